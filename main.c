@@ -116,14 +116,19 @@ int main(int argc, char *argv[]) {
     hz_sequence_load_utf8_zt(section, (const hz_char *) text);
     hz_shape_full(ctx, section);
 
+    // positions in 26.6 pixels, the font is scaled to the FreeType size
+    hz_glyph_position_t *positions = malloc(section->length * sizeof(hz_glyph_position_t));
+    hz_sequence_get_positions(section, font, positions);
 
     uint8_t *image = malloc(WIDTH * HEIGHT);
     memset(image,0, WIDTH * HEIGHT);
 
     int xpos = 400, ypos = 100;
 
-    hz_sequence_node_t *node = ctx->dir == HZ_DIRECTION_RTL ? hz_sequence_last_node(section->root) : section->root;
-    while (node != NULL) {
+    size_t i;
+    for (i = 0; i < section->length; ++i) {
+        size_t index = ctx->dir == HZ_DIRECTION_RTL ? section->length - 1 - i : i;
+        hz_sequence_node_t *node = &section->nodes[index];
         FT_GlyphSlot slot = ft_face->glyph;
         FT_Glyph glyph;
 
@@ -133,10 +138,10 @@ int main(int argc, char *argv[]) {
 
         unsigned int w = slot->bitmap.width;
         unsigned int h = slot->bitmap.rows;
-        int xb = slot->bitmap_left >> 6;
-        int yb = slot->bitmap_top >> 6;
-        int xo = node->x_offset >> 6;
-        int yo = node->y_offset >> 6;
+        int xb = slot->bitmap_left;
+        int yb = slot->bitmap_top;
+        int xo = positions[index].x_offset >> 6;
+        int yo = positions[index].y_offset >> 6;
 
         uint16_t x0 = xpos + xo + xb;
         uint16_t y0 = ypos + yo + (h - yb);
@@ -160,10 +165,11 @@ int main(int argc, char *argv[]) {
 
 //        FT_Done_Glyph(glyph);
 
-        xpos += node->x_advance;
-        node = ctx->dir == HZ_DIRECTION_RTL ? node->prev : node->next;
+        xpos += positions[index].x_advance >> 6;
     }
 
+    free(positions);
+
     stbi_write_bmp("./example.bmp", WIDTH, HEIGHT, 1, image);
     free(image);
 
@@ -2,6 +2,7 @@
 #define HZ_BASE_H
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -94,6 +95,19 @@ static uint32_t bswap32(uint32_t val)
     return res;
 }
 
+static unsigned int
+hz_popcount64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned int) __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
 #define HZ_TRUE 1
 #define HZ_FALSE 0
 
@@ -1,4 +1,5 @@
 #include "hz-face.h"
+#include "hz-ot.h"
 
 typedef struct hz_face_table_node_t hz_face_table_node_t;
 
@@ -15,6 +16,7 @@ struct hz_face_tables_t {
 struct hz_face_t {
     hz_face_tables_t tables;
     hz_face_ot_tables_t ot_tables;
+    hz_ot_layout_t *ot_layout;
 
     uint16_t num_glyphs;
     uint16_t num_of_h_metrics;
@@ -41,13 +43,27 @@ hz_face_create()
     face->linegap = 0;
     face->upem = 0;
     face->tables.root = NULL;
+    face->ot_layout = NULL;
     return face;
 }
 
 void
 hz_face_destroy(hz_face_t *face)
 {
+    hz_face_table_node_t *node = face->tables.root;
+
+    while (node != NULL) {
+        hz_face_table_node_t *next = node->next;
+        hz_blob_destroy(node->blob);
+        HZ_FREE(node);
+        node = next;
+    }
+
+    if (face->ot_layout != NULL)
+        hz_ot_layout_destroy(face->ot_layout);
 
+    HZ_FREE(face->metrics);
+    HZ_FREE(face);
 }
 
 uint16_t
@@ -200,6 +216,18 @@ hz_face_get_ot_tables(hz_face_t *face)
    return &face->ot_tables;
 }
 
+void
+hz_face_set_ot_layout(hz_face_t *face, hz_ot_layout_t *layout)
+{
+    face->ot_layout = layout;
+}
+
+const hz_ot_layout_t *
+hz_face_get_ot_layout(hz_face_t *face)
+{
+    return face->ot_layout;
+}
+
 void
 hz_face_alloc_metrics(hz_face_t *face) {
     if (face->metrics == NULL)
@@ -10,6 +10,7 @@ extern "C" {
 
 typedef struct hz_face_tables_t hz_face_tables_t;
 typedef struct hz_face_t hz_face_t;
+typedef struct hz_ot_layout_t hz_ot_layout_t;
 
 typedef struct hz_face_ot_tables_t {
     hz_byte_t *BASE_table;
@@ -70,6 +71,12 @@ hz_face_set_ot_tables(hz_face_t *face, const hz_face_ot_tables_t *tables);
 const hz_face_ot_tables_t *
 hz_face_get_ot_tables(hz_face_t *face);
 
+void
+hz_face_set_ot_layout(hz_face_t *face, hz_ot_layout_t *layout);
+
+const hz_ot_layout_t *
+hz_face_get_ot_layout(hz_face_t *face);
+
 void
 hz_face_alloc_metrics(hz_face_t *face);
 
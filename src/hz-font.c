@@ -1,5 +1,11 @@
 #include "hz-font.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct hz_font_t {
     hz_face_t *face;
 
@@ -14,8 +20,24 @@ struct hz_font_t {
 };
 
 static hz_position
-em_mult(int16_t v, int64_t mult) {
-    return (hz_position) ((v * mult) >> 16);
+em_mult(int32_t v, int64_t mult) {
+    return (hz_position) ((v * mult + 0x8000) >> 16);
+}
+
+/* the multipliers map font units to the scale in 16.16, so scaling a position
+ * is one multiply and shift */
+static void
+hz_font_update_mults(hz_font_t *font)
+{
+    uint16_t upem = font->face != NULL ? hz_face_get_upem(font->face) : 0;
+
+    if (!upem) {
+        font->x_mult = font->y_mult = 0;
+        return;
+    }
+
+    font->x_mult = (int64_t) font->x_scale * 65536 / upem;
+    font->y_mult = (int64_t) font->y_scale * 65536 / upem;
 }
 
 static float
@@ -33,6 +55,8 @@ hz_font_create()
     font->ptem = 12.0f;
     font->x_scale = 0;
     font->y_scale = 0;
+    font->x_mult = 0;
+    font->y_mult = 0;
     return font;
 }
 
@@ -46,6 +70,124 @@ void
 hz_font_set_face(hz_font_t *font, hz_face_t *face)
 {
     font->face = face;
+
+    /* unscaled fonts position in font units */
+    if (face != NULL && !font->x_scale && !font->y_scale)
+        font->x_scale = font->y_scale = hz_face_get_upem(face);
+
+    hz_font_update_mults(font);
+}
+
+void
+hz_font_set_scale(hz_font_t *font, int32_t x_scale, int32_t y_scale)
+{
+    font->x_scale = x_scale;
+    font->y_scale = y_scale;
+    hz_font_update_mults(font);
+}
+
+void
+hz_font_get_scale(const hz_font_t *font, int32_t *x_scale, int32_t *y_scale)
+{
+    *x_scale = font->x_scale;
+    *y_scale = font->y_scale;
+}
+
+void
+hz_font_set_ppem(hz_font_t *font, uint32_t x_ppem, uint32_t y_ppem)
+{
+    font->x_ppem = x_ppem;
+    font->y_ppem = y_ppem;
+}
+
+void
+hz_font_get_ppem(const hz_font_t *font, uint32_t *x_ppem, uint32_t *y_ppem)
+{
+    *x_ppem = font->x_ppem;
+    *y_ppem = font->y_ppem;
+}
+
+void
+hz_font_set_ptem(hz_font_t *font, float ptem)
+{
+    font->ptem = ptem;
+}
+
+float
+hz_font_get_ptem(const hz_font_t *font)
+{
+    return font->ptem;
+}
+
+#if !defined(__AVX2__) && defined(__SSE2__)
+/* signed 32x32 to 64-bit multiply of the even lanes, SSE2 only has the
+ * unsigned one so the products are corrected by the signs of the factors */
+static __m128i
+hz_mul_epi32_sse2(__m128i a, __m128i b)
+{
+    __m128i a_sign = _mm_shuffle_epi32(_mm_srai_epi32(a, 31), _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i b_sign = _mm_shuffle_epi32(_mm_srai_epi32(b, 31), _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i product = _mm_mul_epu32(a, b);
+
+    product = _mm_sub_epi64(product, _mm_and_si128(a_sign, _mm_slli_epi64(b, 32)));
+    return _mm_sub_epi64(product, _mm_and_si128(b_sign, _mm_slli_epi64(a, 32)));
+}
+#endif
+
+void
+hz_font_scale_positions(const hz_font_t *font, hz_glyph_position_t *positions, size_t count)
+{
+    const int64_t x_mult = font->x_mult, y_mult = font->y_mult;
+    size_t i = 0;
+
+    /* the even lanes of a position are x values and the odd ones y values,
+     * each lane is widened to a 64-bit product and shifted back like em_mult.
+     * Only multipliers that fit 32 bits are vectorized. */
+#if defined(__AVX2__)
+    if (x_mult == (int32_t) x_mult && y_mult == (int32_t) y_mult) {
+        __m256i xm = _mm256_set1_epi32((int32_t) x_mult);
+        __m256i ym = _mm256_set1_epi32((int32_t) y_mult);
+        __m256i round = _mm256_set1_epi64x(0x8000);
+        __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+
+        for (; i + 2 <= count; i += 2) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (positions + i));
+            __m256i x = _mm256_mul_epi32(v, xm);
+            __m256i y = _mm256_mul_epi32(_mm256_srli_epi64(v, 32), ym);
+
+            x = _mm256_srli_epi64(_mm256_add_epi64(x, round), 16);
+            y = _mm256_srli_epi64(_mm256_add_epi64(y, round), 16);
+            _mm256_storeu_si256((__m256i *) (positions + i),
+                                _mm256_or_si256(_mm256_and_si256(x, low),
+                                                _mm256_slli_epi64(y, 32)));
+        }
+    }
+#elif defined(__SSE2__)
+    if (x_mult == (int32_t) x_mult && y_mult == (int32_t) y_mult) {
+        __m128i xm = _mm_set1_epi32((int32_t) x_mult);
+        __m128i ym = _mm_set1_epi32((int32_t) y_mult);
+        __m128i round = _mm_set_epi32(0, 0x8000, 0, 0x8000);
+        __m128i low = _mm_set_epi32(0, -1, 0, -1);
+
+        for (; i < count; ++i) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (positions + i));
+            __m128i x = hz_mul_epi32_sse2(v, xm);
+            __m128i y = hz_mul_epi32_sse2(_mm_srli_epi64(v, 32), ym);
+
+            x = _mm_srli_epi64(_mm_add_epi64(x, round), 16);
+            y = _mm_srli_epi64(_mm_add_epi64(y, round), 16);
+            _mm_storeu_si128((__m128i *) (positions + i),
+                             _mm_or_si128(_mm_and_si128(x, low), _mm_slli_epi64(y, 32)));
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        positions[i].x_offset = em_mult(positions[i].x_offset, x_mult);
+        positions[i].y_offset = em_mult(positions[i].y_offset, y_mult);
+        positions[i].x_advance = em_mult(positions[i].x_advance, x_mult);
+        positions[i].y_advance = em_mult(positions[i].y_advance, y_mult);
+    }
 }
 
 float
@@ -61,7 +203,7 @@ hz_font_em_fscale_y(hz_font_t *font, int16_t v)
 }
 
 hz_face_t *
-hz_font_get_face(hz_font_t *font)
+hz_font_get_face(const hz_font_t *font)
 {
     return font->face;
 }
\ No newline at end of file
@@ -10,6 +10,22 @@ extern "C" {
 
 typedef struct hz_font_t hz_font_t;
 
+/*  Struct: hz_glyph_position_t
+ *      Position of a glyph, in font units or scaled by <hz_font_scale_positions>.
+ *
+ *  Fields:
+ *      x_offset - X offset.
+ *      y_offset - Y offset.
+ *      x_advance - X advance.
+ *      y_advance - Y advance.
+ * */
+typedef struct hz_glyph_position_t {
+    int32_t x_offset;
+    int32_t y_offset;
+    int32_t x_advance;
+    int32_t y_advance;
+} hz_glyph_position_t;
+
 hz_font_t *
 hz_font_create();
 
@@ -17,11 +33,51 @@ void
 hz_font_destroy(hz_font_t *font);
 
 hz_face_t *
-hz_font_get_face(hz_font_t *font);
+hz_font_get_face(const hz_font_t *font);
 
 void
 hz_font_set_face(hz_font_t *font, hz_face_t *face);
 
+/*  Function: hz_font_set_scale
+ *      Sets the size of the em in output units, a scale of ppem * 64 gives
+ *      26.6 pixel positions and ppem << 16 gives 16.16 ones. The scale
+ *      defaults to the face's units per em, leaving positions in font units.
+ *
+ *  Parameters:
+ *      font - The font.
+ *      x_scale - Horizontal scale.
+ *      y_scale - Vertical scale.
+ * */
+void
+hz_font_set_scale(hz_font_t *font, int32_t x_scale, int32_t y_scale);
+
+void
+hz_font_get_scale(const hz_font_t *font, int32_t *x_scale, int32_t *y_scale);
+
+void
+hz_font_set_ppem(hz_font_t *font, uint32_t x_ppem, uint32_t y_ppem);
+
+void
+hz_font_get_ppem(const hz_font_t *font, uint32_t *x_ppem, uint32_t *y_ppem);
+
+void
+hz_font_set_ptem(hz_font_t *font, float ptem);
+
+float
+hz_font_get_ptem(const hz_font_t *font);
+
+/*  Function: hz_font_scale_positions
+ *      Scales positions from font units to the font's scale in place, with the
+ *      16.16 multipliers precomputed from the scale, rounding to nearest.
+ *
+ *  Parameters:
+ *      font - The font.
+ *      positions - Positions in font units.
+ *      count - Number of positions.
+ * */
+void
+hz_font_scale_positions(const hz_font_t *font, hz_glyph_position_t *positions, size_t count);
+
 float
 hz_font_em_fscale_x(hz_font_t *font, int16_t v);
 
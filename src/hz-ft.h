@@ -35,6 +35,7 @@ hz_ft_font_create(FT_Face ft_face) {
             HZ_TAG('m','a','x','p'),
             HZ_TAG('g','l','y','f'),
             HZ_TAG('h','m','t','x'),
+            HZ_TAG('k','e','r','n'),
     };
 
     size_t tag_index, glyph_index;
@@ -51,13 +52,13 @@ hz_ft_font_create(FT_Face ft_face) {
     FT_Bytes GPOS_table;
     FT_Bytes JSTF_table;
 
-    if (FT_OpenType_Validate(ft_face, FT_VALIDATE_GDEF,
+    /* only the tables shaping reads, BASE, JSTF and MATH often fail the strict
+     * validator. A font whose layout tables fail still shapes, without them. */
+    if (FT_OpenType_Validate(ft_face, FT_VALIDATE_GDEF | FT_VALIDATE_GSUB | FT_VALIDATE_GPOS,
                              &BASE_table, &GDEF_table, &GPOS_table, &GSUB_table, &JSTF_table)
                             != FT_Err_Ok) {
-        HZ_ERROR("Failed to validate OpenType tables!");
-        hz_face_destroy(face);
-        hz_font_destroy(font);
-        return NULL;
+        HZ_ERROR("Failed to validate OpenType tables, shaping without them!\n");
+        BASE_table = GDEF_table = GSUB_table = GPOS_table = JSTF_table = NULL;
     }
 
     ot_tables.BASE_table = (hz_byte_t *)BASE_table;
@@ -78,6 +79,9 @@ hz_ft_font_create(FT_Face ft_face) {
     hz_face_load_num_glyphs(face);
     hz_face_alloc_metrics(face);
 
+    /* compile lookups once, the layout is read-only while shaping */
+    hz_face_set_ot_layout(face, hz_ot_layout_create(face));
+
     for (glyph_index = 0; glyph_index < hz_face_get_num_glyphs(face); ++glyph_index) {
         FT_GlyphSlot slot = ft_face->glyph;
         FT_Load_Glyph(ft_face, glyph_index, FT_LOAD_NO_BITMAP | FT_LOAD_NO_SCALE);
@@ -104,6 +108,15 @@ hz_ft_font_create(FT_Face ft_face) {
     }
 
     hz_font_set_face(font, face);
+
+    /* scale to FreeType's 26.6 pixels if a size was set */
+    if (ft_face->size != NULL && ft_face->size->metrics.x_ppem) {
+        hz_font_set_ppem(font, ft_face->size->metrics.x_ppem, ft_face->size->metrics.y_ppem);
+        hz_font_set_scale(font,
+                          (int32_t) FT_MulFix(ft_face->units_per_EM, ft_face->size->metrics.x_scale),
+                          (int32_t) FT_MulFix(ft_face->units_per_EM, ft_face->size->metrics.y_scale));
+    }
+
     return font;
 //
 //    {
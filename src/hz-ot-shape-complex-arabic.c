@@ -34,11 +34,18 @@ typedef enum hz_joining_dir_t {
     JOINING_PREV
 } hz_joining_dir_t;
 
-hz_sequence_node_t *
-hz_ot_shape_complex_arabic_adjacent_char(hz_sequence_node_t *node, hz_bool_t do_reverse)
+/* looks for the character adjacent to the glyph at the sequence's cursor,
+ * preceding characters have already been written to the output */
+const hz_sequence_node_t *
+hz_ot_shape_complex_arabic_adjacent_char(const hz_sequence_t *sequence, hz_bool_t do_reverse)
 {
-    hz_sequence_node_t *curr_node = do_reverse ? node->prev : node->next;
-    while (curr_node != NULL) {
+    size_t index = do_reverse ? sequence->out_length : sequence->cursor + 1;
+    size_t end = do_reverse ? 0 : sequence->length;
+
+    while (index != end) {
+        const hz_sequence_node_t *curr_node = do_reverse
+            ? &sequence->out_nodes[index - 1]
+            : &sequence->nodes[index];
         hz_unicode_t code = curr_node->codepoint;
         hz_glyph_class_t glyph_class = curr_node->gc;
 
@@ -52,22 +59,22 @@ hz_ot_shape_complex_arabic_adjacent_char(hz_sequence_node_t *node, hz_bool_t do_
         }
 
         if (glyph_class & ~HZ_GLYPH_CLASS_MARK) {
-            /* glyph is anything else than a mark, return NULL */
-            break;
+            /* glyph is anything else than a mark, return it */
+            return curr_node;
         }
 
-        curr_node = do_reverse ? curr_node->prev : curr_node->next;
+        index = do_reverse ? index - 1 : index + 1;
     }
 
-    return curr_node;
+    return NULL;
 }
 
 uint16_t
-hz_ot_shape_complex_arabic_joining(hz_sequence_node_t *node, hz_bool_t do_reverse)
+hz_ot_shape_complex_arabic_joining(const hz_sequence_t *sequence, hz_bool_t do_reverse)
 {
     uint16_t joining;
     hz_unicode_t codepoint;
-    hz_sequence_node_t *adj = hz_ot_shape_complex_arabic_adjacent_char(node, do_reverse);
+    const hz_sequence_node_t *adj = hz_ot_shape_complex_arabic_adjacent_char(sequence, do_reverse);
 
     if (adj == NULL)
         goto no_adjacent;
@@ -82,14 +89,15 @@ hz_ot_shape_complex_arabic_joining(hz_sequence_node_t *node, hz_bool_t do_revers
 }
 
 hz_bool_t
-hz_ot_shape_complex_arabic_join(hz_feature_t feature, hz_sequence_node_t *node)
+hz_ot_shape_complex_arabic_join(hz_feature_t feature, const hz_sequence_t *sequence)
 {
+    const hz_sequence_node_t *node = &sequence->nodes[sequence->cursor];
     uint16_t curr;
 
     if (hz_ot_shape_complex_arabic_char_joining(node->codepoint, &curr)) {
         uint16_t prev, next;
-        prev = hz_ot_shape_complex_arabic_joining(node, HZ_TRUE);
-        next = hz_ot_shape_complex_arabic_joining(node, HZ_FALSE);
+        prev = hz_ot_shape_complex_arabic_joining(sequence, HZ_TRUE);
+        next = hz_ot_shape_complex_arabic_joining(sequence, HZ_FALSE);
 
         /* Conditions for substitution */
         hz_bool_t fina = curr & (JOINING_TYPE_R | JOINING_TYPE_D)
@@ -114,4 +122,30 @@ hz_ot_shape_complex_arabic_join(hz_feature_t feature, hz_sequence_node_t *node)
     }
 
     return HZ_FALSE;
-}
\ No newline at end of file
+}
+
+void
+hz_ot_shape_complex_arabic_flag_joins(hz_sequence_t *sequence)
+{
+    size_t prev = 0, index;
+    uint16_t prev_joining = JOINING_TYPE_U;
+
+    for (index = 0; index < sequence->length; ++index) {
+        const hz_sequence_node_t *node = &sequence->nodes[index];
+        uint16_t joining;
+
+        if (!hz_ot_shape_complex_arabic_char_joining(node->codepoint, &joining))
+            joining = JOINING_TYPE_U;
+
+        /* marks are transparent */
+        if (node->gc & HZ_GLYPH_CLASS_MARK || joining & JOINING_TYPE_T)
+            continue;
+
+        if (joining & (JOINING_TYPE_R | JOINING_TYPE_D)
+            && prev_joining & (JOINING_TYPE_L | JOINING_TYPE_D | JOINING_TYPE_C))
+            hz_sequence_set_unsafe_to_break(sequence, prev, index + 1);
+
+        prev = index;
+        prev_joining = joining;
+    }
+}
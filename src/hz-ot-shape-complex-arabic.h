@@ -137,6 +137,16 @@ typedef struct hz_arabic_joining_entry_t {
 #include "hz-ot-shape-complex-arabic-joining-list.h"
 
 hz_bool_t
-hz_ot_shape_complex_arabic_join(hz_feature_t feature, hz_sequence_node_t *node);
+hz_ot_shape_complex_arabic_join(hz_feature_t feature, const hz_sequence_t *sequence);
+
+/*  Function: hz_ot_shape_complex_arabic_flag_joins
+ *      Flags the letters joining the letter before them unsafe to break, the
+ *      forms of both letters depend on the join. Marks in between are flagged too.
+ *
+ *  Parameters:
+ *      sequence - Sequence with glyph classes set up.
+ * */
+void
+hz_ot_shape_complex_arabic_flag_joins(hz_sequence_t *sequence);
 
 #endif /* HZ_OT_SHAPE_COMPLEX_ARABIC_H */
@@ -431,16 +431,32 @@ hz_ot_layout_gather_glyphs(hz_face_t *face,
     return HZ_TRUE;
 }
 
+/* whether the GPOS lookup attaches marks, which moves them by their offsets
+ * and leaves every advance as it is */
+static hz_bool_t
+hz_lookup_table_is_mark_attachment(const hz_lookup_table_t *lookup)
+{
+    return lookup->lookup_type == HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT
+        || lookup->lookup_type == HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT
+        || lookup->lookup_type == HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT;
+}
+
 hz_bool_t
 hz_ot_layout_apply_gsub_features(hz_face_t *face,
                                  hz_tag_t script,
                                  hz_tag_t language,
                                  const hz_array_t *wanted_features,
+                                 const uint64_t *active_glyphs,
                                  hz_sequence_t *sect)
 {
     HZ_ASSERT(face != NULL);
     HZ_ASSERT(wanted_features != NULL);
 
+    /* lookups were compiled when the face was loaded */
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    if (layout == NULL)
+        return HZ_FALSE;
+
     hz_stream_t *table = hz_stream_create(hz_face_get_ot_tables(face)->GSUB_table, 0, 0);
     uint32_t version;
     uint16_t script_list_offset;
@@ -510,24 +526,6 @@ hz_ot_layout_apply_gsub_features(hz_face_t *face,
 //        ++loopIndex;
 //    }
 
-    hz_array_t *lookup_offsets = hz_array_create();
-    hz_stream_t *lookup_list = hz_stream_create(table->data + lookup_list_offset, 0, 0);
-    {
-        {
-            /* Read lookup offets to table */
-            uint16_t lookup_count;
-            uint16_t lookup_index = 0;
-            hz_stream_read16(lookup_list, &lookup_count);
-            while (lookup_index < lookup_count) {
-                uint16_t lookup_offset;
-                hz_stream_read16(lookup_list, &lookup_offset);
-                hz_array_push_back(lookup_offsets, lookup_offset);
-                ++lookup_index;
-            }
-        }
-    }
-
-
     hz_stream_t *feature_list = hz_stream_create(table->data + feature_list_offset, 0, 0);
 
 
@@ -564,10 +562,10 @@ hz_ot_layout_apply_gsub_features(hz_face_t *face,
 
                 int i = 0;
                 while (i < hz_array_size(lookup_indices)) {
-                    uint16_t lookup_offset = hz_array_at(lookup_offsets, hz_array_at(lookup_indices, i));
-                    hz_stream_t *lookup_table = hz_stream_create(lookup_list->data + lookup_offset, 0, 0);
-                    hz_ot_layout_apply_gsub_lookup(face, lookup_table, wanted_feature, sect);
-                    hz_stream_destroy(lookup_table);
+                    uint16_t lookup_index = hz_array_at(lookup_indices, i);
+                    if (lookup_index < layout->gsub_lookup_count)
+                        hz_ot_layout_apply_gsub_lookup(face, &layout->gsub_lookups[lookup_index],
+                                                       wanted_feature, active_glyphs, sect);
                     ++i;
                 }
 
@@ -581,9 +579,7 @@ hz_ot_layout_apply_gsub_features(hz_face_t *face,
         hz_map_destroy(feature_map);
     }
 
-    hz_stream_destroy(lookup_list);
     hz_stream_destroy(feature_list);
-    hz_array_destroy(lookup_offsets);
     hz_stream_destroy(table);
     return HZ_TRUE;
 }
@@ -593,11 +589,18 @@ hz_ot_layout_apply_gpos_features(hz_face_t *face,
                                  hz_tag_t script,
                                  hz_tag_t language,
                                  const hz_array_t *wanted_features,
+                                 const uint64_t *active_glyphs,
+                                 hz_bool_t advances_only,
                                  hz_sequence_t *sect)
 {
     HZ_ASSERT(face != NULL);
     HZ_ASSERT(wanted_features != NULL);
 
+    /* lookups were compiled when the face was loaded */
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    if (layout == NULL)
+        return HZ_FALSE;
+
     hz_stream_t *table = hz_stream_create(hz_face_get_ot_tables(face)->GPOS_table, 0,0);
     uint32_t version;
     uint16_t script_list_offset;
@@ -661,23 +664,6 @@ hz_ot_layout_apply_gpos_features(hz_face_t *face,
         ++loopIndex;
     }
 
-    hz_stream_t *lookup_list = hz_stream_create(table->data + lookup_list_offset, 0, 0);
-    hz_array_t *lookup_offsets = hz_array_create();
-
-    {
-        /* Read lookup offets to table */
-        uint16_t lookup_count;
-        uint16_t lookup_index = 0;
-        hz_stream_read16(lookup_list, &lookup_count);
-        while (lookup_index < lookup_count) {
-            uint16_t lookup_offset;
-            hz_stream_read16(lookup_list, &lookup_offset);
-            hz_array_push_back(lookup_offsets, lookup_offset);
-            ++lookup_index;
-        }
-    }
-
-
     hz_stream_t *feature_list = hz_stream_create(table->data + feature_list_offset, 0, 0);
 
 
@@ -714,10 +700,11 @@ hz_ot_layout_apply_gpos_features(hz_face_t *face,
 
                 int i = 0;
                 while (i < hz_array_size(lookup_indices)) {
-                    uint16_t lookup_offset = hz_array_at(lookup_offsets, hz_array_at(lookup_indices, i));
-                    hz_stream_t *lookup_table = hz_stream_create(lookup_list->data + lookup_offset, 0, 0);
-                    hz_ot_layout_apply_gpos_lookup(face, lookup_table, wanted_feature, sect);
-                    hz_stream_destroy(lookup_table);
+                    uint16_t lookup_index = hz_array_at(lookup_indices, i);
+                    if (lookup_index < layout->gpos_lookup_count
+                        && !(advances_only && hz_lookup_table_is_mark_attachment(&layout->gpos_lookups[lookup_index])))
+                        hz_ot_layout_apply_gpos_lookup(face, &layout->gpos_lookups[lookup_index],
+                                                       wanted_feature, active_glyphs, sect);
                     ++i;
                 }
 
@@ -731,8 +718,9 @@ hz_ot_layout_apply_gpos_features(hz_face_t *face,
         hz_map_destroy(feature_map);
     }
 
-    hz_array_destroy(lookup_offsets);
-    hz_stream_destroy(lookup_list);
+    hz_array_destroy(lang_feature_indices);
+    hz_stream_destroy(feature_list);
+    hz_stream_destroy(lsbuf);
     hz_stream_destroy(table);
     return HZ_TRUE;
 }
@@ -757,1058 +745,3995 @@ hz_ot_layout_lookup_would_substitute(hz_face_t *face,
 }
 
 
-hz_bool_t
-hz_ot_layout_parse_coverage(const uint8_t *data,
-                            hz_map_t *map,
-                            hz_array_t *id_arr)
+/* a bitmap word costs 10 bytes and covers 64 glyph ids, only build one when
+ * the coverage is dense enough for it to stay close to the size of the glyph array
+ * */
+#define HZ_COVERAGE_BITMAP_MIN_GLYPHS 16
+#define HZ_COVERAGE_BITMAP_MAX_SPREAD 8
+
+static void
+hz_coverage_build_bitmap(hz_coverage_t *coverage,
+                         hz_index_t first,
+                         hz_index_t last,
+                         uint32_t glyph_count)
+{
+    uint32_t span = (uint32_t) last - first + 1;
+    uint32_t word_count = (span + 63) / 64;
+    uint32_t word_index, rank = 0;
+
+    if (glyph_count < HZ_COVERAGE_BITMAP_MIN_GLYPHS || span > glyph_count * HZ_COVERAGE_BITMAP_MAX_SPREAD)
+        return;
+
+    coverage->first = first;
+    coverage->span = span;
+    coverage->bitmap = calloc(word_count, sizeof(uint64_t));
+    coverage->ranks = HZ_MALLOC(word_count * sizeof(uint16_t));
+
+    if (coverage->format == 1) {
+        uint16_t i;
+        for (i = 0; i < coverage->count; ++i) {
+            uint32_t offset = (uint32_t) coverage->glyphs[i] - first;
+            if (offset < span)
+                coverage->bitmap[offset >> 6] |= (uint64_t) 1 << (offset & 63);
+        }
+    } else {
+        uint16_t i;
+        for (i = 0; i < coverage->count; ++i) {
+            uint32_t offset = (uint32_t) coverage->ranges[i].start_glyph_id - first;
+            uint32_t end = (uint32_t) coverage->ranges[i].end_glyph_id - first;
+            for (; offset <= end && offset < span; ++offset)
+                coverage->bitmap[offset >> 6] |= (uint64_t) 1 << (offset & 63);
+        }
+    }
+
+    for (word_index = 0; word_index < word_count; ++word_index) {
+        coverage->ranks[word_index] = rank;
+        rank += hz_popcount64(coverage->bitmap[word_index]);
+    }
+}
+
+hz_coverage_t *
+hz_coverage_create(const uint8_t *data)
 {
-    uint16_t coverage_format = 0;
+    hz_coverage_t *coverage;
     hz_stream_t *table = hz_stream_create(data,0,0);
+    uint16_t format;
+
+    hz_stream_read16(table, &format);
+
+    if (format != 1 && format != 2) {
+        /* error */
+        hz_stream_destroy(table);
+        return NULL;
+    }
 
-    hz_stream_read16(table, &coverage_format);
-
-    switch (coverage_format) {
-        case 1: {
-            uint16_t coverage_idx = 0;
-            uint16_t coverage_glyph_count;
-            hz_stream_read16(table, &coverage_glyph_count);
-            while (coverage_idx < coverage_glyph_count) {
-                uint16_t glyph_index;
-                hz_stream_read16(table, &glyph_index);
-//                hz_array_push_back(coverage_glyphs, glyph_index);
-                if (id_arr != NULL)
-                    hz_map_set_value(map, glyph_index, hz_array_at(id_arr, coverage_idx));
-                else
-                    hz_map_set_value(map, glyph_index, coverage_idx);
-
-                ++coverage_idx;
+    coverage = HZ_ALLOC(hz_coverage_t);
+    coverage->format = format;
+    coverage->glyphs = NULL;
+    coverage->ranges = NULL;
+    coverage->first = 0;
+    coverage->span = 0;
+    coverage->bitmap = NULL;
+    coverage->ranks = NULL;
+    hz_stream_read16(table, &coverage->count);
+
+    if (format == 1) {
+        uint16_t i;
+        hz_bool_t is_sorted = HZ_TRUE;
+
+        coverage->glyphs = HZ_MALLOC(coverage->count * sizeof(hz_index_t));
+        hz_stream_read16_n(table, coverage->count, coverage->glyphs);
+
+        /* the bitmap spans the first to the last glyph, a malformed coverage out of
+         * order is left to the binary search */
+        for (i = 1; i < coverage->count; ++i)
+            if (coverage->glyphs[i] <= coverage->glyphs[i - 1])
+                is_sorted = HZ_FALSE;
+
+        if (coverage->count && is_sorted)
+            hz_coverage_build_bitmap(coverage, coverage->glyphs[0],
+                                     coverage->glyphs[coverage->count - 1],
+                                     coverage->count);
+    } else {
+        uint16_t range_index;
+        uint32_t glyph_count = 0;
+        hz_bool_t is_sequential = HZ_TRUE, is_sorted = HZ_TRUE;
+
+        coverage->ranges = HZ_MALLOC(coverage->count * sizeof(hz_range_rec_t));
+
+        for (range_index = 0; range_index < coverage->count; ++range_index) {
+            hz_range_rec_t *range = &coverage->ranges[range_index];
+            hz_stream_read16(table, &range->start_glyph_id);
+            hz_stream_read16(table, &range->end_glyph_id);
+            hz_stream_read16(table, &range->start_coverage_index);
+
+            /* the bitmap derives indices from ranks, only valid if indices follow glyph order */
+            if (range->start_coverage_index != glyph_count)
+                is_sequential = HZ_FALSE;
+
+            /* and the span from the first to the last range only holds them all
+             * if they're sorted and don't overlap */
+            if (range->start_glyph_id > range->end_glyph_id
+                || (range_index > 0 && range->start_glyph_id <= coverage->ranges[range_index - 1].end_glyph_id)) {
+                is_sorted = HZ_FALSE;
+                continue;
             }
 
-            break;
+            glyph_count += range->end_glyph_id - range->start_glyph_id + 1;
+        }
+
+        if (coverage->count && is_sequential && is_sorted)
+            hz_coverage_build_bitmap(coverage, coverage->ranges[0].start_glyph_id,
+                                     coverage->ranges[coverage->count - 1].end_glyph_id,
+                                     glyph_count);
+    }
+
+    hz_stream_destroy(table);
+    return coverage;
+}
+
+void
+hz_coverage_destroy(hz_coverage_t *coverage)
+{
+    if (coverage != NULL) {
+        HZ_FREE(coverage->glyphs);
+        HZ_FREE(coverage->ranges);
+        HZ_FREE(coverage->bitmap);
+        HZ_FREE(coverage->ranks);
+        HZ_FREE(coverage);
+    }
+}
+
+int32_t
+hz_coverage_search(const hz_coverage_t *coverage, hz_index_t id)
+{
+    if (coverage->span) {
+        /* ids below the first glyph wrap around and fail the span check */
+        uint32_t offset = (uint32_t) id - coverage->first;
+
+        if (offset < coverage->span) {
+            uint64_t word = coverage->bitmap[offset >> 6];
+            uint64_t bit = (uint64_t) 1 << (offset & 63);
+
+            if (word & bit)
+                return coverage->ranks[offset >> 6] + hz_popcount64(word & (bit - 1));
         }
 
-        case 2: {
-            uint16_t range_index = 0, range_count;
-            hz_stream_read16(table, &range_count);
+        return -1;
+    }
 
-            /* Assuming ranges are ordered from 0 to glyph_count in order */
-            while (range_index < range_count) {
-                hz_index_t from, to;
-                hz_range_rec_t range;
-                uint16_t range_offset;
-                uint32_t range_end;
+    if (coverage->format == 1) {
+        const hz_index_t *base = coverage->glyphs;
+        uint32_t n = coverage->count;
 
-                hz_stream_read16(table, &range.start_glyph_id);
-                hz_stream_read16(table, &range.end_glyph_id);
-                hz_stream_read16(table, &range.start_coverage_index);
+        if (!n) return -1;
 
-                range_offset = 0;
-                range_end = (range.end_glyph_id - range.start_glyph_id);
-                while (range_offset <= range_end) {
-                    from = range.start_glyph_id + range_offset;
+        /* branchless lower bound, the loop only depends on n */
+        while (n > 1) {
+            uint32_t half = n >> 1;
+            base = (base[half] <= id) ? base + half : base;
+            n -= half;
+        }
 
-                    if (id_arr != NULL)
-                        to = hz_array_at(id_arr, range.start_coverage_index + range_offset);
-                    else
-                        to = range.start_coverage_index + range_offset;
+        return (*base == id) ? (int32_t) (base - coverage->glyphs) : -1;
+    } else {
+        const hz_range_rec_t *base = coverage->ranges;
+        uint32_t n = coverage->count;
 
-                    hz_map_set_value(map, from, to);
+        if (!n) return -1;
 
-//                    HZ_LOG("%d -> %d\n", from, to);
-                    ++range_offset;
-                }
+        while (n > 1) {
+            uint32_t half = n >> 1;
+            base = (base[half].start_glyph_id <= id) ? base + half : base;
+            n -= half;
+        }
 
-                ++range_index;
-            }
-            break;
+        if (id >= base->start_glyph_id && id <= base->end_glyph_id)
+            return base->start_coverage_index + (id - base->start_glyph_id);
+
+        return -1;
+    }
+}
+
+/* like coverages, a dense class array is only worth it when the table doesn't
+ * span more than eight glyph ids per classified glyph
+ * */
+#define HZ_CLASS_DEF_DENSE_MAX_SPAN_PER_GLYPH 8
+
+hz_class_def_t *
+hz_class_def_create(const uint8_t *data)
+{
+    hz_stream_t *table = hz_stream_create(data, 0, 0);
+    hz_class_def_t *class_def;
+    uint16_t format;
+
+    hz_stream_read16(table, &format);
+
+    if (format != 1 && format != 2) {
+        hz_stream_destroy(table);
+        return NULL;
+    }
+
+    class_def = HZ_ALLOC(hz_class_def_t);
+    class_def->first = 0;
+    class_def->count = 0;
+    class_def->classes = NULL;
+    class_def->range_count = 0;
+    class_def->ranges = NULL;
+
+    if (format == 1) {
+        uint16_t glyph_count;
+        hz_stream_read16(table, &class_def->first);
+        hz_stream_read16(table, &glyph_count);
+        class_def->count = glyph_count;
+        class_def->classes = HZ_MALLOC((glyph_count ? glyph_count : 1) * sizeof(uint16_t));
+        hz_stream_read16_n(table, glyph_count, class_def->classes);
+    } else {
+        uint16_t range_index;
+        uint32_t glyph_total = 0, span = 0;
+        struct hz_class_range_rec_t *ranges;
+
+        hz_stream_read16(table, &class_def->range_count);
+        ranges = HZ_MALLOC((class_def->range_count ? class_def->range_count : 1)
+                           * sizeof(struct hz_class_range_rec_t));
+
+        for (range_index = 0; range_index < class_def->range_count; ++range_index) {
+            struct hz_class_range_rec_t *range = &ranges[range_index];
+            hz_stream_read16(table, &range->startGlyphID);
+            hz_stream_read16(table, &range->endGlyphID);
+            hz_stream_read16(table, &range->classValue);
+
+            if (range->endGlyphID >= range->startGlyphID)
+                glyph_total += range->endGlyphID - range->startGlyphID + 1;
         }
 
-        default:
-            /* error */
-            break;
+        if (class_def->range_count) {
+            hz_index_t last = ranges[class_def->range_count - 1].endGlyphID;
+            class_def->first = ranges[0].startGlyphID;
+            span = last >= class_def->first ? (uint32_t) last - class_def->first + 1 : 0;
+        }
+
+        if (span && span <= glyph_total * HZ_CLASS_DEF_DENSE_MAX_SPAN_PER_GLYPH) {
+            /* expand ranges into a dense array, gaps are class 0 */
+            class_def->count = span;
+            class_def->classes = HZ_MALLOC(span * sizeof(uint16_t));
+            memset(class_def->classes, 0, span * sizeof(uint16_t));
+
+            for (range_index = 0; range_index < class_def->range_count; ++range_index) {
+                const struct hz_class_range_rec_t *range = &ranges[range_index];
+                uint32_t id;
+
+                for (id = range->startGlyphID; id <= range->endGlyphID && id - class_def->first < span; ++id)
+                    class_def->classes[id - class_def->first] = range->classValue;
+            }
+
+            class_def->range_count = 0;
+            HZ_FREE(ranges);
+        } else {
+            class_def->ranges = ranges;
+        }
     }
 
     hz_stream_destroy(table);
-    return HZ_TRUE;
+    return class_def;
 }
 
-hz_sequence_node_t *
-hz_prev_node_not_of_class(hz_sequence_node_t *g,
-                          hz_glyph_class_t gcignore,
-                          int *skip)
+void
+hz_class_def_destroy(hz_class_def_t *class_def)
 {
-    if (gcignore == HZ_GLYPH_CLASS_ZERO) {
-        /* if no ignored classes, just give the next glyph directly as an optimization */
-        if (skip != NULL) (* skip) --;
-        return g->prev;
+    if (class_def != NULL) {
+        HZ_FREE(class_def->classes);
+        HZ_FREE(class_def->ranges);
+        HZ_FREE(class_def);
     }
+}
 
-    while (1) {
-        if (skip != NULL) (* skip) --;
-        g = g->prev;
+uint16_t
+hz_class_def_get(const hz_class_def_t *class_def, hz_index_t id)
+{
+    if (class_def == NULL)
+        return 0;
+
+    if (class_def->classes != NULL) {
+        uint32_t index = (uint32_t) id - class_def->first;
+        return index < class_def->count ? class_def->classes[index] : 0;
+    } else if (class_def->range_count) {
+        /* branchless lower bound over the ranges start glyph ids */
+        const struct hz_class_range_rec_t *base = class_def->ranges;
+        uint32_t n = class_def->range_count;
+
+        while (n > 1) {
+            uint32_t half = n >> 1;
+            base = (base[half].startGlyphID <= id) ? base + half : base;
+            n -= half;
+        }
 
-        /* break if prev node is NULL, cannot keep searching */
-        if (g == NULL)
-            break;
+        if (id >= base->startGlyphID && id <= base->endGlyphID)
+            return base->classValue;
+    }
 
-        /* if not any of the class flags set, break, as we found what we want */
-        if (~g->gc & gcignore)
-            break;
+    return 0;
+}
+
+/* SingleSubst subtable of either format, format 1 keeps its delta and format 2
+ * its substitutes indexed like the coverage.
+ * */
+struct hz_single_subst_t {
+    hz_coverage_t *coverage;
+    int16_t delta;
+    uint16_t substitute_count;
+    hz_index_t *substitutes;
+};
+
+static hz_single_subst_t *
+hz_single_subst_create(const hz_byte_t *data)
+{
+    hz_single_subst_t *subst = HZ_ALLOC(hz_single_subst_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    uint16_t format;
+    hz_offset16_t coverage_offset;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &coverage_offset);
+    subst->coverage = hz_coverage_create(data + coverage_offset);
+    subst->delta = 0;
+    subst->substitute_count = 0;
+    subst->substitutes = NULL;
+
+    if (format == 1) {
+        hz_stream_read16(subtable, (uint16_t *) &subst->delta);
+    } else if (format == 2) {
+        hz_stream_read16(subtable, &subst->substitute_count);
+        subst->substitutes = HZ_MALLOC((subst->substitute_count ? subst->substitute_count : 1)
+                                       * sizeof(hz_index_t));
+        hz_stream_read16_n(subtable, subst->substitute_count, subst->substitutes);
     }
 
-    return g;
+    hz_stream_destroy(subtable);
+    return subst;
+}
+
+static void
+hz_single_subst_destroy(hz_single_subst_t *subst)
+{
+    hz_coverage_destroy(subst->coverage);
+    HZ_FREE(subst->substitutes);
+    HZ_FREE(subst);
 }
 
-hz_sequence_node_t *
-hz_next_node_not_of_class(hz_sequence_node_t *g,
-                          hz_glyph_class_t gcignore,
-                          int *skip)
+/* looks up the substitute of a glyph, returns HZ_FALSE if it is not covered */
+static hz_bool_t
+hz_single_subst_get(const hz_single_subst_t *subst, hz_index_t id, hz_index_t *substitute)
 {
-    if (gcignore == HZ_GLYPH_CLASS_ZERO) {
-        /* if no ignored classes, just give the next glyph directly as an optimization */
-        if (skip != NULL) (* skip) ++;
-        return g->next;
+    int32_t coverage_index;
+
+    if (subst->coverage == NULL)
+        return HZ_FALSE;
+
+    coverage_index = hz_coverage_search(subst->coverage, id);
+    if (coverage_index < 0)
+        return HZ_FALSE;
+
+    if (subst->substitutes == NULL) {
+        /* addition is modulo 65536 */
+        *substitute = (hz_index_t) (id + subst->delta);
+        return HZ_TRUE;
     }
 
-    while (1) {
-        if (skip != NULL) (* skip) ++;
-        g = g->next;
+    if (coverage_index >= subst->substitute_count)
+        return HZ_FALSE;
 
-        /* break if next node is NULL, cannot keep searching */
-        if (g == NULL)
-            break;
+    *substitute = subst->substitutes[coverage_index];
+    return HZ_TRUE;
+}
 
-        /* if not any of the class flags set, break, as we found what we want */
-        if (~g->gc & gcignore)
-            break;
+/* MultipleSubst and AlternateSubst format 1 subtables, both map every covered
+ * glyph to an array of glyphs (a Sequence or an AlternateSet). The arrays are
+ * packed in one buffer.
+ * */
+struct hz_multiple_subst_t {
+    hz_coverage_t *coverage;
+    uint16_t set_count;
+    uint32_t *set_glyphs; /* glyphs of set i are [set_glyphs[i], set_glyphs[i + 1]) */
+    hz_index_t *glyphs;
+};
+
+static hz_multiple_subst_t *
+hz_multiple_subst_create(const hz_byte_t *data)
+{
+    hz_multiple_subst_t *subst = HZ_ALLOC(hz_multiple_subst_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    uint16_t format;
+    hz_offset16_t coverage_offset;
+    hz_offset16_t *set_offsets;
+    uint32_t glyph_count = 0;
+    uint16_t i;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &coverage_offset);
+    hz_stream_read16(subtable, &subst->set_count);
+    subst->coverage = hz_coverage_create(data + coverage_offset);
+
+    set_offsets = HZ_MALLOC((subst->set_count ? subst->set_count : 1) * sizeof(hz_offset16_t));
+    hz_stream_read16_n(subtable, subst->set_count, set_offsets);
+
+    subst->set_glyphs = HZ_MALLOC((subst->set_count + 1) * sizeof(uint32_t));
+    for (i = 0; i < subst->set_count; ++i) {
+        hz_stream_t *set = hz_stream_create(data + set_offsets[i], 0, 0);
+        uint16_t count;
+        hz_stream_read16(set, &count);
+        subst->set_glyphs[i] = glyph_count;
+        glyph_count += count;
+        hz_stream_destroy(set);
     }
+    subst->set_glyphs[subst->set_count] = glyph_count;
+
+    subst->glyphs = HZ_MALLOC((glyph_count ? glyph_count : 1) * sizeof(hz_index_t));
+    for (i = 0; i < subst->set_count; ++i) {
+        hz_stream_t *set = hz_stream_create(data + set_offsets[i], 0, 0);
+        hz_stream_seek(set, 2);
+        hz_stream_read16_n(set, subst->set_glyphs[i + 1] - subst->set_glyphs[i],
+                           subst->glyphs + subst->set_glyphs[i]);
+        hz_stream_destroy(set);
+    }
+
+    HZ_FREE(set_offsets);
+    hz_stream_destroy(subtable);
+    return subst;
+}
+
+static void
+hz_multiple_subst_destroy(hz_multiple_subst_t *subst)
+{
+    hz_coverage_destroy(subst->coverage);
+    HZ_FREE(subst->set_glyphs);
+    HZ_FREE(subst->glyphs);
+    HZ_FREE(subst);
+}
+
+/* looks up the glyph array of a glyph, returns HZ_FALSE if it is not covered */
+static hz_bool_t
+hz_multiple_subst_get(const hz_multiple_subst_t *subst,
+                      hz_index_t id,
+                      const hz_index_t **glyphs,
+                      uint16_t *glyph_count)
+{
+    int32_t coverage_index;
+
+    if (subst->coverage == NULL)
+        return HZ_FALSE;
+
+    coverage_index = hz_coverage_search(subst->coverage, id);
+    if (coverage_index < 0 || coverage_index >= subst->set_count)
+        return HZ_FALSE;
 
-    return g;
+    *glyphs = subst->glyphs + subst->set_glyphs[coverage_index];
+    *glyph_count = subst->set_glyphs[coverage_index + 1] - subst->set_glyphs[coverage_index];
+    return HZ_TRUE;
 }
 
-hz_sequence_node_t *
-hz_next_node_of_class(hz_sequence_node_t *node,
-                      hz_glyph_class_t gc,
-                      int *skip)
+/*  Struct: hz_ligature_trie_node_t
+ *      Node of a ligature trie, the path from the root spells the components.
+ *
+ *  Fields:
+ *      first_edge - Index of the node's first edge.
+ *      edge_count - Number of edges, sorted by glyph id.
+ *      order - Position of the ligature ending here in its LigatureSet, 0xFFFF if none.
+ *      ligature_glyph - Glyph of the ligature ending here.
+ *      component_count - Number of components of the ligature ending here.
+ * */
+typedef struct hz_ligature_trie_node_t {
+    uint32_t first_edge;
+    uint16_t edge_count;
+    uint16_t order;
+    hz_index_t ligature_glyph;
+    uint16_t component_count;
+} hz_ligature_trie_node_t;
+
+#define HZ_LIGATURE_TRIE_NO_LIGATURE 0xFFFF
+
+/* LigatureSubst format 1 subtable, with every LigatureSet compiled into a trie
+ * keyed on the component glyph ids following the covered first glyph.
+ * */
+struct hz_ligature_subst_t {
+    hz_coverage_t *coverage;
+    uint16_t root_count;
+    uint32_t *roots; /* trie root of every coverage index */
+    hz_ligature_trie_node_t *nodes;
+    uint32_t node_count;
+    hz_index_t *edge_glyphs;
+    uint32_t *edge_nodes;
+    uint32_t edge_count;
+};
+
+typedef struct hz_ligature_rec_t {
+    const hz_index_t *components; /* components following the first glyph */
+    uint16_t component_count;
+    uint16_t order;
+    hz_index_t ligature_glyph;
+} hz_ligature_rec_t;
+
+static int
+hz_ligature_rec_compare(const void *a, const void *b)
 {
-    if (gc == HZ_GLYPH_CLASS_ZERO) {
-        /* if no wanted classes, just give the next glyph directly as an optimization */
-        if (skip != NULL) (* skip) ++;
-        return node->next;
+    const hz_ligature_rec_t *r1 = a, *r2 = b;
+    uint16_t i = 0, min_count = r1->component_count < r2->component_count
+                                ? r1->component_count : r2->component_count;
+
+    while (i < min_count) {
+        if (r1->components[i] != r2->components[i])
+            return r1->components[i] < r2->components[i] ? -1 : 1;
+        ++i;
     }
 
-    while (1) {
-        if (skip != NULL) (* skip) ++;
-        node = node->next;
+    /* shorter ligatures are prefixes and sort first, ties keep the LigatureSet order */
+    if (r1->component_count != r2->component_count)
+        return r1->component_count < r2->component_count ? -1 : 1;
 
-        /* break if next node is NULL, cannot keep searching */
-        if (node == NULL)
-            break;
+    return (int) r1->order - (int) r2->order;
+}
 
-        /* if not any of the class flags set, break, as we found what we want */
-        if (node->gc & gc)
-            break;
+static uint32_t
+hz_ligature_subst_add_node(hz_ligature_subst_t *subst, uint32_t *node_capacity)
+{
+    hz_ligature_trie_node_t *node;
+
+    if (subst->node_count == *node_capacity) {
+        *node_capacity = *node_capacity ? *node_capacity * 2 : 16;
+        subst->nodes = HZ_REALLOC(subst->nodes, *node_capacity * sizeof(hz_ligature_trie_node_t));
     }
 
-    return node;
+    node = &subst->nodes[subst->node_count];
+    node->first_edge = 0;
+    node->edge_count = 0;
+    node->order = HZ_LIGATURE_TRIE_NO_LIGATURE;
+    node->ligature_glyph = 0;
+    node->component_count = 0;
+    return subst->node_count++;
 }
 
-hz_sequence_node_t *
-hz_next_node_of_class_bound(hz_sequence_node_t *node,
-                            hz_glyph_class_t gc,
-                            int *skip,
-                            int max_skip)
+/* builds the trie node for the sorted ligatures [lo, hi) sharing their first depth components */
+static uint32_t
+hz_ligature_subst_build_node(hz_ligature_subst_t *subst,
+                             uint32_t *node_capacity,
+                             uint32_t *edge_capacity,
+                             const hz_ligature_rec_t *recs,
+                             uint32_t lo, uint32_t hi,
+                             uint16_t depth)
 {
-    if (gc == HZ_GLYPH_CLASS_ZERO) {
-        /* if no wanted classes, just give the next glyph directly as an optimization */
-        if (skip != NULL) (* skip) ++;
-        return node->next;
+    uint32_t node_index = hz_ligature_subst_add_node(subst, node_capacity);
+    uint32_t i, first_edge, edge_count = 0;
+
+    /* ligatures ending at this depth sort first, the first one has the lowest order */
+    if (lo < hi && recs[lo].component_count == depth) {
+        hz_ligature_trie_node_t *node = &subst->nodes[node_index];
+        node->order = recs[lo].order;
+        node->ligature_glyph = recs[lo].ligature_glyph;
+        node->component_count = depth + 1;
+
+        while (lo < hi && recs[lo].component_count == depth)
+            ++lo;
     }
 
-    while (*skip < max_skip) {
-        if (skip != NULL) (* skip) ++;
-        node = node->next;
+    for (i = lo; i < hi; ++i) {
+        if (i == lo || recs[i].components[depth] != recs[i - 1].components[depth])
+            ++edge_count;
+    }
 
-        /* break if next node is NULL, cannot keep searching */
-        if (node == NULL)
-            break;
+    /* reserve the node's edges before recursing so they stay contiguous */
+    first_edge = subst->edge_count;
+    if (first_edge + edge_count > *edge_capacity) {
+        while (first_edge + edge_count > *edge_capacity)
+            *edge_capacity = *edge_capacity ? *edge_capacity * 2 : 16;
 
-        /* if not any of the class flags set, break, as we found what we want */
-        if (node->gc & gc)
-            break;
+        subst->edge_glyphs = HZ_REALLOC(subst->edge_glyphs, *edge_capacity * sizeof(hz_index_t));
+        subst->edge_nodes = HZ_REALLOC(subst->edge_nodes, *edge_capacity * sizeof(uint32_t));
+    }
+
+    subst->edge_count += edge_count;
+    subst->nodes[node_index].first_edge = first_edge;
+    subst->nodes[node_index].edge_count = edge_count;
+
+    edge_count = 0;
+    while (lo < hi) {
+        uint32_t group_end = lo + 1;
+        hz_index_t glyph = recs[lo].components[depth];
+        uint32_t child;
+
+        while (group_end < hi && recs[group_end].components[depth] == glyph)
+            ++group_end;
+
+        child = hz_ligature_subst_build_node(subst, node_capacity, edge_capacity,
+                                             recs, lo, group_end, depth + 1);
+
+        subst->edge_glyphs[first_edge + edge_count] = glyph;
+        subst->edge_nodes[first_edge + edge_count] = child;
+        ++edge_count;
+        lo = group_end;
     }
 
-    return node;
+    return node_index;
 }
 
-/* assumes node is not NULL */
-hz_sequence_node_t *
-hz_last_node_of_class(hz_sequence_node_t *node,
-                      hz_glyph_class_t gc,
-                      int *skip)
+static hz_ligature_subst_t *
+hz_ligature_subst_create(const hz_byte_t *data)
 {
-    if (gc == HZ_GLYPH_CLASS_ZERO)
-        return node;
+    hz_ligature_subst_t *subst;
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    uint16_t format, coverage_offset, set_index;
+    uint32_t node_capacity = 0, edge_capacity = 0;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &coverage_offset);
+
+    subst = HZ_ALLOC(hz_ligature_subst_t);
+    subst->coverage = hz_coverage_create(data + coverage_offset);
+    subst->nodes = NULL;
+    subst->node_count = 0;
+    subst->edge_glyphs = NULL;
+    subst->edge_nodes = NULL;
+    subst->edge_count = 0;
+
+    hz_stream_read16(subtable, &subst->root_count);
+    subst->roots = HZ_MALLOC(subst->root_count * sizeof(uint32_t));
+
+    for (set_index = 0; set_index < subst->root_count; ++set_index) {
+        hz_offset16_t set_offset;
+        uint16_t ligature_count, ligature_index;
+        hz_stream_t *ligature_set;
+        hz_ligature_rec_t *recs;
+        hz_index_t *components = NULL;
+        size_t component_total = 0, component_used = 0;
+
+        hz_stream_read16(subtable, &set_offset);
+        ligature_set = hz_stream_create(data + set_offset, 0, 0);
+        hz_stream_read16(ligature_set, &ligature_count);
+        recs = HZ_MALLOC(ligature_count * sizeof(hz_ligature_rec_t));
+
+        /* first pass sizes the component pool, the records point into it */
+        for (ligature_index = 0; ligature_index < ligature_count; ++ligature_index) {
+            hz_offset16_t ligature_offset;
+            uint16_t component_count;
+            hz_stream_t *ligature;
+
+            hz_stream_read16(ligature_set, &ligature_offset);
+            ligature = hz_stream_create(ligature_set->data + ligature_offset, 0, 0);
+            hz_stream_read16(ligature, &recs[ligature_index].ligature_glyph);
+            hz_stream_read16(ligature, &component_count);
+            recs[ligature_index].component_count = component_count ? component_count - 1 : 0;
+            recs[ligature_index].order = ligature_index;
+            component_total += recs[ligature_index].component_count;
+            hz_stream_destroy(ligature);
+        }
+
+        components = HZ_MALLOC((component_total ? component_total : 1) * sizeof(hz_index_t));
+        ligature_set->offset = sizeof(uint16_t);
+
+        for (ligature_index = 0; ligature_index < ligature_count; ++ligature_index) {
+            hz_offset16_t ligature_offset;
+            hz_stream_t *ligature;
+
+            hz_stream_read16(ligature_set, &ligature_offset);
+            ligature = hz_stream_create(ligature_set->data + ligature_offset + 2 * sizeof(uint16_t), 0, 0);
+            hz_stream_read16_n(ligature, recs[ligature_index].component_count, components + component_used);
+            recs[ligature_index].components = components + component_used;
+            component_used += recs[ligature_index].component_count;
+            hz_stream_destroy(ligature);
+        }
+
+        qsort(recs, ligature_count, sizeof(hz_ligature_rec_t), hz_ligature_rec_compare);
+        subst->roots[set_index] = hz_ligature_subst_build_node(subst, &node_capacity, &edge_capacity,
+                                                               recs, 0, ligature_count, 0);
 
-    while(1) {
-        if (node == NULL) break;
-        if (node->next == NULL) break;
-        if (~node->next->gc & gc) break;
-        node = node->next;
-        if (skip != NULL) (* skip) ++;
+        HZ_FREE(components);
+        HZ_FREE(recs);
+        hz_stream_destroy(ligature_set);
     }
 
-    return node;
+    hz_stream_destroy(subtable);
+    return subst;
+}
+
+static void
+hz_ligature_subst_destroy(hz_ligature_subst_t *subst)
+{
+    hz_coverage_destroy(subst->coverage);
+    HZ_FREE(subst->roots);
+    HZ_FREE(subst->nodes);
+    HZ_FREE(subst->edge_glyphs);
+    HZ_FREE(subst->edge_nodes);
+    HZ_FREE(subst);
 }
 
-hz_sequence_node_t *
-hz_prev_node_of_class(hz_sequence_node_t *node,
-                      hz_glyph_class_t gc,
-                      uint16_t *skip_count)
+/* rules whose input is longer than this are dropped when compiling, this bounds
+ * the matched positions kept on the stack while applying a rule
+ * */
+#define HZ_MAX_CONTEXT_LENGTH 64
+
+typedef struct hz_sequence_lookup_record_t {
+    uint16_t sequence_index;
+    uint16_t lookup_index;
+} hz_sequence_lookup_record_t;
+
+/*  Struct: hz_context_rule_t
+ *      Rule of a (chained) sequence context subtable.
+ *
+ *  Fields:
+ *      backtrack_count - Number of backtrack glyphs, closest to the input first.
+ *      input_count - Number of input glyphs, including the first one.
+ *      lookahead_count - Number of lookahead glyphs.
+ *      record_count - Number of sequence lookup records.
+ *      first_value - Index of the rule's first value, the backtrack values are
+ *                    followed by the input values past the first glyph and
+ *                    the lookahead values.
+ *      first_record - Index of the rule's first sequence lookup record.
+ * */
+typedef struct hz_context_rule_t {
+    uint16_t backtrack_count;
+    uint16_t input_count;
+    uint16_t lookahead_count;
+    uint16_t record_count;
+    uint32_t first_value;
+    uint32_t first_record;
+} hz_context_rule_t;
+
+/* SequenceContext and ChainedSequenceContext subtables of any format. Format 1
+ * values are glyph ids, format 2 values are classes and format 3 values index
+ * coverages. The first glyph is always matched by the coverage, its index
+ * (format 1) or class (format 2) selects the rule set.
+ * */
+struct hz_context_t {
+    uint16_t format;
+    hz_coverage_t *coverage;
+    hz_class_def_t *backtrack_class_def;
+    hz_class_def_t *input_class_def;
+    hz_class_def_t *lookahead_class_def;
+    uint16_t set_count;
+    uint32_t *set_rules; /* rules of set i are [set_rules[i], set_rules[i + 1]) */
+    hz_context_rule_t *rules;
+    uint32_t rule_count;
+    uint16_t *values;
+    uint32_t value_count;
+    hz_coverage_t **coverages;
+    hz_sequence_lookup_record_t *records;
+    uint32_t record_count;
+};
+
+/* ReverseChainSingleSubst format 1 subtable */
+struct hz_reverse_chain_subst_t {
+    hz_coverage_t *coverage;
+    uint16_t backtrack_count;
+    uint16_t lookahead_count;
+    hz_coverage_t **coverages; /* backtrack, then lookahead */
+    uint16_t substitute_count;
+    hz_index_t *substitutes;
+};
+
+static void *
+hz_grow_array(void *data, uint32_t *capacity, uint32_t needed, size_t size)
 {
-    if (gc == HZ_GLYPH_CLASS_ZERO) {
-        /* if no wanted classes, just give the prev glyph directly as an optimization */
-        if (skip_count != NULL) (* skip_count) --;
-        return node->prev;
+    if (needed > *capacity) {
+        while (needed > *capacity)
+            *capacity = *capacity ? *capacity * 2 : 16;
+        data = HZ_REALLOC(data, *capacity * size);
     }
 
-    while (1) {
-        if (skip_count != NULL) (* skip_count) --;
-        node = node->prev;
+    return data;
+}
 
-        /* break if next node is NULL, cannot keep searching */
-        if (node == NULL)
-            break;
+typedef struct hz_context_capacity_t {
+    uint32_t rules, values, records;
+} hz_context_capacity_t;
 
-        /* if not any of the class flags set, break, as we found what we want */
-        if (node->gc & gc)
-            break;
+static void
+hz_context_add_values(hz_context_t *context,
+                      hz_context_capacity_t *capacity,
+                      hz_stream_t *stream,
+                      const hz_byte_t *base,
+                      uint16_t count)
+{
+    if (context->format == 3) {
+        uint16_t i;
+        context->coverages = hz_grow_array(context->coverages, &capacity->values,
+                                           context->value_count + count, sizeof(hz_coverage_t *));
+        for (i = 0; i < count; ++i) {
+            hz_offset16_t coverage_offset;
+            hz_stream_read16(stream, &coverage_offset);
+            context->coverages[context->value_count++] = hz_coverage_create(base + coverage_offset);
+        }
+    } else {
+        context->values = hz_grow_array(context->values, &capacity->values,
+                                        context->value_count + count, sizeof(uint16_t));
+        hz_stream_read16_n(stream, count, context->values + context->value_count);
+        context->value_count += count;
     }
-
-    return node;
 }
 
-hz_glyph_class_t
-hz_ignored_classes_from_lookup_flags(hz_lookup_flag_t flags)
+/* reads a (chained) sequence rule, for format 3 base is the subtable the coverage
+ * offsets are relative to and the rule starts after the subtable format
+ * */
+static void
+hz_context_add_rule(hz_context_t *context,
+                    hz_context_capacity_t *capacity,
+                    const hz_byte_t *data,
+                    const hz_byte_t *base,
+                    hz_bool_t chained)
 {
-    hz_glyph_class_t ignored_classes = HZ_GLYPH_CLASS_ZERO;
+    hz_stream_t *stream = hz_stream_create(data, 0, 0);
+    hz_context_rule_t rule;
+    uint32_t value_count = context->value_count;
+    uint16_t i;
+
+    rule.backtrack_count = 0;
+    rule.lookahead_count = 0;
+    rule.first_value = context->value_count;
+    rule.first_record = context->record_count;
+
+    if (chained) {
+        hz_stream_read16(stream, &rule.backtrack_count);
+        hz_context_add_values(context, capacity, stream, base, rule.backtrack_count);
+        hz_stream_read16(stream, &rule.input_count);
+        if (context->format == 3) {
+            /* the first input coverage gates the subtable, it is kept apart */
+            hz_offset16_t coverage_offset;
+            if (rule.input_count) {
+                hz_stream_read16(stream, &coverage_offset);
+                context->coverage = hz_coverage_create(base + coverage_offset);
+            }
+        }
+        hz_context_add_values(context, capacity, stream, base, rule.input_count ? rule.input_count - 1 : 0);
+        hz_stream_read16(stream, &rule.lookahead_count);
+        hz_context_add_values(context, capacity, stream, base, rule.lookahead_count);
+        hz_stream_read16(stream, &rule.record_count);
+    } else {
+        hz_stream_read16(stream, &rule.input_count);
+        hz_stream_read16(stream, &rule.record_count);
+        if (context->format == 3) {
+            hz_offset16_t coverage_offset;
+            if (rule.input_count) {
+                hz_stream_read16(stream, &coverage_offset);
+                context->coverage = hz_coverage_create(base + coverage_offset);
+            }
+        }
+        hz_context_add_values(context, capacity, stream, base, rule.input_count ? rule.input_count - 1 : 0);
+    }
 
-    if (flags & HZ_LOOKUP_FLAG_IGNORE_MARKS) ignored_classes |= HZ_GLYPH_CLASS_MARK;
-    if (flags & HZ_LOOKUP_FLAG_IGNORE_BASE_GLYPHS) ignored_classes |= HZ_GLYPH_CLASS_BASE;
-    if (flags & HZ_LOOKUP_FLAG_IGNORE_LIGATURES) ignored_classes |= HZ_GLYPH_CLASS_LIGATURE;
+    if (!rule.input_count || rule.input_count > HZ_MAX_CONTEXT_LENGTH) {
+        /* rule can't match, drop the values it added */
+        if (context->format == 3) {
+            while (context->value_count > value_count)
+                hz_coverage_destroy(context->coverages[--context->value_count]);
+        }
 
-    return ignored_classes;
+        context->value_count = value_count;
+        hz_stream_destroy(stream);
+        return;
+    }
+
+    context->records = hz_grow_array(context->records, &capacity->records,
+                                     context->record_count + rule.record_count,
+                                     sizeof(hz_sequence_lookup_record_t));
+    for (i = 0; i < rule.record_count; ++i) {
+        hz_sequence_lookup_record_t *record = &context->records[context->record_count++];
+        hz_stream_read16(stream, &record->sequence_index);
+        hz_stream_read16(stream, &record->lookup_index);
+    }
+
+    context->rules = hz_grow_array(context->rules, &capacity->rules,
+                                   context->rule_count + 1, sizeof(hz_context_rule_t));
+    context->rules[context->rule_count++] = rule;
+    hz_stream_destroy(stream);
 }
 
-#define HZ_MAX(x, y) (((x) > (y)) ? (x) : (y))
+static hz_context_t *
+hz_context_create(const hz_byte_t *data, hz_bool_t chained)
+{
+    hz_context_t *context = HZ_ALLOC(hz_context_t);
+    hz_context_capacity_t capacity = {0, 0, 0};
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
 
-/* if possible, apply ligature fit for sequence of glyphs
- * returns true if replacement occurred
- * */
-hz_bool_t
-hz_ot_layout_apply_fit_ligature(hz_ligature_t **ligatures,
-                                uint16_t ligature_count,
-                                hz_glyph_class_t gcignore,
-                                hz_sequence_node_t *start_node)
-{
-    uint16_t ligature_index = 0;
-
-    while (ligature_index < ligature_count) {
-        int skip_count = 0;
-        uint16_t skip_index = 0;
-        hz_sequence_node_t *step_node = start_node;
-        hz_ligature_t *ligature = ligatures[ligature_index];
-        hz_bool_t pattern_matches = HZ_TRUE;
-
-        /* go over sequence and compare with current ligature */
-        while (skip_index < ligature->component_count - 1) {
-            step_node = hz_next_node_not_of_class(step_node, gcignore, &skip_count);
-
-            if (step_node == NULL) {
-                pattern_matches = HZ_FALSE;
-                break;
+    hz_stream_read16(subtable, &context->format);
+    context->coverage = NULL;
+    context->backtrack_class_def = NULL;
+    context->input_class_def = NULL;
+    context->lookahead_class_def = NULL;
+    context->set_count = 0;
+    context->set_rules = NULL;
+    context->rules = NULL;
+    context->rule_count = 0;
+    context->values = NULL;
+    context->value_count = 0;
+    context->coverages = NULL;
+    context->records = NULL;
+    context->record_count = 0;
+
+    if (context->format == 1 || context->format == 2) {
+        hz_offset16_t coverage_offset;
+        uint16_t set_index;
+
+        hz_stream_read16(subtable, &coverage_offset);
+        context->coverage = hz_coverage_create(data + coverage_offset);
+
+        if (context->format == 2) {
+            hz_offset16_t class_def_offset;
+
+            if (chained) {
+                hz_stream_read16(subtable, &class_def_offset);
+                context->backtrack_class_def = class_def_offset ? hz_class_def_create(data + class_def_offset) : NULL;
             }
 
-            hz_index_t g1 = step_node->id;
-            hz_index_t g2 = ligature->component_glyph_ids[skip_index];
-            if (g1 != g2) {
-                pattern_matches = HZ_FALSE;
-                break;
+            hz_stream_read16(subtable, &class_def_offset);
+            context->input_class_def = class_def_offset ? hz_class_def_create(data + class_def_offset) : NULL;
+
+            if (chained) {
+                hz_stream_read16(subtable, &class_def_offset);
+                context->lookahead_class_def = class_def_offset ? hz_class_def_create(data + class_def_offset) : NULL;
             }
+        }
 
-            ++ skip_index;
-        }
-
-        if (pattern_matches) {
-            /* pattern matches, replace it and tag following mark glyphs with
-             * a component id, link all following marks together after the ligature which were attached
-             * to the ligature.
-             * */
-            int comp_count = ligature->component_count;
-
-            if (comp_count - 1) {
-                if (gcignore == HZ_GLYPH_CLASS_ZERO)
-                    hz_sequence_rem_next_n_nodes(start_node, comp_count-1);
-                else {
-                    hz_sequence_node_t *n1, *n2 = start_node;
-
-                    int comp_index = 0;
-                    while (comp_index < comp_count) {
-                        hz_sequence_node_t *child;
-                        int skip = 0;
-                        n1 = n2;
-                        n2 = hz_next_node_of_class_bound(n1, gcignore, &skip, comp_count);
-
-                        if ((comp_index + skip) > comp_count) {
-                            int rem = HZ_MAX((comp_index + skip) - comp_count, 0);
-                            if (rem)
-                                hz_sequence_rem_next_n_nodes(n1, rem);
-                        } else {
-                            hz_sequence_rem_node_range(n1, n2);
-                        }
+        hz_stream_read16(subtable, &context->set_count);
+        context->set_rules = HZ_MALLOC((context->set_count + 1) * sizeof(uint32_t));
 
-                        if (n2 == NULL) break;
+        for (set_index = 0; set_index < context->set_count; ++set_index) {
+            hz_offset16_t set_offset;
 
-                        n1 = n2;
-                        n2 = hz_last_node_of_class(n1, HZ_GLYPH_CLASS_MARK, NULL);
+            hz_stream_read16(subtable, &set_offset);
+            context->set_rules[set_index] = context->rule_count;
 
-                        for (child = n1; child != n2->next; child = child->next) {
-                            child->cid = comp_index ? comp_index : skip-1;
-                        }
+            if (set_offset) {
+                hz_stream_t *rule_set = hz_stream_create(data + set_offset, 0, 0);
+                uint16_t rule_count, rule_index;
 
-                        comp_index += comp_index ? skip-1 : skip;
-                    }
+                hz_stream_read16(rule_set, &rule_count);
+                for (rule_index = 0; rule_index < rule_count; ++rule_index) {
+                    hz_offset16_t rule_offset;
+                    hz_stream_read16(rule_set, &rule_offset);
+                    hz_context_add_rule(context, &capacity, rule_set->data + rule_offset, NULL, chained);
                 }
-            }
 
-            /* insert ligature glyph */
-            start_node->id = ligature->ligature_glyph;
-            start_node->gc |= HZ_GLYPH_CLASS_LIGATURE;
-            break;
+                hz_stream_destroy(rule_set);
+            }
         }
 
-        ++ ligature_index;
+        context->set_rules[context->set_count] = context->rule_count;
+    } else if (context->format == 3) {
+        /* single rule, its coverages are relative to the subtable */
+        context->set_count = 1;
+        context->set_rules = HZ_MALLOC(2 * sizeof(uint32_t));
+        context->set_rules[0] = 0;
+        hz_context_add_rule(context, &capacity, data + sizeof(uint16_t), data, chained);
+        context->set_rules[1] = context->rule_count;
     }
 
-    return HZ_TRUE;
+    hz_stream_destroy(subtable);
+    return context;
 }
 
-void
-hz_ot_layout_apply_gsub_lookup(hz_face_t *face,
-                               hz_stream_t *table,
-                               hz_feature_t feature,
-                               hz_sequence_t *sect)
+static void
+hz_context_destroy(hz_context_t *context)
 {
-    HZ_LOG("FEATURE '%c%c%c%c'\n", HZ_UNTAG(hz_ot_tag_from_feature(feature)));
-    uint16_t lookup_type;
-    uint16_t lookup_flags;
-    uint16_t subtable_count;
-    hz_stream_read16(table, &lookup_type);
-    hz_stream_read16(table, &lookup_flags);
-    hz_stream_read16(table, &subtable_count);
+    if (context->format == 3) {
+        uint32_t i;
+        for (i = 0; i < context->value_count; ++i)
+            hz_coverage_destroy(context->coverages[i]);
+    }
 
-    HZ_LOG("lookup_type: %d\n", lookup_type);
-    HZ_LOG("lookup_flag: %d\n", lookup_flags);
-    HZ_LOG("subtable_count: %d\n", subtable_count);
+    hz_coverage_destroy(context->coverage);
+    hz_class_def_destroy(context->backtrack_class_def);
+    hz_class_def_destroy(context->input_class_def);
+    hz_class_def_destroy(context->lookahead_class_def);
+    HZ_FREE(context->set_rules);
+    HZ_FREE(context->rules);
+    HZ_FREE(context->values);
+    HZ_FREE(context->coverages);
+    HZ_FREE(context->records);
+    HZ_FREE(context);
+}
 
-    hz_glyph_class_t gcignore = hz_ignored_classes_from_lookup_flags(lookup_flags);
-    uint16_t subtable_index = 0;
-    while (subtable_index < subtable_count) {
-        hz_offset16_t offset;
-        hz_stream_read16(table, &offset);
-        hz_stream_t *subtable = hz_stream_create(table->data + offset, 0, 0);
-        uint16_t format;
-        hz_stream_read16(subtable, &format);
+static hz_reverse_chain_subst_t *
+hz_reverse_chain_subst_create(const hz_byte_t *data)
+{
+    hz_reverse_chain_subst_t *subst = HZ_ALLOC(hz_reverse_chain_subst_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    uint16_t format, i;
+    hz_offset16_t coverage_offset;
+    hz_offset16_t *offsets;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &coverage_offset);
+    subst->coverage = hz_coverage_create(data + coverage_offset);
+
+    hz_stream_read16(subtable, &subst->backtrack_count);
+    offsets = HZ_MALLOC((subst->backtrack_count ? subst->backtrack_count : 1) * sizeof(hz_offset16_t));
+    hz_stream_read16_n(subtable, subst->backtrack_count, offsets);
+    hz_stream_read16(subtable, &subst->lookahead_count);
+    offsets = HZ_REALLOC(offsets, ((subst->backtrack_count + subst->lookahead_count) ?
+                                   subst->backtrack_count + subst->lookahead_count : 1) * sizeof(hz_offset16_t));
+    hz_stream_read16_n(subtable, subst->lookahead_count, offsets + subst->backtrack_count);
+
+    subst->coverages = HZ_MALLOC(((subst->backtrack_count + subst->lookahead_count) ?
+                                  subst->backtrack_count + subst->lookahead_count : 1) * sizeof(hz_coverage_t *));
+    for (i = 0; i < subst->backtrack_count + subst->lookahead_count; ++i)
+        subst->coverages[i] = hz_coverage_create(data + offsets[i]);
+
+    hz_stream_read16(subtable, &subst->substitute_count);
+    subst->substitutes = HZ_MALLOC((subst->substitute_count ? subst->substitute_count : 1) * sizeof(hz_index_t));
+    hz_stream_read16_n(subtable, subst->substitute_count, subst->substitutes);
+
+    HZ_FREE(offsets);
+    hz_stream_destroy(subtable);
+    return subst;
+}
+
+static void
+hz_reverse_chain_subst_destroy(hz_reverse_chain_subst_t *subst)
+{
+    uint16_t i;
+
+    for (i = 0; i < subst->backtrack_count + subst->lookahead_count; ++i)
+        hz_coverage_destroy(subst->coverages[i]);
+
+    hz_coverage_destroy(subst->coverage);
+    HZ_FREE(subst->coverages);
+    HZ_FREE(subst->substitutes);
+    HZ_FREE(subst);
+}
+
+/* ValueRecord decoded to the adjustments applied to glyph positions,
+ * device tables are skipped */
+typedef struct hz_value_record_t {
+    int16_t x_placement;
+    int16_t y_placement;
+    int16_t x_advance;
+    int16_t y_advance;
+} hz_value_record_t;
+
+/* size in bytes of a ValueRecord of the given ValueFormat */
+static size_t
+hz_value_record_size(uint16_t value_format)
+{
+    return hz_popcount64(value_format & 0x00FFU) * 2;
+}
+
+static void
+hz_value_record_read(hz_stream_t *stream, uint16_t value_format, hz_value_record_t *record)
+{
+    uint16_t device_offset;
+
+    record->x_placement = 0;
+    record->y_placement = 0;
+    record->x_advance = 0;
+    record->y_advance = 0;
+
+    if (value_format & HZ_VALUE_FORMAT_X_PLACEMENT)
+        hz_stream_read16(stream, (uint16_t *) &record->x_placement);
+    if (value_format & HZ_VALUE_FORMAT_Y_PLACEMENT)
+        hz_stream_read16(stream, (uint16_t *) &record->y_placement);
+    if (value_format & HZ_VALUE_FORMAT_X_ADVANCE)
+        hz_stream_read16(stream, (uint16_t *) &record->x_advance);
+    if (value_format & HZ_VALUE_FORMAT_Y_ADVANCE)
+        hz_stream_read16(stream, (uint16_t *) &record->y_advance);
+
+    /* device adjustments are skipped over, shaping is done in font units with no ppem */
+    if (value_format & HZ_VALUE_FORMAT_X_PLACEMENT_DEVICE)
+        hz_stream_read16(stream, &device_offset);
+    if (value_format & HZ_VALUE_FORMAT_Y_PLACEMENT_DEVICE)
+        hz_stream_read16(stream, &device_offset);
+    if (value_format & HZ_VALUE_FORMAT_X_ADVANCE_DEVICE)
+        hz_stream_read16(stream, &device_offset);
+    if (value_format & HZ_VALUE_FORMAT_Y_ADVANCE_DEVICE)
+        hz_stream_read16(stream, &device_offset);
+}
+
+static void
+hz_value_record_apply(hz_sequence_node_t *node, const hz_value_record_t *record)
+{
+    node->x_offset += record->x_placement;
+    node->y_offset += record->y_placement;
+    node->x_advance += record->x_advance;
+    node->y_advance += record->y_advance;
+}
+
+/* SinglePos subtable of either format. Only the fields the ValueFormat provides
+ * are kept, packed per value in x placement, y placement, x advance, y advance
+ * order next to the offsets of the node fields they are added to, so applying a
+ * value doesn't go through the format bits. Format 1 has a single value shared
+ * by every covered glyph.
+ * */
+struct hz_single_pos_t {
+    uint16_t format;
+    hz_coverage_t *coverage;
+    uint16_t value_count;
+    uint8_t field_count;
+    uint8_t field_offsets[4];
+    int16_t *values;
+};
+
+static hz_single_pos_t *
+hz_single_pos_create(const hz_byte_t *data)
+{
+    hz_single_pos_t *pos = HZ_ALLOC(hz_single_pos_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    hz_offset16_t coverage_offset;
+    uint16_t value_format;
+    size_t record_size;
+    uint32_t value_index;
+    uint8_t field_index;
+
+    hz_stream_read16(subtable, &pos->format);
+    hz_stream_read16(subtable, &coverage_offset);
+    hz_stream_read16(subtable, &value_format);
+    pos->coverage = hz_coverage_create(data + coverage_offset);
+
+    pos->field_count = 0;
+    if (value_format & HZ_VALUE_FORMAT_X_PLACEMENT)
+        pos->field_offsets[pos->field_count++] = offsetof(hz_sequence_node_t, x_offset);
+    if (value_format & HZ_VALUE_FORMAT_Y_PLACEMENT)
+        pos->field_offsets[pos->field_count++] = offsetof(hz_sequence_node_t, y_offset);
+    if (value_format & HZ_VALUE_FORMAT_X_ADVANCE)
+        pos->field_offsets[pos->field_count++] = offsetof(hz_sequence_node_t, x_advance);
+    if (value_format & HZ_VALUE_FORMAT_Y_ADVANCE)
+        pos->field_offsets[pos->field_count++] = offsetof(hz_sequence_node_t, y_advance);
+
+    if (pos->format == 1)
+        pos->value_count = 1;
+    else
+        hz_stream_read16(subtable, &pos->value_count);
+
+    /* the device offsets follow the fields and are skipped */
+    record_size = hz_value_record_size(value_format);
+    pos->values = HZ_MALLOC(((uint32_t) pos->value_count * pos->field_count + 1) * sizeof(int16_t));
+    for (value_index = 0; value_index < pos->value_count; ++value_index) {
+        int16_t *value = pos->values + value_index * pos->field_count;
+
+        for (field_index = 0; field_index < pos->field_count; ++field_index)
+            hz_stream_read16(subtable, (uint16_t *) &value[field_index]);
+
+        hz_stream_seek(subtable, (int) (record_size - pos->field_count * 2));
+    }
+
+    hz_stream_destroy(subtable);
+    return pos;
+}
+
+static void
+hz_single_pos_destroy(hz_single_pos_t *pos)
+{
+    hz_coverage_destroy(pos->coverage);
+    HZ_FREE(pos->values);
+    HZ_FREE(pos);
+}
+
+/* adds the value of the glyph at the cursor to its position and moves past it */
+static hz_bool_t
+hz_single_pos_apply(const hz_single_pos_t *pos, hz_sequence_t *sect)
+{
+    hz_sequence_node_t *node = &sect->nodes[sect->cursor];
+    int32_t coverage_index;
+    const int16_t *value;
+    uint8_t field_index;
+
+    if (pos->coverage == NULL)
+        return HZ_FALSE;
+
+    coverage_index = hz_coverage_search(pos->coverage, node->id);
+    if (coverage_index < 0)
+        return HZ_FALSE;
+
+    if (pos->format == 1)
+        coverage_index = 0;
+    else if (coverage_index >= pos->value_count)
+        return HZ_FALSE;
+
+    value = pos->values + coverage_index * pos->field_count;
+    for (field_index = 0; field_index < pos->field_count; ++field_index)
+        *(int16_t *) ((hz_byte_t *) node + pos->field_offsets[field_index]) += value[field_index];
+
+    hz_sequence_next_node(sect);
+    return HZ_TRUE;
+}
+
+typedef struct hz_anchor_t {
+    int16_t x_coord, y_coord;
+} hz_anchor_t;
+
+/* decodes the coordinates of an Anchor table, they lead every format. The contour
+ * point of format 2 and the device tables of format 3 are left out */
+static hz_anchor_t
+hz_anchor_decode(const hz_byte_t *data)
+{
+    hz_anchor_t anchor;
+    anchor.x_coord = (int16_t) (((uint16_t) data[2] << 8) | data[3]);
+    anchor.y_coord = (int16_t) (((uint16_t) data[4] << 8) | data[5]);
+    return anchor;
+}
+
+/* PairPos subtable of either format. Format 1 keeps the pairs of every covered
+ * first glyph sorted by second glyph, format 2 keeps a dense class1 x class2
+ * matrix. When the first glyph only adjusts its x advance and the second glyph
+ * isn't adjusted, which is how most kerning is encoded, the values are plain
+ * x advances, otherwise they are pairs of value records.
+ * */
+struct hz_pair_pos_t {
+    uint16_t format;
+    hz_coverage_t *coverage;
+    uint16_t value_format1;
+    uint16_t value_format2;
+
+    /* format 1 */
+    uint16_t set_count;
+    uint32_t *set_pairs; /* pairs of set i are [set_pairs[i], set_pairs[i + 1]) */
+    hz_index_t *second_glyphs;
+
+    /* format 2 */
+    hz_class_def_t *class_def1;
+    hz_class_def_t *class_def2;
+    uint16_t class1_count;
+    uint16_t class2_count;
+
+    int16_t *x_advances; /* NULL unless the values are x advances */
+    hz_value_record_t *records; /* first then second glyph record of every value */
+};
+
+static hz_pair_pos_t *
+hz_pair_pos_create(const hz_byte_t *data)
+{
+    hz_pair_pos_t *pos = HZ_ALLOC(hz_pair_pos_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    hz_offset16_t coverage_offset;
+    hz_bool_t x_advance_only;
+    uint32_t value_count = 0, value_index;
+
+    hz_stream_read16(subtable, &pos->format);
+    hz_stream_read16(subtable, &coverage_offset);
+    hz_stream_read16(subtable, &pos->value_format1);
+    hz_stream_read16(subtable, &pos->value_format2);
+    pos->coverage = hz_coverage_create(data + coverage_offset);
+    pos->set_count = 0;
+    pos->set_pairs = NULL;
+    pos->second_glyphs = NULL;
+    pos->class_def1 = NULL;
+    pos->class_def2 = NULL;
+    pos->class1_count = 0;
+    pos->class2_count = 0;
+    pos->x_advances = NULL;
+    pos->records = NULL;
+
+    x_advance_only = (pos->value_format1 & 0x000FU) == HZ_VALUE_FORMAT_X_ADVANCE
+                     && (pos->value_format2 & 0x000FU) == 0;
+
+    if (pos->format == 1) {
+        hz_offset16_t *set_offsets;
+        uint16_t set_index;
+
+        hz_stream_read16(subtable, &pos->set_count);
+        set_offsets = HZ_MALLOC((pos->set_count ? pos->set_count : 1) * sizeof(hz_offset16_t));
+        hz_stream_read16_n(subtable, pos->set_count, set_offsets);
+
+        pos->set_pairs = HZ_MALLOC((pos->set_count + 1) * sizeof(uint32_t));
+        for (set_index = 0; set_index < pos->set_count; ++set_index) {
+            hz_stream_t *set = hz_stream_create(data + set_offsets[set_index], 0, 0);
+            uint16_t pair_count;
+            hz_stream_read16(set, &pair_count);
+            pos->set_pairs[set_index] = value_count;
+            value_count += pair_count;
+            hz_stream_destroy(set);
+        }
+        pos->set_pairs[pos->set_count] = value_count;
+
+        pos->second_glyphs = HZ_MALLOC((value_count ? value_count : 1) * sizeof(hz_index_t));
+        if (x_advance_only)
+            pos->x_advances = HZ_MALLOC((value_count ? value_count : 1) * sizeof(int16_t));
+        else
+            pos->records = HZ_MALLOC((value_count ? value_count : 1) * 2 * sizeof(hz_value_record_t));
+
+        for (set_index = 0; set_index < pos->set_count; ++set_index) {
+            hz_stream_t *set = hz_stream_create(data + set_offsets[set_index], 0, 0);
+            hz_stream_seek(set, 2);
+
+            for (value_index = pos->set_pairs[set_index]; value_index < pos->set_pairs[set_index + 1]; ++value_index) {
+                hz_value_record_t first, second;
+
+                hz_stream_read16(set, &pos->second_glyphs[value_index]);
+                hz_value_record_read(set, pos->value_format1, &first);
+                hz_value_record_read(set, pos->value_format2, &second);
+
+                if (x_advance_only) {
+                    pos->x_advances[value_index] = first.x_advance;
+                } else {
+                    pos->records[value_index * 2] = first;
+                    pos->records[value_index * 2 + 1] = second;
+                }
+            }
+
+            hz_stream_destroy(set);
+        }
+
+        HZ_FREE(set_offsets);
+    } else if (pos->format == 2) {
+        hz_offset16_t class_def1_offset, class_def2_offset;
+
+        hz_stream_read16(subtable, &class_def1_offset);
+        hz_stream_read16(subtable, &class_def2_offset);
+        hz_stream_read16(subtable, &pos->class1_count);
+        hz_stream_read16(subtable, &pos->class2_count);
+        pos->class_def1 = hz_class_def_create(data + class_def1_offset);
+        pos->class_def2 = hz_class_def_create(data + class_def2_offset);
+
+        value_count = (uint32_t) pos->class1_count * pos->class2_count;
+        if (x_advance_only)
+            pos->x_advances = HZ_MALLOC((value_count ? value_count : 1) * sizeof(int16_t));
+        else
+            pos->records = HZ_MALLOC((value_count ? value_count : 1) * 2 * sizeof(hz_value_record_t));
+
+        for (value_index = 0; value_index < value_count; ++value_index) {
+            hz_value_record_t first, second;
+
+            hz_value_record_read(subtable, pos->value_format1, &first);
+            hz_value_record_read(subtable, pos->value_format2, &second);
+
+            if (x_advance_only) {
+                pos->x_advances[value_index] = first.x_advance;
+            } else {
+                pos->records[value_index * 2] = first;
+                pos->records[value_index * 2 + 1] = second;
+            }
+        }
+    }
+
+    hz_stream_destroy(subtable);
+    return pos;
+}
+
+static void
+hz_pair_pos_destroy(hz_pair_pos_t *pos)
+{
+    hz_coverage_destroy(pos->coverage);
+    HZ_FREE(pos->set_pairs);
+    HZ_FREE(pos->second_glyphs);
+    if (pos->class_def1 != NULL) hz_class_def_destroy(pos->class_def1);
+    if (pos->class_def2 != NULL) hz_class_def_destroy(pos->class_def2);
+    HZ_FREE(pos->x_advances);
+    HZ_FREE(pos->records);
+    HZ_FREE(pos);
+}
+
+/* looks up the value of a glyph pair, returns HZ_FALSE if the pair isn't kerned */
+static hz_bool_t
+hz_pair_pos_get(const hz_pair_pos_t *pos, hz_index_t first, hz_index_t second, uint32_t *value_index)
+{
+    int32_t coverage_index;
+
+    if (pos->coverage == NULL)
+        return HZ_FALSE;
+
+    coverage_index = hz_coverage_search(pos->coverage, first);
+    if (coverage_index < 0)
+        return HZ_FALSE;
+
+    if (pos->format == 1) {
+        const hz_index_t *base;
+        uint32_t n;
+
+        if (coverage_index >= pos->set_count)
+            return HZ_FALSE;
+
+        /* branchless lower bound over the set's sorted second glyphs */
+        base = pos->second_glyphs + pos->set_pairs[coverage_index];
+        n = pos->set_pairs[coverage_index + 1] - pos->set_pairs[coverage_index];
+        if (n == 0)
+            return HZ_FALSE;
+
+        while (n > 1) {
+            uint32_t half = n >> 1;
+            base = (base[half] <= second) ? base + half : base;
+            n -= half;
+        }
+
+        if (*base != second)
+            return HZ_FALSE;
+
+        *value_index = (uint32_t) (base - pos->second_glyphs);
+        return HZ_TRUE;
+    } else if (pos->format == 2) {
+        uint16_t class1 = hz_class_def_get(pos->class_def1, first);
+        uint16_t class2 = hz_class_def_get(pos->class_def2, second);
+
+        if (class1 >= pos->class1_count || class2 >= pos->class2_count)
+            return HZ_FALSE;
+
+        *value_index = (uint32_t) class1 * pos->class2_count + class2;
+        return HZ_TRUE;
+    }
+
+    return HZ_FALSE;
+}
+
+/* entry and exit anchors of a glyph covered by a CursivePos subtable */
+typedef struct hz_entry_exit_t {
+    hz_bool_t has_entry, has_exit;
+    hz_anchor_t entry, exit;
+} hz_entry_exit_t;
+
+/* CursivePos subtable with the anchors of every covered glyph decoded */
+struct hz_cursive_pos_t {
+    hz_coverage_t *coverage;
+    uint16_t record_count;
+    hz_entry_exit_t *records;
+};
+
+static hz_cursive_pos_t *
+hz_cursive_pos_create(const hz_byte_t *data)
+{
+    hz_cursive_pos_t *pos = HZ_ALLOC(hz_cursive_pos_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    hz_offset16_t coverage_offset, entry_offset, exit_offset;
+    uint16_t format, record_index;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &coverage_offset);
+    hz_stream_read16(subtable, &pos->record_count);
+    pos->coverage = hz_coverage_create(data + coverage_offset);
+    pos->records = HZ_MALLOC((pos->record_count ? pos->record_count : 1) * sizeof(hz_entry_exit_t));
+
+    for (record_index = 0; record_index < pos->record_count; ++record_index) {
+        hz_entry_exit_t *record = &pos->records[record_index];
+
+        hz_stream_read16(subtable, &entry_offset);
+        hz_stream_read16(subtable, &exit_offset);
+        record->has_entry = entry_offset ? HZ_TRUE : HZ_FALSE;
+        record->has_exit = exit_offset ? HZ_TRUE : HZ_FALSE;
+        if (record->has_entry) record->entry = hz_anchor_decode(data + entry_offset);
+        if (record->has_exit) record->exit = hz_anchor_decode(data + exit_offset);
+    }
+
+    hz_stream_destroy(subtable);
+    return pos;
+}
+
+static void
+hz_cursive_pos_destroy(hz_cursive_pos_t *pos)
+{
+    hz_coverage_destroy(pos->coverage);
+    HZ_FREE(pos->records);
+    HZ_FREE(pos);
+}
+
+/* entry and exit anchors of a glyph, NULL if it isn't covered */
+static const hz_entry_exit_t *
+hz_cursive_pos_get(const hz_cursive_pos_t *pos, hz_index_t id)
+{
+    int32_t coverage_index;
+
+    if (pos->coverage == NULL)
+        return NULL;
+
+    coverage_index = hz_coverage_search(pos->coverage, id);
+    if (coverage_index < 0 || coverage_index >= pos->record_count)
+        return NULL;
+
+    return &pos->records[coverage_index];
+}
+
+/* slot of the attachment anchor matrix of a base, ligature component or mark
+ * that defines no anchor for the mark class */
+#define HZ_ANCHOR_NULL_COORD INT16_MIN
+
+/* MarkBasePos, MarkLigPos and MarkMarkPos subtable with every anchor decoded.
+ * The anchors the marks attach to form a dense matrix with a row per base glyph
+ * and a column per mark class. Ligatures have a row per component, the rows of
+ * ligature i are [component_rows[i], component_rows[i + 1]).
+ * */
+struct hz_mark_attach_pos_t {
+    hz_coverage_t *mark_coverage;
+    hz_coverage_t *base_coverage; /* bases, ligatures or mark2 glyphs */
+    uint16_t class_count;
+    uint16_t mark_count;
+    uint16_t *mark_classes;
+    hz_anchor_t *mark_anchors;
+    uint16_t base_count;
+    uint32_t *component_rows; /* NULL unless attaching to ligatures */
+    hz_anchor_t *base_anchors; /* row * class_count + mark class */
+};
+
+/* decodes an anchor row of the base matrix, offsets are relative to base */
+static void
+hz_mark_attach_pos_read_row(hz_mark_attach_pos_t *pos, hz_stream_t *stream,
+                            const hz_byte_t *base, uint32_t row)
+{
+    hz_anchor_t *anchors = pos->base_anchors + row * pos->class_count;
+    hz_offset16_t anchor_offset;
+    uint16_t class_index;
+
+    for (class_index = 0; class_index < pos->class_count; ++class_index) {
+        hz_stream_read16(stream, &anchor_offset);
+
+        if (anchor_offset) {
+            anchors[class_index] = hz_anchor_decode(base + anchor_offset);
+        } else {
+            anchors[class_index].x_coord = HZ_ANCHOR_NULL_COORD;
+            anchors[class_index].y_coord = HZ_ANCHOR_NULL_COORD;
+        }
+    }
+}
+
+static hz_mark_attach_pos_t *
+hz_mark_attach_pos_create(const hz_byte_t *data, hz_bool_t is_ligature)
+{
+    hz_mark_attach_pos_t *pos = HZ_ALLOC(hz_mark_attach_pos_t);
+    hz_stream_t *subtable = hz_stream_create(data, 0, 0);
+    hz_offset16_t mark_coverage_offset, base_coverage_offset;
+    hz_offset16_t mark_array_offset, base_array_offset;
+    hz_stream_t *array;
+    uint16_t format, index;
+    uint32_t row_count = 0;
+
+    hz_stream_read16(subtable, &format);
+    hz_stream_read16(subtable, &mark_coverage_offset);
+    hz_stream_read16(subtable, &base_coverage_offset);
+    hz_stream_read16(subtable, &pos->class_count);
+    hz_stream_read16(subtable, &mark_array_offset);
+    hz_stream_read16(subtable, &base_array_offset);
+    hz_stream_destroy(subtable);
+
+    pos->mark_coverage = hz_coverage_create(data + mark_coverage_offset);
+    pos->base_coverage = hz_coverage_create(data + base_coverage_offset);
+    pos->component_rows = NULL;
+
+    /* MarkArray */
+    array = hz_stream_create(data + mark_array_offset, 0, 0);
+    hz_stream_read16(array, &pos->mark_count);
+    pos->mark_classes = HZ_MALLOC((pos->mark_count ? pos->mark_count : 1) * sizeof(uint16_t));
+    pos->mark_anchors = HZ_MALLOC((pos->mark_count ? pos->mark_count : 1) * sizeof(hz_anchor_t));
+    for (index = 0; index < pos->mark_count; ++index) {
+        hz_offset16_t anchor_offset;
+
+        hz_stream_read16(array, &pos->mark_classes[index]);
+        hz_stream_read16(array, &anchor_offset);
+        pos->mark_anchors[index] = hz_anchor_decode(data + mark_array_offset + anchor_offset);
+    }
+    hz_stream_destroy(array);
+
+    /* BaseArray, Mark2Array or LigatureArray */
+    array = hz_stream_create(data + base_array_offset, 0, 0);
+    hz_stream_read16(array, &pos->base_count);
+
+    if (is_ligature) {
+        hz_offset16_t *attach_offsets = HZ_MALLOC((pos->base_count ? pos->base_count : 1) * sizeof(hz_offset16_t));
+        hz_stream_read16_n(array, pos->base_count, attach_offsets);
+
+        pos->component_rows = HZ_MALLOC((pos->base_count + 1) * sizeof(uint32_t));
+        for (index = 0; index < pos->base_count; ++index) {
+            const hz_byte_t *attach = data + base_array_offset + attach_offsets[index];
+            pos->component_rows[index] = row_count;
+            row_count += ((uint16_t) attach[0] << 8) | attach[1];
+        }
+        pos->component_rows[pos->base_count] = row_count;
+
+        pos->base_anchors = HZ_MALLOC((row_count * pos->class_count + 1) * sizeof(hz_anchor_t));
+        for (index = 0; index < pos->base_count; ++index) {
+            const hz_byte_t *attach = data + base_array_offset + attach_offsets[index];
+            hz_stream_t *components = hz_stream_create(attach, 0, 0);
+            uint32_t row;
+
+            hz_stream_seek(components, 2);
+            for (row = pos->component_rows[index]; row < pos->component_rows[index + 1]; ++row)
+                hz_mark_attach_pos_read_row(pos, components, attach, row);
+
+            hz_stream_destroy(components);
+        }
+
+        HZ_FREE(attach_offsets);
+    } else {
+        uint32_t row;
+
+        row_count = pos->base_count;
+        pos->base_anchors = HZ_MALLOC((row_count * pos->class_count + 1) * sizeof(hz_anchor_t));
+        for (row = 0; row < row_count; ++row)
+            hz_mark_attach_pos_read_row(pos, array, data + base_array_offset, row);
+    }
+
+    hz_stream_destroy(array);
+    return pos;
+}
+
+static void
+hz_mark_attach_pos_destroy(hz_mark_attach_pos_t *pos)
+{
+    hz_coverage_destroy(pos->mark_coverage);
+    hz_coverage_destroy(pos->base_coverage);
+    HZ_FREE(pos->mark_classes);
+    HZ_FREE(pos->mark_anchors);
+    HZ_FREE(pos->component_rows);
+    HZ_FREE(pos->base_anchors);
+    HZ_FREE(pos);
+}
+
+/* anchors of a mark and the glyph it attaches to, component picks the ligature
+ * component and is clamped to the last one. Returns HZ_FALSE if either glyph
+ * isn't covered or the attaching glyph has no anchor for the mark's class
+ * */
+static hz_bool_t
+hz_mark_attach_pos_get(const hz_mark_attach_pos_t *pos,
+                       hz_index_t mark_id,
+                       hz_index_t base_id,
+                       uint16_t component,
+                       hz_anchor_t *mark_anchor,
+                       hz_anchor_t *base_anchor)
+{
+    int32_t mark_index, base_index;
+    uint32_t row;
+    uint16_t mark_class;
+
+    if (pos->mark_coverage == NULL || pos->base_coverage == NULL)
+        return HZ_FALSE;
+
+    mark_index = hz_coverage_search(pos->mark_coverage, mark_id);
+    if (mark_index < 0 || mark_index >= pos->mark_count)
+        return HZ_FALSE;
+
+    mark_class = pos->mark_classes[mark_index];
+    if (mark_class >= pos->class_count)
+        return HZ_FALSE;
+
+    base_index = hz_coverage_search(pos->base_coverage, base_id);
+    if (base_index < 0 || base_index >= pos->base_count)
+        return HZ_FALSE;
+
+    if (pos->component_rows != NULL) {
+        uint32_t component_count = pos->component_rows[base_index + 1] - pos->component_rows[base_index];
+
+        if (!component_count)
+            return HZ_FALSE;
+
+        if (component >= component_count)
+            component = component_count - 1;
+
+        row = pos->component_rows[base_index] + component;
+    } else {
+        row = base_index;
+    }
+
+    *base_anchor = pos->base_anchors[row * pos->class_count + mark_class];
+    if (base_anchor->x_coord == HZ_ANCHOR_NULL_COORD && base_anchor->y_coord == HZ_ANCHOR_NULL_COORD)
+        return HZ_FALSE;
+
+    *mark_anchor = pos->mark_anchors[mark_index];
+    return HZ_TRUE;
+}
 
+/* compiles the subtable types that have a compiled form, others are applied
+ * straight from the raw data */
+static void
+hz_lookup_subtable_compile(hz_lookup_subtable_t *subtable,
+                           uint16_t lookup_type,
+                           hz_bool_t is_gsub)
+{
+    if (is_gsub) {
         switch (lookup_type) {
-            case HZ_GSUB_LOOKUP_TYPE_SINGLE_SUBSTITUTION: {
-                if (format == 1) {
-                    hz_offset16_t coverage_offset;
-                    int16_t id_delta;
-                    hz_stream_read16(subtable, &coverage_offset);
-                    hz_stream_read16(subtable, (uint16_t *) &id_delta);
-                    /* NOTE: Implement */
-                } else if (format == 2) {
-                    hz_map_t *map_subst = hz_map_create();
-                    hz_offset16_t coverage_offset;
-                    uint16_t glyph_count;
-                    hz_array_t *subst = hz_array_create();
-                    hz_stream_read16(subtable, &coverage_offset);
-                    hz_stream_read16(subtable, &glyph_count);
+            case HZ_GSUB_LOOKUP_TYPE_SINGLE_SUBSTITUTION:
+                if (subtable->format == 1 || subtable->format == 2)
+                    subtable->compiled.single_subst = hz_single_subst_create(subtable->data);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_MULTIPLE_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_ALTERNATE_SUBSTITUTION:
+                if (subtable->format == 1)
+                    subtable->compiled.multiple_subst = hz_multiple_subst_create(subtable->data);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION:
+                if (subtable->format == 1)
+                    subtable->compiled.ligature_subst = hz_ligature_subst_create(subtable->data);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION:
+                if (subtable->format >= 1 && subtable->format <= 3)
+                    subtable->compiled.context = hz_context_create(subtable->data,
+                            lookup_type == HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION:
+                if (subtable->format == 1)
+                    subtable->compiled.reverse_chain_subst = hz_reverse_chain_subst_create(subtable->data);
+                break;
+        }
+    } else {
+        switch (lookup_type) {
+            case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT:
+                if (subtable->format == 1 || subtable->format == 2)
+                    subtable->compiled.single_pos = hz_single_pos_create(subtable->data);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT:
+                if (subtable->format == 1 || subtable->format == 2)
+                    subtable->compiled.pair_pos = hz_pair_pos_create(subtable->data);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT:
+                if (subtable->format == 1)
+                    subtable->compiled.cursive_pos = hz_cursive_pos_create(subtable->data);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+                if (subtable->format == 1)
+                    subtable->compiled.mark_attach_pos = hz_mark_attach_pos_create(subtable->data,
+                            lookup_type == HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING:
+            case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING:
+                if (subtable->format >= 1 && subtable->format <= 3)
+                    subtable->compiled.context = hz_context_create(subtable->data,
+                            lookup_type == HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING);
+                break;
+        }
+    }
+}
 
-                    /* Get destination glyph indices */
-                    uint16_t dst_gidx;
-                    for (dst_gidx = 0; dst_gidx < glyph_count; ++dst_gidx) {
-                        hz_index_t substitute_glyph;
-                        hz_stream_read16(subtable, &substitute_glyph);
-                        hz_array_push_back(subst, substitute_glyph);
-                    }
+static void
+hz_lookup_subtable_release(hz_lookup_subtable_t *subtable,
+                           uint16_t lookup_type,
+                           hz_bool_t is_gsub)
+{
+    if (is_gsub) {
+        switch (lookup_type) {
+            case HZ_GSUB_LOOKUP_TYPE_SINGLE_SUBSTITUTION:
+                if (subtable->compiled.single_subst != NULL)
+                    hz_single_subst_destroy(subtable->compiled.single_subst);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_MULTIPLE_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_ALTERNATE_SUBSTITUTION:
+                if (subtable->compiled.multiple_subst != NULL)
+                    hz_multiple_subst_destroy(subtable->compiled.multiple_subst);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION:
+                if (subtable->compiled.ligature_subst != NULL)
+                    hz_ligature_subst_destroy(subtable->compiled.ligature_subst);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION:
+                if (subtable->compiled.context != NULL)
+                    hz_context_destroy(subtable->compiled.context);
+                break;
+            case HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION:
+                if (subtable->compiled.reverse_chain_subst != NULL)
+                    hz_reverse_chain_subst_destroy(subtable->compiled.reverse_chain_subst);
+                break;
+        }
+    } else {
+        switch (lookup_type) {
+            case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT:
+                if (subtable->compiled.single_pos != NULL)
+                    hz_single_pos_destroy(subtable->compiled.single_pos);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT:
+                if (subtable->compiled.pair_pos != NULL)
+                    hz_pair_pos_destroy(subtable->compiled.pair_pos);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT:
+                if (subtable->compiled.cursive_pos != NULL)
+                    hz_cursive_pos_destroy(subtable->compiled.cursive_pos);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+                if (subtable->compiled.mark_attach_pos != NULL)
+                    hz_mark_attach_pos_destroy(subtable->compiled.mark_attach_pos);
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING:
+            case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING:
+                if (subtable->compiled.context != NULL)
+                    hz_context_destroy(subtable->compiled.context);
+                break;
+        }
+    }
+}
 
-                    /* Read coverage offset */
-                    hz_ot_layout_parse_coverage(subtable->data + coverage_offset, map_subst, subst);
-
-                    /* Substitute glyphs */
-                    hz_sequence_node_t *g = sect->root;
-
-                    while (g != NULL) {
-                        hz_index_t curr_id = g->id;
-
-                        if (hz_map_value_exists(map_subst, curr_id)) {
-                            switch (feature) {
-                                case HZ_FEATURE_ISOL:
-                                case HZ_FEATURE_MEDI:
-                                case HZ_FEATURE_MED2:
-                                case HZ_FEATURE_INIT:
-                                case HZ_FEATURE_FINA:
-                                case HZ_FEATURE_FIN2:
-                                case HZ_FEATURE_FIN3:
-                                    if (hz_ot_shape_complex_arabic_join(feature, g)) {
-                                        g->id = hz_map_get_value(map_subst, curr_id);
-                                    }
-                                    break;
-                            }
-                        }
-                        g = g->next;
-                    }
+/* empty slot of the kern pair hash, no glyph pair can produce it */
+#define HZ_KERN_PAIR_EMPTY 0xFFFFFFFFU
+
+/* legacy 'kern' table, the horizontal subtables of format 0 and 2 merged
+ * into one open-addressed hash keyed by (left << 16) | right
+ * */
+struct hz_kern_table_t {
+    uint32_t capacity; /* power of two */
+    uint32_t shift; /* 32 - log2(capacity) */
+    uint32_t count;
+    uint32_t *keys;
+    int16_t *values;
+};
+
+static uint32_t
+hz_kern_pair_hash(uint32_t key, uint32_t shift)
+{
+    /* fibonacci hashing, the top log2(capacity) bits are the best mixed */
+    return (uint32_t) (key * 2654435769U) >> shift;
+}
+
+/* slot of key, or the empty slot it would go in */
+static uint32_t
+hz_kern_table_find(const hz_kern_table_t *kern, uint32_t key)
+{
+    uint32_t slot = hz_kern_pair_hash(key, kern->shift);
+
+    while (kern->keys[slot] != key && kern->keys[slot] != HZ_KERN_PAIR_EMPTY)
+        slot = (slot + 1) & (kern->capacity - 1);
+
+    return slot;
+}
+
+static void
+hz_kern_table_grow(hz_kern_table_t *kern)
+{
+    uint32_t *keys = kern->keys;
+    int16_t *values = kern->values;
+    uint32_t capacity = kern->capacity;
+    uint32_t i;
+
+    kern->capacity = capacity ? capacity * 2 : 64;
+    kern->shift = capacity ? kern->shift - 1 : 32 - 6;
+    kern->keys = HZ_MALLOC(kern->capacity * sizeof(uint32_t));
+    kern->values = HZ_MALLOC(kern->capacity * sizeof(int16_t));
+    memset(kern->keys, 0xFF, kern->capacity * sizeof(uint32_t));
+
+    for (i = 0; i < capacity; ++i) {
+        if (keys[i] != HZ_KERN_PAIR_EMPTY) {
+            uint32_t slot = hz_kern_table_find(kern, keys[i]);
+            kern->keys[slot] = keys[i];
+            kern->values[slot] = values[i];
+        }
+    }
+
+    HZ_FREE(keys);
+    HZ_FREE(values);
+}
+
+/* adds value to the pair's kerning, or replaces it for override subtables */
+static void
+hz_kern_table_add(hz_kern_table_t *kern, hz_index_t left, hz_index_t right,
+                  int16_t value, hz_bool_t override)
+{
+    uint32_t key = ((uint32_t) left << 16) | right;
+    uint32_t slot;
+
+    /* keep the load factor at or under one half */
+    if ((kern->count + 1) * 2 > kern->capacity)
+        hz_kern_table_grow(kern);
+
+    slot = hz_kern_table_find(kern, key);
+    if (kern->keys[slot] == HZ_KERN_PAIR_EMPTY) {
+        kern->keys[slot] = key;
+        kern->values[slot] = value;
+        ++kern->count;
+    } else {
+        kern->values[slot] = override ? value : (int16_t) (kern->values[slot] + value);
+    }
+}
+
+static int16_t
+hz_kern_table_get(const hz_kern_table_t *kern, hz_index_t left, hz_index_t right)
+{
+    uint32_t key = ((uint32_t) left << 16) | right;
+    uint32_t slot = hz_kern_table_find(kern, key);
+    return kern->keys[slot] == key ? kern->values[slot] : 0;
+}
+
+#define HZ_KERN_COVERAGE_HORIZONTAL 0x0001
+#define HZ_KERN_COVERAGE_MINIMUM 0x0002
+#define HZ_KERN_COVERAGE_CROSS_STREAM 0x0004
+#define HZ_KERN_COVERAGE_OVERRIDE 0x0008
+
+/* reads a format 2 class table, the class values of glyphs outside of it are 0 */
+static void
+hz_kern_read_class_table(const hz_byte_t *data, hz_index_t *first_glyph, uint16_t *glyph_count,
+                         uint16_t **classes)
+{
+    hz_stream_t *table = hz_stream_create(data, 0, 0);
+    hz_stream_read16(table, first_glyph);
+    hz_stream_read16(table, glyph_count);
+    *classes = HZ_MALLOC((*glyph_count ? *glyph_count : 1) * sizeof(uint16_t));
+    hz_stream_read16_n(table, *glyph_count, *classes);
+    hz_stream_destroy(table);
+}
+
+/* merges a format 2 subtable into the hash, every kerned pair of the class
+ * array is expanded to its glyph pairs */
+static void
+hz_kern_table_add_format2(hz_kern_table_t *kern, const hz_byte_t *data,
+                          size_t length, hz_bool_t override)
+{
+    hz_stream_t *subtable = hz_stream_create(data + 6, 0, 0);
+    uint16_t row_width;
+    hz_offset16_t left_offset, right_offset, array_offset;
+    hz_index_t left_first, right_first;
+    uint16_t left_count, right_count;
+    uint16_t *left_classes, *right_classes;
+    uint16_t l, r;
+
+    hz_stream_read16(subtable, &row_width);
+    hz_stream_read16(subtable, &left_offset);
+    hz_stream_read16(subtable, &right_offset);
+    hz_stream_read16(subtable, &array_offset);
+    hz_stream_destroy(subtable);
+
+    hz_kern_read_class_table(data + left_offset, &left_first, &left_count, &left_classes);
+    hz_kern_read_class_table(data + right_offset, &right_first, &right_count, &right_classes);
+
+    for (l = 0; l < left_count; ++l) {
+        for (r = 0; r < right_count; ++r) {
+            /* class values are byte offsets from the subtable, the left ones
+             * pre-multiplied by the row width */
+            uint32_t offset = (uint32_t) left_classes[l] + right_classes[r];
+            int16_t value;
+
+            if (offset < array_offset || offset + 2 > length)
+                continue;
+
+            value = (int16_t) (((uint16_t) data[offset] << 8) | data[offset + 1]);
+            if (value != 0)
+                hz_kern_table_add(kern, left_first + l, right_first + r, value, override);
+        }
+    }
+
+    HZ_FREE(left_classes);
+    HZ_FREE(right_classes);
+}
+
+/* compiles the horizontal, non cross-stream kerning subtables of a version 0
+ * 'kern' table, returns NULL if there is nothing to kern with */
+static hz_kern_table_t *
+hz_kern_table_create(const hz_byte_t *data, size_t size)
+{
+    hz_kern_table_t *kern;
+    hz_stream_t *table;
+    uint16_t version, subtable_count, subtable_index;
+    size_t offset = 4, next_offset;
+
+    if (data == NULL || size < 4)
+        return NULL;
+
+    table = hz_stream_create(data, 0, 0);
+    hz_stream_read16(table, &version);
+    hz_stream_read16(table, &subtable_count);
+    hz_stream_destroy(table);
+
+    /* version 1.0 (Apple AAT) kern tables are deliberately ignored */
+    if (version != 0)
+        return NULL;
+
+    kern = HZ_ALLOC(hz_kern_table_t);
+    kern->capacity = 0;
+    kern->shift = 32;
+    kern->count = 0;
+    kern->keys = NULL;
+    kern->values = NULL;
+
+    for (subtable_index = 0; subtable_index < subtable_count && offset + 6 <= size; ++subtable_index) {
+        const hz_byte_t *subtable_data = data + offset;
+        hz_stream_t *subtable = hz_stream_create(subtable_data, 0, 0);
+        uint16_t subtable_version, length, coverage;
+        hz_bool_t override;
+
+        hz_stream_read16(subtable, &subtable_version);
+        hz_stream_read16(subtable, &length);
+        hz_stream_read16(subtable, &coverage);
+        override = (coverage & HZ_KERN_COVERAGE_OVERRIDE) != 0;
+
+        if (coverage >> 8 == 0 && offset + 14 <= size) {
+            /* large format 0 subtables overflow their 16-bit length,
+             * the pair count gives the real one */
+            uint16_t pair_count;
+            hz_stream_read16(subtable, &pair_count);
+            hz_stream_seek(subtable, -2);
+            next_offset = offset + 14 + (size_t) pair_count * 6;
+        } else {
+            next_offset = offset + (length < 6 ? 6 : length);
+        }
+
+        if (next_offset > size)
+            next_offset = size;
+
+        if ((coverage & HZ_KERN_COVERAGE_HORIZONTAL)
+            && !(coverage & (HZ_KERN_COVERAGE_MINIMUM | HZ_KERN_COVERAGE_CROSS_STREAM))) {
+            switch (coverage >> 8) {
+                case 0: {
+                    uint16_t pair_count, pair_index;
+                    hz_stream_read16(subtable, &pair_count);
+                    hz_stream_seek(subtable, 6); /* binary search header */
+
+                    for (pair_index = 0; pair_index < pair_count
+                         && offset + subtable->offset + 6 <= next_offset; ++pair_index) {
+                        hz_index_t left, right;
+                        int16_t value;
+                        hz_stream_read16(subtable, &left);
+                        hz_stream_read16(subtable, &right);
+                        hz_stream_read16(subtable, (uint16_t *) &value);
+                        hz_kern_table_add(kern, left, right, value, override);
+                    }
+                    break;
+                }
+                case 2:
+                    hz_kern_table_add_format2(kern, subtable_data, next_offset - offset, override);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        hz_stream_destroy(subtable);
+        offset = next_offset;
+    }
+
+    if (kern->count == 0) {
+        HZ_FREE(kern->keys);
+        HZ_FREE(kern->values);
+        HZ_FREE(kern);
+        return NULL;
+    }
+
+    return kern;
+}
+
+static void
+hz_kern_table_destroy(hz_kern_table_t *kern)
+{
+    HZ_FREE(kern->keys);
+    HZ_FREE(kern->values);
+    HZ_FREE(kern);
+}
+
+/* checks whether the GPOS FeatureList has a 'kern' feature with any lookups */
+static hz_bool_t
+hz_ot_layout_gpos_has_kerning(const hz_byte_t *data)
+{
+    hz_stream_t *table, *feature_list;
+    uint32_t version;
+    uint16_t script_list_offset, feature_list_offset;
+    uint16_t feature_count, feature_index;
+    hz_bool_t has_kerning = HZ_FALSE;
+
+    if (data == NULL)
+        return HZ_FALSE;
+
+    table = hz_stream_create(data, 0, 0);
+    hz_stream_read32(table, &version);
+    hz_stream_read16(table, &script_list_offset);
+    hz_stream_read16(table, &feature_list_offset);
+    hz_stream_destroy(table);
+
+    feature_list = hz_stream_create(data + feature_list_offset, 0, 0);
+    hz_stream_read16(feature_list, &feature_count);
+
+    for (feature_index = 0; feature_index < feature_count && !has_kerning; ++feature_index) {
+        hz_tag_t tag;
+        hz_offset16_t offset;
+        hz_stream_read32(feature_list, &tag);
+        hz_stream_read16(feature_list, &offset);
+
+        if (tag == HZ_TAG('k','e','r','n')) {
+            hz_stream_t *feature = hz_stream_create(feature_list->data + offset, 0, 0);
+            uint16_t feature_params, lookup_count;
+            hz_stream_read16(feature, &feature_params);
+            hz_stream_read16(feature, &lookup_count);
+            has_kerning = lookup_count != 0;
+            hz_stream_destroy(feature);
+        }
+    }
+
+    hz_stream_destroy(feature_list);
+    return has_kerning;
+}
+
+static hz_lookup_table_t *
+hz_ot_layout_compile_lookups(const hz_byte_t *data,
+                             hz_bool_t is_gsub,
+                             uint16_t *lookup_count)
+{
+    hz_stream_t *header, *lookup_list;
+    hz_lookup_table_t *lookups;
+    uint32_t version;
+    uint16_t script_list_offset, feature_list_offset, lookup_list_offset;
+    uint16_t extension_type = is_gsub ? HZ_GSUB_LOOKUP_TYPE_EXTENSION_SUBSTITUTION
+                                      : HZ_GPOS_LOOKUP_TYPE_EXTENSION_POSITIONING;
+    uint16_t lookup_index;
+
+    *lookup_count = 0;
+    if (data == NULL)
+        return NULL;
+
+    /* GSUB and GPOS share the same header up to the LookupList offset */
+    header = hz_stream_create(data, 0, 0);
+    hz_stream_read32(header, &version);
+    hz_stream_read16(header, &script_list_offset);
+    hz_stream_read16(header, &feature_list_offset);
+    hz_stream_read16(header, &lookup_list_offset);
+    hz_stream_destroy(header);
+
+    if (version != 0x00010000 && version != 0x00010001)
+        return NULL;
+
+    lookup_list = hz_stream_create(data + lookup_list_offset, 0, 0);
+    hz_stream_read16(lookup_list, lookup_count);
+    lookups = HZ_MALLOC((*lookup_count ? *lookup_count : 1) * sizeof(hz_lookup_table_t));
+
+    for (lookup_index = 0; lookup_index < *lookup_count; ++lookup_index) {
+        hz_lookup_table_t *lookup = &lookups[lookup_index];
+        hz_offset16_t lookup_offset;
+        hz_stream_t *table;
+        uint16_t subtable_index;
+
+        hz_stream_read16(lookup_list, &lookup_offset);
+        table = hz_stream_create(lookup_list->data + lookup_offset, 0, 0);
+        hz_stream_read16(table, &lookup->lookup_type);
+        hz_stream_read16(table, &lookup->lookup_flags);
+        hz_stream_read16(table, &lookup->subtable_count);
+        lookup->subtables = HZ_MALLOC((lookup->subtable_count ? lookup->subtable_count : 1)
+                                      * sizeof(hz_lookup_subtable_t));
+
+        for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+            hz_lookup_subtable_t *subtable = &lookup->subtables[subtable_index];
+            hz_offset16_t subtable_offset;
+            hz_stream_read16(table, &subtable_offset);
+            subtable->data = table->data + subtable_offset;
+            subtable->compiled.ligature_subst = NULL;
+        }
+
+        lookup->mark_filtering_set = 0;
+        if (lookup->lookup_flags & HZ_LOOKUP_FLAG_USE_MARK_FILTERING_SET)
+            hz_stream_read16(table, &lookup->mark_filtering_set);
+
+        hz_stream_destroy(table);
+
+        if (lookup->lookup_type == extension_type) {
+            /* resolve extension subtables, they all share the same real lookup type */
+            for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+                hz_lookup_subtable_t *subtable = &lookup->subtables[subtable_index];
+                hz_stream_t *extension = hz_stream_create(subtable->data, 0, 0);
+                uint16_t extension_format, extension_lookup_type;
+                hz_offset32_t extension_offset;
+                hz_stream_read16(extension, &extension_format);
+                hz_stream_read16(extension, &extension_lookup_type);
+                hz_stream_read32(extension, &extension_offset);
+                subtable->data += extension_offset;
+                lookup->lookup_type = extension_lookup_type;
+                hz_stream_destroy(extension);
+            }
+        }
+
+        for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+            hz_lookup_subtable_t *subtable = &lookup->subtables[subtable_index];
+            subtable->format = ((uint16_t) subtable->data[0] << 8) | subtable->data[1];
+            hz_lookup_subtable_compile(subtable, lookup->lookup_type, is_gsub);
+        }
+    }
+
+    hz_stream_destroy(lookup_list);
+    return lookups;
+}
+
+static void
+hz_ot_layout_release_lookups(hz_lookup_table_t *lookups,
+                             uint16_t lookup_count,
+                             hz_bool_t is_gsub)
+{
+    uint16_t lookup_index, subtable_index;
+
+    for (lookup_index = 0; lookup_index < lookup_count; ++lookup_index) {
+        hz_lookup_table_t *lookup = &lookups[lookup_index];
+
+        for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index)
+            hz_lookup_subtable_release(&lookup->subtables[subtable_index], lookup->lookup_type, is_gsub);
+
+        HZ_FREE(lookup->subtables);
+    }
+
+    HZ_FREE(lookups);
+}
+
+hz_glyph_class_t
+hz_ignored_classes_from_lookup_flags(hz_lookup_flag_t flags)
+{
+    hz_glyph_class_t ignored_classes = HZ_GLYPH_CLASS_ZERO;
+
+    if (flags & HZ_LOOKUP_FLAG_IGNORE_MARKS) ignored_classes |= HZ_GLYPH_CLASS_MARK;
+    if (flags & HZ_LOOKUP_FLAG_IGNORE_BASE_GLYPHS) ignored_classes |= HZ_GLYPH_CLASS_BASE;
+    if (flags & HZ_LOOKUP_FLAG_IGNORE_LIGATURES) ignored_classes |= HZ_GLYPH_CLASS_LIGATURE;
+
+    return ignored_classes;
+}
+
+/* sets the bit of every glyph of the coverage below glyph_count */
+static void
+hz_coverage_fill_bitset(const hz_coverage_t *coverage, uint64_t *bitset, uint32_t glyph_count)
+{
+    uint16_t i;
+
+    if (coverage->format == 1) {
+        for (i = 0; i < coverage->count; ++i)
+            if (coverage->glyphs[i] < glyph_count)
+                bitset[coverage->glyphs[i] >> 6] |= (uint64_t) 1 << (coverage->glyphs[i] & 63);
+    } else {
+        for (i = 0; i < coverage->count; ++i) {
+            uint32_t id;
+
+            for (id = coverage->ranges[i].start_glyph_id;
+                 id <= coverage->ranges[i].end_glyph_id && id < glyph_count; ++id)
+                bitset[id >> 6] |= (uint64_t) 1 << (id & 63);
+        }
+    }
+}
+
+/* compiles the coordinates of the GDEF ligature carets into one array. Carets
+ * placed on a contour point need the outline, ligatures with any of them get
+ * no carets */
+static void
+hz_ot_layout_compile_lig_carets(hz_ot_layout_t *layout, const hz_byte_t *data)
+{
+    hz_stream_t *list = hz_stream_create(data, 0, 0);
+    hz_offset16_t coverage_offset;
+    uint16_t lig_glyph_count, lig_index;
+    uint32_t caret_count = 0;
+
+    hz_stream_read16(list, &coverage_offset);
+    hz_stream_read16(list, &lig_glyph_count);
+
+    layout->lig_caret_coverage = hz_coverage_create(data + coverage_offset);
+    if (layout->lig_caret_coverage == NULL) {
+        hz_stream_destroy(list);
+        return;
+    }
+
+    /* the carets are counted first, then read */
+    for (lig_index = 0; lig_index < lig_glyph_count; ++lig_index) {
+        hz_offset16_t lig_glyph_offset;
+        hz_stream_t *lig_glyph;
+        uint16_t count;
+
+        hz_stream_read16(list, &lig_glyph_offset);
+        lig_glyph = hz_stream_create(data + lig_glyph_offset, 0, 0);
+        hz_stream_read16(lig_glyph, &count);
+        caret_count += count;
+        hz_stream_destroy(lig_glyph);
+    }
+
+    layout->lig_caret_starts = HZ_MALLOC(((size_t) lig_glyph_count + 1) * sizeof(uint32_t));
+    layout->lig_carets = HZ_MALLOC((caret_count ? caret_count : 1) * sizeof(int16_t));
+    layout->lig_caret_starts[0] = 0;
+
+    hz_stream_seek(list, -2 * (int) lig_glyph_count);
+    for (lig_index = 0; lig_index < lig_glyph_count; ++lig_index) {
+        hz_offset16_t lig_glyph_offset;
+        hz_stream_t *lig_glyph;
+        uint32_t start = layout->lig_caret_starts[lig_index], end = start;
+        uint16_t count, caret_index;
+
+        hz_stream_read16(list, &lig_glyph_offset);
+        lig_glyph = hz_stream_create(data + lig_glyph_offset, 0, 0);
+        hz_stream_read16(lig_glyph, &count);
+
+        for (caret_index = 0; caret_index < count; ++caret_index) {
+            hz_offset16_t caret_offset;
+            hz_stream_t *caret;
+            uint16_t format, coordinate;
+
+            hz_stream_read16(lig_glyph, &caret_offset);
+            caret = hz_stream_create(lig_glyph->data + caret_offset, 0, 0);
+            hz_stream_read16(caret, &format);
+            hz_stream_read16(caret, &coordinate);
+            hz_stream_destroy(caret);
+
+            /* format 3 adds a device table, only the coordinate is used */
+            if (format != 1 && format != 3) {
+                end = start;
+                break;
+            }
+
+            layout->lig_carets[end++] = (int16_t) coordinate;
+        }
+
+        layout->lig_caret_starts[lig_index + 1] = end;
+        hz_stream_destroy(lig_glyph);
+    }
+
+    layout->lig_glyph_count = lig_glyph_count;
+    hz_stream_destroy(list);
+}
+
+/* compiles the GDEF mark attachment classes into a per glyph array and, like the
+ * mark glyph sets, into glyph bitsets, so lookup filters test a mark with one bit */
+static void
+hz_ot_layout_compile_gdef(hz_ot_layout_t *layout, const hz_byte_t *data)
+{
+    hz_stream_t *header;
+    uint32_t version, id;
+    hz_offset16_t glyph_class_def_offset, attach_list_offset, lig_caret_list_offset;
+    hz_offset16_t mark_attach_class_def_offset, mark_glyph_sets_def_offset = 0;
+
+    layout->mark_attach_classes = NULL;
+    layout->mark_attach_class_count = 0;
+    layout->mark_attach_class_glyphs = NULL;
+    layout->mark_glyph_set_count = 0;
+    layout->mark_glyph_sets = NULL;
+    layout->bitset_words = (layout->glyph_count + 63) / 64;
+    layout->lig_caret_coverage = NULL;
+    layout->lig_glyph_count = 0;
+    layout->lig_caret_starts = NULL;
+    layout->lig_carets = NULL;
+
+    if (data == NULL || !layout->glyph_count)
+        return;
+
+    header = hz_stream_create(data, 0, 0);
+    hz_stream_read32(header, &version);
+    hz_stream_read16(header, &glyph_class_def_offset);
+    hz_stream_read16(header, &attach_list_offset);
+    hz_stream_read16(header, &lig_caret_list_offset);
+    hz_stream_read16(header, &mark_attach_class_def_offset);
+    if (version >= 0x00010002)
+        hz_stream_read16(header, &mark_glyph_sets_def_offset);
+    hz_stream_destroy(header);
+
+    if (version >> 16 != 1)
+        return;
+
+    if (mark_attach_class_def_offset) {
+        hz_class_def_t *class_def = hz_class_def_create(data + mark_attach_class_def_offset);
+
+        if (class_def != NULL) {
+            uint16_t class_count = 1;
+
+            /* the lookup flags hold the attachment type in 8 bits */
+            layout->mark_attach_classes = HZ_MALLOC(layout->glyph_count);
+            for (id = 0; id < layout->glyph_count; ++id) {
+                uint16_t glyph_class = hz_class_def_get(class_def, (hz_index_t) id);
+                layout->mark_attach_classes[id] = glyph_class <= 0xFF ? (uint8_t) glyph_class : 0;
+                if (layout->mark_attach_classes[id] >= class_count)
+                    class_count = layout->mark_attach_classes[id] + 1;
+            }
+
+            layout->mark_attach_class_count = class_count;
+            layout->mark_attach_class_glyphs = calloc((size_t) class_count * layout->bitset_words,
+                                                      sizeof(uint64_t));
+            for (id = 0; id < layout->glyph_count; ++id) {
+                uint64_t *bitset = layout->mark_attach_class_glyphs
+                    + layout->mark_attach_classes[id] * layout->bitset_words;
+                bitset[id >> 6] |= (uint64_t) 1 << (id & 63);
+            }
+
+            hz_class_def_destroy(class_def);
+        }
+    }
+
+    if (mark_glyph_sets_def_offset) {
+        hz_stream_t *sets = hz_stream_create(data + mark_glyph_sets_def_offset, 0, 0);
+        uint16_t format, set_index;
+
+        hz_stream_read16(sets, &format);
+        if (format == 1) {
+            hz_stream_read16(sets, &layout->mark_glyph_set_count);
+            layout->mark_glyph_sets = calloc((size_t) (layout->mark_glyph_set_count ? layout->mark_glyph_set_count : 1)
+                                             * layout->bitset_words, sizeof(uint64_t));
+
+            for (set_index = 0; set_index < layout->mark_glyph_set_count; ++set_index) {
+                hz_offset32_t coverage_offset;
+                hz_coverage_t *coverage;
+
+                hz_stream_read32(sets, &coverage_offset);
+                coverage = hz_coverage_create(sets->data + coverage_offset);
+                if (coverage != NULL) {
+                    hz_coverage_fill_bitset(coverage,
+                                            layout->mark_glyph_sets + set_index * layout->bitset_words,
+                                            layout->glyph_count);
+                    hz_coverage_destroy(coverage);
+                }
+            }
+        }
+
+        hz_stream_destroy(sets);
+    }
+
+    if (lig_caret_list_offset)
+        hz_ot_layout_compile_lig_carets(layout, data + lig_caret_list_offset);
+}
+
+/* filters of a lookup whose mark glyph set or attachment class isn't in GDEF,
+ * no mark belongs to them */
+static const uint64_t hz_empty_glyph_bitset[1] = { 0 };
+
+/* compiles the glyph filter of every lookup from its flags and the GDEF bitsets */
+static void
+hz_ot_layout_compile_filters(const hz_ot_layout_t *layout,
+                             hz_lookup_table_t *lookups,
+                             uint16_t lookup_count)
+{
+    uint16_t lookup_index;
+
+    for (lookup_index = 0; lookup_index < lookup_count; ++lookup_index) {
+        hz_lookup_table_t *lookup = &lookups[lookup_index];
+        hz_glyph_filter_t *filter = &lookup->filter;
+        uint16_t attach_type = lookup->lookup_flags >> 8;
+
+        filter->gcignore = hz_ignored_classes_from_lookup_flags(lookup->lookup_flags);
+        filter->mark_glyphs = NULL;
+        filter->glyph_count = layout->glyph_count;
+
+        /* the mark filtering set takes precedence over the attachment type */
+        if (lookup->lookup_flags & HZ_LOOKUP_FLAG_USE_MARK_FILTERING_SET) {
+            if (lookup->mark_filtering_set < layout->mark_glyph_set_count)
+                filter->mark_glyphs = layout->mark_glyph_sets
+                    + lookup->mark_filtering_set * layout->bitset_words;
+        } else if (attach_type) {
+            if (attach_type < layout->mark_attach_class_count)
+                filter->mark_glyphs = layout->mark_attach_class_glyphs
+                    + attach_type * layout->bitset_words;
+        } else {
+            continue;
+        }
+
+        if (filter->mark_glyphs == NULL) {
+            filter->mark_glyphs = hz_empty_glyph_bitset;
+            filter->glyph_count = 0;
+        }
+    }
+}
+
+hz_ot_layout_t *
+hz_ot_layout_create(hz_face_t *face)
+{
+    const hz_face_ot_tables_t *tables = hz_face_get_ot_tables(face);
+    hz_ot_layout_t *layout = HZ_ALLOC(hz_ot_layout_t);
+    hz_blob_t *kern_blob;
+
+    layout->glyph_count = hz_face_get_num_glyphs(face);
+    hz_ot_layout_compile_gdef(layout, tables->GDEF_table);
+
+    layout->gsub_lookups = hz_ot_layout_compile_lookups(tables->GSUB_table, HZ_TRUE,
+                                                        &layout->gsub_lookup_count);
+    layout->gpos_lookups = hz_ot_layout_compile_lookups(tables->GPOS_table, HZ_FALSE,
+                                                        &layout->gpos_lookup_count);
+    hz_ot_layout_compile_filters(layout, layout->gsub_lookups, layout->gsub_lookup_count);
+    hz_ot_layout_compile_filters(layout, layout->gpos_lookups, layout->gpos_lookup_count);
+    layout->gpos_has_kerning = hz_ot_layout_gpos_has_kerning(tables->GPOS_table);
+
+    kern_blob = hz_face_reference_table(face, HZ_TAG('k','e','r','n'));
+    layout->kern_table = kern_blob != NULL
+        ? hz_kern_table_create(hz_blob_get_data(kern_blob), hz_blob_get_size(kern_blob))
+        : NULL;
+    return layout;
+}
+
+void
+hz_ot_layout_destroy(hz_ot_layout_t *layout)
+{
+    if (layout->gsub_lookups != NULL)
+        hz_ot_layout_release_lookups(layout->gsub_lookups, layout->gsub_lookup_count, HZ_TRUE);
+
+    if (layout->gpos_lookups != NULL)
+        hz_ot_layout_release_lookups(layout->gpos_lookups, layout->gpos_lookup_count, HZ_FALSE);
+
+    if (layout->kern_table != NULL)
+        hz_kern_table_destroy(layout->kern_table);
+
+    HZ_FREE(layout->mark_attach_classes);
+    HZ_FREE(layout->mark_attach_class_glyphs);
+    HZ_FREE(layout->mark_glyph_sets);
+    hz_coverage_destroy(layout->lig_caret_coverage);
+    HZ_FREE(layout->lig_caret_starts);
+    HZ_FREE(layout->lig_carets);
+    HZ_FREE(layout);
+}
+
+uint16_t
+hz_ot_layout_get_ligature_carets(const hz_ot_layout_t *layout, hz_index_t id, const int16_t **carets)
+{
+    int32_t index;
+
+    if (layout == NULL || layout->lig_caret_coverage == NULL)
+        return 0;
+
+    index = hz_coverage_search(layout->lig_caret_coverage, id);
+    if (index < 0 || index >= layout->lig_glyph_count)
+        return 0;
+
+    *carets = layout->lig_carets + layout->lig_caret_starts[index];
+    return (uint16_t) (layout->lig_caret_starts[index + 1] - layout->lig_caret_starts[index]);
+}
+
+#define HZ_MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* index of the first input glyph past index not skipped by the lookup's filter,
+ * the sequence's length if there is none */
+static size_t
+hz_next_index_not_ignored(const hz_sequence_t *sect, size_t index, const hz_glyph_filter_t *filter)
+{
+    /* the skip index is only built once there is something to skip */
+    if (index + 1 >= sect->length || !hz_glyph_filter_skips(filter, &sect->nodes[index + 1]))
+        return index + 1;
+
+    return hz_sequence_next_index(sect, index, filter);
+}
+
+/* walks back over the glyphs already output, count is the number of output glyphs
+ * left to look at, returns NULL once they are exhausted
+ * */
+static const hz_sequence_node_t *
+hz_prev_output_not_ignored(const hz_sequence_t *sect, size_t *count, const hz_glyph_filter_t *filter)
+{
+    if (*count == 0)
+        return NULL;
+
+    if (hz_glyph_filter_skips(filter, &sect->out_nodes[*count - 1])) {
+        *count = hz_sequence_prev_output_index(sect, *count, filter);
+        if (*count == 0)
+            return NULL;
+    }
+
+    return &sect->out_nodes[--(*count)];
+}
+
+/* walks the trie of the LigatureSet of the glyph at the cursor along the following
+ * non-ignored glyphs, returns the trie node of the first ligature of the set
+ * (in font order) that matches
+ * */
+static const hz_ligature_trie_node_t *
+hz_ligature_subst_match(const hz_ligature_subst_t *subst,
+                        uint32_t root,
+                        const hz_glyph_filter_t *filter,
+                        const hz_sequence_t *sect)
+{
+    const hz_ligature_trie_node_t *trie_node = &subst->nodes[root];
+    const hz_ligature_trie_node_t *best = NULL;
+    size_t index = sect->cursor;
+
+    while (1) {
+        const hz_index_t *edges;
+        hz_index_t id;
+        uint32_t n;
+
+        if (trie_node->order != HZ_LIGATURE_TRIE_NO_LIGATURE
+            && (best == NULL || trie_node->order < best->order))
+            best = trie_node;
+
+        if (!trie_node->edge_count)
+            break;
+
+        index = hz_next_index_not_ignored(sect, index, filter);
+        if (index >= sect->length)
+            break;
+
+        /* branchless lower bound over the node's sorted edges */
+        id = sect->nodes[index].id;
+        edges = subst->edge_glyphs + trie_node->first_edge;
+        n = trie_node->edge_count;
+        while (n > 1) {
+            uint32_t half = n >> 1;
+            edges = (edges[half] <= id) ? edges + half : edges;
+            n -= half;
+        }
+
+        if (*edges != id)
+            break;
+
+        trie_node = &subst->nodes[ subst->edge_nodes[edges - subst->edge_glyphs] ];
+    }
+
+    return best;
+}
+
+/* outputs the ligature in place of the glyph at the cursor and consumes the other
+ * components, ignored glyphs in between are output after the ligature and tagged
+ * with the index of the component they follow, as are the marks following the
+ * last component. The glyphs in between join the cluster of the ligature,
+ * which can't be broken at them
+ * */
+static void
+hz_ot_layout_apply_ligature(hz_sequence_t *sect,
+                            hz_index_t ligature_glyph,
+                            uint16_t component_count,
+                            const hz_glyph_filter_t *filter)
+{
+    uint32_t cluster = sect->nodes[sect->cursor].cluster;
+    uint16_t component_index = 1;
+    size_t index;
+
+    sect->nodes[sect->cursor].id = ligature_glyph;
+    sect->nodes[sect->cursor].gc |= HZ_GLYPH_CLASS_LIGATURE;
+    hz_sequence_next_node(sect);
+
+    while (sect->cursor < sect->length && component_index < component_count) {
+        hz_sequence_node_t *node = &sect->nodes[sect->cursor];
+
+        if (hz_glyph_filter_skips(filter, node)) {
+            node->cid = component_index - 1;
+            node->cluster = cluster;
+            node->flags |= HZ_GLYPH_FLAG_UNSAFE_TO_BREAK;
+            hz_sequence_next_node(sect);
+        } else {
+            hz_sequence_skip_node(sect);
+            ++component_index;
+        }
+    }
+
+    for (index = sect->cursor; index < sect->length && (sect->nodes[index].gc & HZ_GLYPH_CLASS_MARK); ++index)
+        sect->nodes[index].cid = component_count - 1;
+}
+
+/* outputs the glyphs of a Sequence in place of the glyph at the cursor, they
+ * all keep its cluster and class
+ * */
+static void
+hz_ot_layout_apply_multiple(hz_sequence_t *sect,
+                            const hz_index_t *glyphs,
+                            uint16_t glyph_count)
+{
+    hz_sequence_node_t node = sect->nodes[sect->cursor];
+    uint16_t i;
+
+    hz_sequence_make_room_for(sect, 1, glyph_count);
+    hz_sequence_skip_node(sect);
+
+    for (i = 0; i < glyph_count; ++i) {
+        node.id = glyphs[i];
+        hz_sequence_output_node(sect, &node);
+    }
+}
+
+/* guards against lookups nesting each other through their context rules forever */
+#define HZ_MAX_NESTING_LEVEL 16
+
+/*  Struct: hz_apply_context_t
+ *      State shared by a lookup and the lookups nested in its context rules.
+ *      Lookups are applied to the glyph at the section's cursor, a lookup that
+ *      applies consumes the glyphs it covers and outputs their replacement,
+ *      one that doesn't leaves the section untouched.
+ *
+ *  Fields:
+ *      face - The face being shaped.
+ *      layout - Compiled layout of the face, resolves nested lookup indices.
+ *      feature - Feature the top-level lookup belongs to.
+ *      feature_value - Value the feature is enabled with, selects alternates.
+ *      sect - The section being shaped.
+ *      nesting_level - Number of context rules the current lookup is nested in.
+ * */
+typedef struct hz_apply_context_t {
+    hz_face_t *face;
+    const hz_ot_layout_t *layout;
+    hz_feature_t feature;
+    uint32_t feature_value;
+    hz_sequence_t *sect;
+    uint16_t nesting_level;
+} hz_apply_context_t;
+
+/* features in the wanted feature array are enabled without a value */
+#define HZ_FEATURE_DEFAULT_VALUE 1
+
+static hz_bool_t
+hz_ot_layout_apply_gsub_lookup_at(hz_apply_context_t *ctx,
+                                  const hz_lookup_table_t *lookup);
+
+static hz_bool_t
+hz_ot_layout_apply_gpos_lookup_at(hz_apply_context_t *ctx,
+                                  const hz_lookup_table_t *lookup);
+
+static hz_bool_t
+hz_context_match_glyph(const hz_context_t *context,
+                       const hz_class_def_t *class_def,
+                       uint32_t value_index,
+                       hz_index_t id)
+{
+    switch (context->format) {
+        case 1: return context->values[value_index] == id;
+        case 2: return context->values[value_index] == hz_class_def_get(class_def, id);
+        case 3: return context->coverages[value_index] != NULL
+                       && hz_coverage_search(context->coverages[value_index], id) >= 0;
+    }
+
+    return HZ_FALSE;
+}
+
+/* matches a rule whose first input glyph is at the cursor, the input glyph
+ * positions are stored in matched, backtrack glyphs are read from the output.
+ * The context spans from the output position out_first to the input position end
+ * */
+static hz_bool_t
+hz_context_match_rule(const hz_context_t *context,
+                      const hz_context_rule_t *rule,
+                      const hz_glyph_filter_t *filter,
+                      const hz_sequence_t *sect,
+                      size_t *matched,
+                      size_t *out_first,
+                      size_t *end)
+{
+    uint32_t backtrack_value = rule->first_value;
+    uint32_t input_value = backtrack_value + rule->backtrack_count;
+    uint32_t lookahead_value = input_value + rule->input_count - 1;
+    size_t index = sect->cursor;
+    size_t count;
+    uint16_t i;
+
+    matched[0] = index;
+    for (i = 1; i < rule->input_count; ++i) {
+        index = hz_next_index_not_ignored(sect, index, filter);
+        if (index >= sect->length || !hz_context_match_glyph(context, context->input_class_def,
+                                                             input_value + i - 1, sect->nodes[index].id))
+            return HZ_FALSE;
+
+        matched[i] = index;
+    }
+
+    for (i = 0; i < rule->lookahead_count; ++i) {
+        index = hz_next_index_not_ignored(sect, index, filter);
+        if (index >= sect->length || !hz_context_match_glyph(context, context->lookahead_class_def,
+                                                             lookahead_value + i, sect->nodes[index].id))
+            return HZ_FALSE;
+    }
+
+    count = sect->out_length;
+    for (i = 0; i < rule->backtrack_count; ++i) {
+        const hz_sequence_node_t *node = hz_prev_output_not_ignored(sect, &count, filter);
+        if (node == NULL || !hz_context_match_glyph(context, context->backtrack_class_def,
+                                                    backtrack_value + i, node->id))
+            return HZ_FALSE;
+    }
+
+    *out_first = count;
+    *end = index + 1;
+    return HZ_TRUE;
+}
+
+/* applies the nested lookups of a matched rule in record order and consumes the
+ * input. The matched positions are turned into output positions first, when a
+ * nested lookup adds or removes glyphs the positions following it are shifted,
+ * so later records index the updated input.
+ * */
+static void
+hz_context_apply_records(hz_apply_context_t *ctx,
+                         const hz_context_t *context,
+                         const hz_context_rule_t *rule,
+                         hz_bool_t is_gsub,
+                         size_t *matched)
+{
+    hz_sequence_t *sect = ctx->sect;
+    int32_t count = rule->input_count;
+    int32_t end = (int32_t) (sect->out_length + matched[count - 1] + 1 - sect->cursor);
+    uint16_t record_index;
+    int32_t i;
+
+    for (i = 0; i < count; ++i)
+        matched[i] = matched[i] - sect->cursor + sect->out_length;
+
+    if (ctx->layout == NULL || ctx->nesting_level >= HZ_MAX_NESTING_LEVEL) {
+        hz_sequence_move_to(sect, end);
+        return;
+    }
+
+    ++ctx->nesting_level;
+
+    for (record_index = 0; record_index < rule->record_count; ++record_index) {
+        const hz_sequence_lookup_record_t *record = &context->records[rule->first_record + record_index];
+        int32_t index = record->sequence_index;
+        int32_t orig_length, delta, next;
+
+        if (index >= count)
+            continue;
+
+        orig_length = (int32_t) (sect->out_length + sect->length - sect->cursor);
+        if (!hz_sequence_move_to(sect, matched[index]))
+            break;
+
+        if (is_gsub) {
+            if (record->lookup_index < ctx->layout->gsub_lookup_count)
+                hz_ot_layout_apply_gsub_lookup_at(ctx, &ctx->layout->gsub_lookups[record->lookup_index]);
+        } else {
+            if (record->lookup_index < ctx->layout->gpos_lookup_count)
+                hz_ot_layout_apply_gpos_lookup_at(ctx, &ctx->layout->gpos_lookups[record->lookup_index]);
+        }
+
+        delta = (int32_t) (sect->out_length + sect->length - sect->cursor) - orig_length;
+        if (delta == 0)
+            continue;
+
+        /* glyphs were added right after the position, or the positions
+         * following it were removed */
+        end += delta;
+        if (end < (int32_t) matched[index]) {
+            delta += (int32_t) matched[index] - end;
+            end = (int32_t) matched[index];
+        }
+
+        next = index + 1;
+        if (delta > 0) {
+            if (delta + count > HZ_MAX_CONTEXT_LENGTH)
+                break;
+        } else {
+            delta = HZ_MAX(delta, next - count);
+            next -= delta;
+        }
+
+        memmove(matched + next + delta, matched + next, (count - next) * sizeof(size_t));
+        next += delta;
+        count += delta;
+
+        for (i = index + 1; i < next; ++i)
+            matched[i] = matched[i - 1] + 1;
+
+        for (; next < count; ++next)
+            matched[next] = (size_t) ((int32_t) matched[next] + delta);
+    }
+
+    --ctx->nesting_level;
+    hz_sequence_move_to(sect, end);
+}
+
+/* applies the first rule of the context subtable that matches at the cursor */
+static hz_bool_t
+hz_context_apply(hz_apply_context_t *ctx,
+                 const hz_lookup_table_t *lookup,
+                 const hz_context_t *context,
+                 hz_bool_t is_gsub)
+{
+    const hz_glyph_filter_t *filter = &lookup->filter;
+    hz_index_t id = ctx->sect->nodes[ctx->sect->cursor].id;
+    size_t matched[HZ_MAX_CONTEXT_LENGTH];
+    size_t out_first, end;
+    uint32_t set_index, rule_index;
+
+    if (context->coverage == NULL || hz_coverage_search(context->coverage, id) < 0)
+        return HZ_FALSE;
+
+    switch (context->format) {
+        case 1: set_index = hz_coverage_search(context->coverage, id); break;
+        case 2: set_index = hz_class_def_get(context->input_class_def, id); break;
+        default: set_index = 0; break;
+    }
+
+    if (set_index >= context->set_count)
+        return HZ_FALSE;
+
+    for (rule_index = context->set_rules[set_index]; rule_index < context->set_rules[set_index + 1]; ++rule_index) {
+        const hz_context_rule_t *rule = &context->rules[rule_index];
+
+        if (hz_context_match_rule(context, rule, filter, ctx->sect, matched, &out_first, &end)) {
+            hz_sequence_set_unsafe_to_break_from_output(ctx->sect, out_first, end);
+            hz_context_apply_records(ctx, context, rule, is_gsub, matched);
+            return HZ_TRUE;
+        }
+    }
+
+    return HZ_FALSE;
+}
+
+/* substitutes the glyph at the cursor in place, the cursor is moved by the
+ * backward pass driving the lookup, which keeps the output aliased to the input
+ * right before it for the backtrack glyphs
+ * */
+static hz_bool_t
+hz_reverse_chain_subst_apply(const hz_reverse_chain_subst_t *subst,
+                             const hz_glyph_filter_t *filter,
+                             hz_sequence_t *sect)
+{
+    hz_sequence_node_t *g = &sect->nodes[sect->cursor];
+    int32_t coverage_index;
+    size_t index, count;
+    uint16_t i;
+
+    if (subst->coverage == NULL)
+        return HZ_FALSE;
+
+    coverage_index = hz_coverage_search(subst->coverage, g->id);
+    if (coverage_index < 0 || coverage_index >= subst->substitute_count)
+        return HZ_FALSE;
+
+    for (count = sect->out_length, i = 0; i < subst->backtrack_count; ++i) {
+        const hz_coverage_t *coverage = subst->coverages[i];
+        const hz_sequence_node_t *node = hz_prev_output_not_ignored(sect, &count, filter);
+        if (node == NULL || coverage == NULL || hz_coverage_search(coverage, node->id) < 0)
+            return HZ_FALSE;
+    }
+
+    for (index = sect->cursor, i = 0; i < subst->lookahead_count; ++i) {
+        const hz_coverage_t *coverage = subst->coverages[subst->backtrack_count + i];
+        index = hz_next_index_not_ignored(sect, index, filter);
+        if (index >= sect->length || coverage == NULL || hz_coverage_search(coverage, sect->nodes[index].id) < 0)
+            return HZ_FALSE;
+    }
+
+    hz_sequence_set_unsafe_to_break_from_output(sect, count, index + 1);
+    g->id = subst->substitutes[coverage_index];
+    return HZ_TRUE;
+}
+
+/* applies a GSUB subtable at the cursor */
+static hz_bool_t
+hz_ot_layout_apply_gsub_subtable(hz_apply_context_t *ctx,
+                                 const hz_lookup_table_t *lookup,
+                                 const hz_lookup_subtable_t *subtable,
+                                 const hz_glyph_filter_t *filter)
+{
+    hz_sequence_t *sect = ctx->sect;
+    hz_sequence_node_t *g = &sect->nodes[sect->cursor];
+
+    switch (lookup->lookup_type) {
+        case HZ_GSUB_LOOKUP_TYPE_SINGLE_SUBSTITUTION: {
+            const hz_single_subst_t *subst = subtable->compiled.single_subst;
+            hz_index_t substitute;
+
+            if (subst == NULL || !hz_single_subst_get(subst, g->id, &substitute))
+                return HZ_FALSE;
+
+            switch (ctx->feature) {
+                case HZ_FEATURE_ISOL:
+                case HZ_FEATURE_MEDI:
+                case HZ_FEATURE_MED2:
+                case HZ_FEATURE_INIT:
+                case HZ_FEATURE_FINA:
+                case HZ_FEATURE_FIN2:
+                case HZ_FEATURE_FIN3:
+                    if (!hz_ot_shape_complex_arabic_join(ctx->feature, sect))
+                        return HZ_FALSE;
+                    break;
+            }
+
+            g->id = substitute;
+            hz_sequence_next_node(sect);
+            return HZ_TRUE;
+        }
+
+        case HZ_GSUB_LOOKUP_TYPE_MULTIPLE_SUBSTITUTION: {
+            const hz_multiple_subst_t *subst = subtable->compiled.multiple_subst;
+            const hz_index_t *glyphs;
+            uint16_t glyph_count;
+
+            if (subst == NULL || !hz_multiple_subst_get(subst, g->id, &glyphs, &glyph_count))
+                return HZ_FALSE;
+
+            hz_ot_layout_apply_multiple(sect, glyphs, glyph_count);
+            return HZ_TRUE;
+        }
+
+        case HZ_GSUB_LOOKUP_TYPE_ALTERNATE_SUBSTITUTION: {
+            const hz_multiple_subst_t *subst = subtable->compiled.multiple_subst;
+            const hz_index_t *alternates;
+            uint16_t alternate_count;
+
+            if (subst == NULL || !hz_multiple_subst_get(subst, g->id, &alternates, &alternate_count))
+                return HZ_FALSE;
+
+            /* feature value n selects the n-th alternate */
+            if (ctx->feature_value == 0 || ctx->feature_value > alternate_count)
+                return HZ_FALSE;
+
+            g->id = alternates[ctx->feature_value - 1];
+            hz_sequence_next_node(sect);
+            return HZ_TRUE;
+        }
+
+        case HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION: {
+            const hz_ligature_subst_t *subst = subtable->compiled.ligature_subst;
+            const hz_ligature_trie_node_t *match;
+            int32_t coverage_index;
+
+            if (subst == NULL || subst->coverage == NULL)
+                return HZ_FALSE;
+
+            coverage_index = hz_coverage_search(subst->coverage, g->id);
+            if (coverage_index < 0 || coverage_index >= subst->root_count)
+                return HZ_FALSE;
+
+            /* current glyph is covered, walk the trie and replace */
+            match = hz_ligature_subst_match(subst, subst->roots[coverage_index], filter, sect);
+            if (match == NULL)
+                return HZ_FALSE;
+
+            hz_ot_layout_apply_ligature(sect, match->ligature_glyph, match->component_count, filter);
+            return HZ_TRUE;
+        }
+
+        case HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION:
+        case HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION: {
+            const hz_context_t *context = subtable->compiled.context;
+            return context != NULL && hz_context_apply(ctx, lookup, context, HZ_TRUE);
+        }
+
+        case HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION: {
+            const hz_reverse_chain_subst_t *subst = subtable->compiled.reverse_chain_subst;
+
+            /* only applied by its own backward pass, never nested */
+            if (ctx->nesting_level > 0)
+                return HZ_FALSE;
+
+            return subst != NULL && hz_reverse_chain_subst_apply(subst, filter, sect);
+        }
+
+        default:
+            HZ_LOG("Invalid GSUB lookup type!\n");
+            break;
+    }
+
+    return HZ_FALSE;
+}
+
+/* applies the first subtable of the lookup that applies at the cursor */
+static hz_bool_t
+hz_ot_layout_apply_gsub_lookup_at(hz_apply_context_t *ctx,
+                                  const hz_lookup_table_t *lookup)
+{
+    const hz_glyph_filter_t *filter = &lookup->filter;
+    uint16_t subtable_index;
+
+    if (ctx->sect->cursor >= ctx->sect->length
+        || hz_glyph_filter_skips(filter, &ctx->sect->nodes[ctx->sect->cursor]))
+        return HZ_FALSE;
+
+    for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+        if (hz_ot_layout_apply_gsub_subtable(ctx, lookup, &lookup->subtables[subtable_index], filter))
+            return HZ_TRUE;
+    }
+
+    return HZ_FALSE;
+}
+
+/* first input index at or past index whose glyph is in the bitset of glyphs the
+ * lookups of the plan can be applied at, the sequence's length if there is none */
+static size_t
+hz_sequence_next_active_index(const hz_sequence_t *sect, size_t index,
+                              const uint64_t *active_glyphs, uint32_t glyph_count)
+{
+    for (; index < sect->length; ++index) {
+        hz_index_t id = sect->nodes[index].id;
+
+        if (id >= glyph_count || ((active_glyphs[id >> 6] >> (id & 63)) & 1))
+            break;
+    }
+
+    return index;
+}
+
+/* outputs the glyphs at the cursor that no lookup of the plan can be applied at,
+ * returns whether there were any */
+static hz_bool_t
+hz_sequence_skip_inert_glyphs(hz_sequence_t *sect, const uint64_t *active_glyphs, uint32_t glyph_count)
+{
+    size_t index;
+
+    if (active_glyphs == NULL)
+        return HZ_FALSE;
+
+    index = hz_sequence_next_active_index(sect, sect->cursor, active_glyphs, glyph_count);
+    if (index == sect->cursor)
+        return HZ_FALSE;
+
+    hz_sequence_move_to(sect, sect->out_length + index - sect->cursor);
+    return HZ_TRUE;
+}
+
+void
+hz_ot_layout_apply_gsub_lookup(hz_face_t *face,
+                               const hz_lookup_table_t *lookup,
+                               hz_feature_t feature,
+                               const uint64_t *active_glyphs,
+                               hz_sequence_t *sect)
+{
+    hz_apply_context_t ctx;
+
+    HZ_LOG("FEATURE '%c%c%c%c'\n", HZ_UNTAG(hz_ot_tag_from_feature(feature)));
+    HZ_LOG("lookup_type: %d\n", lookup->lookup_type);
+    HZ_LOG("lookup_flag: %d\n", lookup->lookup_flags);
+    HZ_LOG("subtable_count: %d\n", lookup->subtable_count);
+
+    ctx.face = face;
+    ctx.layout = hz_face_get_ot_layout(face);
+    ctx.feature = feature;
+    ctx.feature_value = HZ_FEATURE_DEFAULT_VALUE;
+    ctx.sect = sect;
+    ctx.nesting_level = 0;
+
+    if (lookup->lookup_type == HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION) {
+        /* one backward pass substituting in place, the glyphs before the
+         * cursor serve as the output for the backtrack */
+        size_t index;
+
+        hz_sequence_clear_output(sect);
+        for (index = sect->length; index > 0; --index) {
+            hz_index_t id = sect->nodes[index - 1].id;
+
+            if (active_glyphs != NULL && id < ctx.layout->glyph_count
+                && !((active_glyphs[id >> 6] >> (id & 63)) & 1))
+                continue;
+
+            sect->out_nodes = sect->nodes;
+            sect->out_length = index - 1;
+            sect->cursor = index - 1;
+            hz_ot_layout_apply_gsub_lookup_at(&ctx, lookup);
+        }
+
+        hz_sequence_clear_output(sect);
+    } else {
+        hz_sequence_clear_output(sect);
+
+        while (sect->cursor < sect->length) {
+            if (hz_sequence_skip_inert_glyphs(sect, active_glyphs, ctx.layout->glyph_count))
+                continue;
+
+            if (!hz_ot_layout_apply_gsub_lookup_at(&ctx, lookup))
+                hz_sequence_next_node(sect);
+        }
+
+        hz_sequence_swap(sect);
+    }
+}
+
+/* adjusts the glyph at the cursor and the next glyph not ignored by the lookup,
+ * the cursor moves to the second glyph, or past it when it was adjusted too
+ * */
+static hz_bool_t
+hz_pair_pos_apply(const hz_pair_pos_t *pos,
+                  const hz_glyph_filter_t *filter,
+                  hz_sequence_t *sect)
+{
+    hz_sequence_node_t *first = &sect->nodes[sect->cursor];
+    hz_sequence_node_t *second;
+    uint32_t value_index;
+    size_t index;
+
+    index = hz_next_index_not_ignored(sect, sect->cursor, filter);
+    if (index >= sect->length)
+        return HZ_FALSE;
+
+    second = &sect->nodes[index];
+    if (!hz_pair_pos_get(pos, first->id, second->id, &value_index))
+        return HZ_FALSE;
+
+    if (pos->x_advances != NULL) {
+        first->x_advance += pos->x_advances[value_index];
+    } else {
+        hz_value_record_apply(first, &pos->records[value_index * 2]);
+        hz_value_record_apply(second, &pos->records[value_index * 2 + 1]);
+    }
+
+    hz_sequence_set_unsafe_to_break(sect, sect->cursor, index + 1);
+
+    if (pos->value_format2)
+        ++index;
+
+    hz_sequence_move_to(sect, sect->out_length + index - sect->cursor);
+    return HZ_TRUE;
+}
+
+/* turns the cursive chain the glyph at index is a child of around, so the glyph
+ * can be attached to new_parent without forming a cycle
+ * */
+static void
+hz_sequence_reverse_cursive_chain(hz_sequence_t *sect, size_t index, size_t new_parent)
+{
+    hz_sequence_node_t *nodes = sect->nodes;
+    int16_t chain = nodes[index].attach_chain;
+    int16_t y_offset = nodes[index].y_offset;
+
+    if (!chain)
+        return;
+
+    nodes[index].attach_chain = 0;
+
+    for (;;) {
+        size_t parent = index + chain;
+        int16_t parent_chain, parent_y_offset;
+
+        if (parent == new_parent || parent >= sect->length)
+            break;
+
+        parent_chain = nodes[parent].attach_chain;
+        parent_y_offset = nodes[parent].y_offset;
+        nodes[parent].attach_chain = (int16_t) -chain;
+        nodes[parent].y_offset = (int16_t) -y_offset;
+
+        if (!parent_chain)
+            break;
+
+        index = parent;
+        chain = parent_chain;
+        y_offset = parent_y_offset;
+    }
+}
 
-                    hz_array_destroy(subst);
-                    hz_map_destroy(map_subst);
-                }
-                break;
-            }
+/* attaches the exit anchor of the previous glyph not ignored by the lookup to the
+ * entry anchor of the glyph at the cursor. The advances are adjusted right away,
+ * the cross-stream offset is recorded relative to the parent glyph of the
+ * attachment and resolved for the whole chain by hz_sequence_resolve_cursive_chains
+ * */
+static hz_bool_t
+hz_cursive_pos_apply(const hz_cursive_pos_t *pos,
+                     uint16_t lookup_flags,
+                     const hz_glyph_filter_t *filter,
+                     hz_sequence_t *sect)
+{
+    hz_sequence_node_t *nodes = sect->nodes;
+    const hz_entry_exit_t *this_record, *prev_record = NULL;
+    size_t i = sect->cursor, j = sect->cursor, child, parent;
+    int32_t d, y_offset;
 
-            case HZ_GSUB_LOOKUP_TYPE_MULTIPLE_SUBSTITUTION: {
+    this_record = hz_cursive_pos_get(pos, nodes[j].id);
+    if (this_record == NULL || !this_record->has_entry)
+        return HZ_FALSE;
 
-                break;
-            }
+    while (i > 0) {
+        if (!hz_glyph_filter_skips(filter, &nodes[--i])) {
+            prev_record = hz_cursive_pos_get(pos, nodes[i].id);
+            break;
+        }
+    }
 
-            case HZ_GSUB_LOOKUP_TYPE_ALTERNATE_SUBSTITUTION: {
-                break;
-            }
+    if (prev_record == NULL || !prev_record->has_exit)
+        return HZ_FALSE;
 
-            case HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION: {
-                if (format == 1) {
-                    hz_offset16_t coverage_offset;
-                    uint16_t ligature_set_count;
-                    hz_offset16_t *ligature_set_offsets;
-                    hz_map_t *coverage_map = hz_map_create();
+    /* glyphs are in logical order, the previous glyph is on the right in rtl text */
+    if (sect->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) {
+        d = prev_record->exit.x_coord + nodes[i].x_offset;
+        nodes[i].x_advance -= d;
+        nodes[i].x_offset -= d;
+        nodes[j].x_advance = this_record->entry.x_coord + nodes[j].x_offset;
+    } else {
+        nodes[i].x_advance = prev_record->exit.x_coord + nodes[i].x_offset;
+        d = this_record->entry.x_coord + nodes[j].x_offset;
+        nodes[j].x_advance -= d;
+        nodes[j].x_offset -= d;
+    }
 
-                    hz_stream_read16(subtable, &coverage_offset);
-                    hz_stream_read16(subtable, &ligature_set_count);
-                    ligature_set_offsets = HZ_MALLOC(ligature_set_count * sizeof(uint16_t));
-                    hz_stream_read16_n(subtable, ligature_set_count, ligature_set_offsets);
-                    hz_ot_layout_parse_coverage(subtable->data + coverage_offset, coverage_map, NULL);
-
-
-                    /* loop over every glyph in the section */
-                    hz_sequence_node_t *g;
-                    for (g = sect->root; g != NULL; g = g->next) {
-                        /* if glyph class not ignored, try to apply */
-                        if (g->gc & ~gcignore) {
-                            if (hz_map_value_exists(coverage_map, g->id)) {
-                                /* current glyph is covered, check pattern and replace */
-                                hz_offset16_t ligature_set_offset = ligature_set_offsets[ hz_map_get_value(coverage_map, g->id) ];
-                                uint16_t ligature_count;
-                                hz_stream_t *ligature_set = hz_stream_create(subtable->data + ligature_set_offset, 0, 0);
-                                hz_stream_read16(ligature_set, &ligature_count);
-                                hz_ligature_t **ligatures = HZ_MALLOC(sizeof(hz_ligature_t*) * ligature_count);
-                                uint16_t ligature_index = 0;
-                                for (ligature_index = 0; ligature_index < ligature_count; ++ligature_index) {
-                                    hz_offset16_t ligature_offset;
-                                    hz_stream_read16(ligature_set, &ligature_offset);
-
-                                    ligatures[ligature_index] = hz_ligature_create();
-                                    hz_ligature_decode(ligatures[ligature_index], ligature_set->data + ligature_offset);
-                                }
-
-                                hz_ot_layout_apply_fit_ligature(ligatures, ligature_count, gcignore, g);
-
-                                for (ligature_index = 0; ligature_index < ligature_count; ++ligature_index) {
-                                    hz_ligature_destroy(ligatures[ligature_index]);
-                                }
-
-                                HZ_FREE(ligatures);
-                                hz_stream_destroy(ligature_set);
-                            }
-                        }
-                    }
+    /* the last glyph of the chain stays on the baseline */
+    y_offset = this_record->entry.y_coord - prev_record->exit.y_coord;
+    if (lookup_flags & HZ_LOOKUP_FLAG_RIGHT_TO_LEFT) {
+        child = i;
+        parent = j;
+    } else {
+        child = j;
+        parent = i;
+        y_offset = -y_offset;
+    }
 
-                    HZ_FREE(ligature_set_offsets);
-                    hz_map_destroy(coverage_map);
-                } else {
-                    /* error */
-                }
+    hz_sequence_reverse_cursive_chain(sect, child, parent);
+    nodes[child].attach_chain = (int16_t) ((int32_t) parent - (int32_t) child);
+    nodes[child].y_offset = (int16_t) y_offset;
 
-                break;
-            }
+    /* separate the glyphs if the parent was attached to the child */
+    if (nodes[parent].attach_chain == -nodes[child].attach_chain) {
+        nodes[parent].attach_chain = 0;
+        nodes[parent].y_offset = 0;
+    }
 
-            case HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION: {
-                break;
-            }
+    hz_sequence_set_unsafe_to_break(sect, i, j + 1);
+    sect->flags |= HZ_SEQUENCE_FLAG_CURSIVE_CHAINS;
+    hz_sequence_next_node(sect);
+    return HZ_TRUE;
+}
 
-            case HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION: {
-                break;
-            }
+/* adds the offset of its parent to every glyph attached cursively, parents first.
+ * Each glyph is resolved once, the chain is cleared as it is walked, so the pass
+ * is linear in the length of the sequence however long the chains get
+ * */
+static void
+hz_sequence_resolve_cursive_chains(hz_sequence_t *sect)
+{
+    hz_sequence_node_t *nodes = sect->nodes;
+    size_t *stack = HZ_MALLOC((sect->length ? sect->length : 1) * sizeof(size_t));
+    size_t index;
 
-            case HZ_GSUB_LOOKUP_TYPE_EXTENSION_SUBSTITUTION: {
-                break;
-            }
+    for (index = 0; index < sect->length; ++index) {
+        size_t depth = 0, child = index, parent;
 
-            case HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION: {
-                break;
-            }
+        /* walk up to a resolved glyph, the cleared chains make cycles stop too */
+        while (nodes[child].attach_chain) {
+            parent = child + nodes[child].attach_chain;
+            nodes[child].attach_chain = 0;
 
-            default:
-                HZ_LOG("Invalid GSUB lookup type!\n");
+            if (parent >= sect->length)
                 break;
+
+            stack[depth++] = child;
+            child = parent;
         }
 
-        hz_stream_destroy(subtable);
-        ++subtable_index;
+        /* child is the root, walk back down */
+        parent = child;
+        while (depth > 0) {
+            child = stack[--depth];
+            nodes[child].y_offset += nodes[parent].y_offset;
+            parent = child;
+        }
     }
+
+    HZ_FREE(stack);
+    sect->flags &= ~HZ_SEQUENCE_FLAG_CURSIVE_CHAINS;
 }
 
-typedef struct hz_entry_exit_record_t {
-    hz_offset16_t entry_anchor_offset, exit_anchor_offset;
-} hz_entry_exit_record_t;
+/* no glyph was seen yet by the mark attachment trackers */
+#define HZ_NO_GLYPH ((size_t) -1)
 
-typedef struct hz_anchor_t {
-    int16_t x_coord, y_coord;
-} hz_anchor_t;
+/* the glyphs marks attach to as bases, every one that isn't a mark */
+static const hz_glyph_filter_t hz_mark_base_filter = { HZ_GLYPH_CLASS_MARK, NULL, 0 };
 
-typedef struct hz_anchor_pair_t {
-    hz_bool_t has_entry, has_exit;
-    hz_anchor_t entry, exit;
-} hz_anchor_pair_t;
+/* the first subtable of a mark attachment lookup that attaches mark to base */
+static hz_bool_t
+hz_mark_attach_lookup_get(const hz_lookup_table_t *lookup,
+                          hz_index_t mark, hz_index_t base, uint16_t component,
+                          hz_anchor_t *mark_anchor, hz_anchor_t *base_anchor)
+{
+    uint16_t subtable_index;
 
+    for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+        const hz_mark_attach_pos_t *pos = lookup->subtables[subtable_index].compiled.mark_attach_pos;
 
-hz_anchor_t
-hz_ot_layout_read_anchor(const uint8_t *data) {
-    hz_stream_t *stream = hz_stream_create(data, 0,0);
-    hz_anchor_t anchor;
+        if (pos != NULL && hz_mark_attach_pos_get(pos, mark, base, component,
+                                                  mark_anchor, base_anchor))
+            return HZ_TRUE;
+    }
 
-    uint16_t format;
-    hz_stream_read16(stream, &format);
+    return HZ_FALSE;
+}
 
-    HZ_ASSERT(format >= 1 && format <= 3);
-    hz_stream_read16(stream, (uint16_t *) &anchor.x_coord);
-    hz_stream_read16(stream, (uint16_t *) &anchor.y_coord);
+/* attaches the marks in [first, end) to the glyph before them, with the first
+ * subtable of the lookup that covers both. Bases and ligatures are the last glyph
+ * that isn't a mark, base marks the last glyph not ignored by the lookup, marks
+ * aren't skipped for them. Both are carried along the pass, so it stays linear
+ * however many marks are stacked on a glyph
+ * */
+static void
+hz_mark_attach_pos_apply(const hz_lookup_table_t *lookup,
+                         hz_sequence_t *sect,
+                         size_t first,
+                         size_t end)
+{
+    const hz_glyph_filter_t *filter = &lookup->filter;
+    hz_sequence_node_t *nodes = sect->nodes;
+    hz_glyph_filter_t mark_filter = *filter;
+    size_t last_base = HZ_NO_GLYPH, last_glyph = HZ_NO_GLYPH, i;
+    hz_anchor_t mark_anchor, base_anchor;
+
+    mark_filter.gcignore &= ~HZ_GLYPH_CLASS_MARK;
+
+    /* glyphs before the range, a context lookup applies to a single glyph. While
+     * positioning, the output is the input, and its skip indices find them
+     * without walking back over every mark of a stack each time */
+    if (first > 0 && sect->out_nodes == nodes) {
+        i = hz_sequence_prev_output_index(sect, first, &hz_mark_base_filter);
+        last_base = i > 0 ? i - 1 : HZ_NO_GLYPH;
+        i = hz_sequence_prev_output_index(sect, first, &mark_filter);
+        last_glyph = i > 0 ? i - 1 : HZ_NO_GLYPH;
+    } else {
+        for (i = first; i > 0 && last_base == HZ_NO_GLYPH; --i)
+            if (!(nodes[i - 1].gc & HZ_GLYPH_CLASS_MARK))
+                last_base = i - 1;
+
+        for (i = first; i > 0 && last_glyph == HZ_NO_GLYPH; --i)
+            if (!hz_glyph_filter_skips(&mark_filter, &nodes[i - 1]))
+                last_glyph = i - 1;
+    }
 
-    hz_stream_destroy(stream);
-    return anchor;
+    for (i = first; i < end; ++i) {
+        hz_sequence_node_t *node = &nodes[i];
+
+        if (!(node->gc & HZ_GLYPH_CLASS_MARK)) {
+            last_base = i;
+        } else if (!hz_glyph_filter_skips(filter, node)) {
+            switch (lookup->lookup_type) {
+                case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+                case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+                    if (last_base != HZ_NO_GLYPH
+                        && hz_mark_attach_lookup_get(lookup, node->id, nodes[last_base].id, node->cid,
+                                                     &mark_anchor, &base_anchor)) {
+                        node->x_offset = base_anchor.x_coord - mark_anchor.x_coord;
+                        node->y_offset = base_anchor.y_coord - mark_anchor.y_coord;
+                        hz_sequence_set_unsafe_to_break(sect, last_base, i + 1);
+                    }
+                    break;
+                case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+                    if (last_glyph != HZ_NO_GLYPH && nodes[last_glyph].gc & HZ_GLYPH_CLASS_MARK
+                        && hz_mark_attach_lookup_get(lookup, node->id, nodes[last_glyph].id, 0,
+                                                     &mark_anchor, &base_anchor)) {
+                        /* the mark sits on mark2, wherever mark2 was attached */
+                        node->x_offset = nodes[last_glyph].x_offset + base_anchor.x_coord - mark_anchor.x_coord;
+                        node->y_offset = nodes[last_glyph].y_offset + base_anchor.y_coord - mark_anchor.y_coord;
+                        hz_sequence_set_unsafe_to_break(sect, last_glyph, i + 1);
+                    }
+                    break;
+            }
+        }
+
+        if (!hz_glyph_filter_skips(&mark_filter, node))
+            last_glyph = i;
+    }
 }
 
-hz_anchor_pair_t
-hz_ot_layout_read_anchor_pair(const uint8_t *subtable, const hz_entry_exit_record_t *rec) {
-    hz_anchor_pair_t anchor_pair;
+/* applies a GPOS lookup that isn't applied at a cursor to the glyphs in [first, end) */
+static void
+hz_ot_layout_apply_gpos_range(const hz_lookup_table_t *lookup,
+                              hz_sequence_t *sect,
+                              size_t first,
+                              size_t end)
+{
+    switch (lookup->lookup_type) {
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+            hz_mark_attach_pos_apply(lookup, sect, first, end);
+            break;
+        default:
+            break;
+    }
+}
 
-    anchor_pair.has_entry = rec->entry_anchor_offset ? HZ_TRUE : HZ_FALSE;
-    anchor_pair.has_exit = rec->exit_anchor_offset ? HZ_TRUE : HZ_FALSE;
+/* applies the lookup at the cursor, single, pair, cursive and context subtables are tried in order
+ * until one applies while mark attachments are applied to the glyph alone and don't
+ * move the cursor
+ * */
+static hz_bool_t
+hz_ot_layout_apply_gpos_lookup_at(hz_apply_context_t *ctx,
+                                  const hz_lookup_table_t *lookup)
+{
+    const hz_glyph_filter_t *filter = &lookup->filter;
+    hz_sequence_t *sect = ctx->sect;
+    uint16_t subtable_index;
 
-    if (anchor_pair.has_entry)
-        anchor_pair.entry = hz_ot_layout_read_anchor(subtable + rec->entry_anchor_offset);
+    if (sect->cursor >= sect->length || hz_glyph_filter_skips(filter, &sect->nodes[sect->cursor]))
+        return HZ_FALSE;
 
-    if (anchor_pair.has_exit)
-        anchor_pair.exit = hz_ot_layout_read_anchor(subtable + rec->exit_anchor_offset);
+    switch (lookup->lookup_type) {
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+        case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+            hz_ot_layout_apply_gpos_range(lookup, sect, sect->cursor, sect->cursor + 1);
+            return HZ_FALSE;
+        default:
+            break;
+    }
 
-    return anchor_pair;
-}
+    for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+        const hz_lookup_subtable_t *subtable = &lookup->subtables[subtable_index];
 
-typedef struct hz_mark_record_t {
-    uint16_t mark_class;
-    hz_offset16_t mark_anchor_offset;
-} hz_mark_record_t;
+        switch (lookup->lookup_type) {
+            case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT:
+                if (subtable->compiled.single_pos != NULL
+                    && hz_single_pos_apply(subtable->compiled.single_pos, sect))
+                    return HZ_TRUE;
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT:
+                if (subtable->compiled.pair_pos != NULL
+                    && hz_pair_pos_apply(subtable->compiled.pair_pos, filter, sect))
+                    return HZ_TRUE;
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT:
+                if (subtable->compiled.cursive_pos != NULL
+                    && hz_cursive_pos_apply(subtable->compiled.cursive_pos, lookup->lookup_flags,
+                                            filter, sect))
+                    return HZ_TRUE;
+                break;
+            case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING:
+            case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING:
+                if (subtable->compiled.context != NULL
+                    && hz_context_apply(ctx, lookup, subtable->compiled.context, HZ_FALSE))
+                    return HZ_TRUE;
+                break;
+            default:
+                break;
+        }
+    }
 
-typedef struct hz_mark2_record_t {
-    uint16_t mark_class;
-    hz_offset16_t mark2_anchor_offets;
-} hz_mark2_record_t;
+    return HZ_FALSE;
+}
 
-hz_sequence_node_t *
-hz_ot_layout_find_prev_with_class(hz_sequence_node_t *node, hz_glyph_class_t gc)
+void
+hz_ot_layout_apply_gpos_lookup(hz_face_t *face,
+                               const hz_lookup_table_t *lookup,
+                               hz_feature_t feature,
+                               const uint64_t *active_glyphs,
+                               hz_sequence_t *sect)
 {
-    node = node->prev;
-    while (node != NULL) {
-        if (node->gc == gc) {
-            /* found node with required class */
-            break;
-        }
+    hz_apply_context_t ctx;
+
+    HZ_LOG("lookup_type: %d\n", lookup->lookup_type);
+    HZ_LOG("lookup_flag: %d\n", lookup->lookup_flags);
+    HZ_LOG("subtable_count: %d\n", lookup->subtable_count);
+
+    ctx.face = face;
+    ctx.layout = hz_face_get_ot_layout(face);
+    ctx.feature = feature;
+    ctx.feature_value = HZ_FEATURE_DEFAULT_VALUE;
+    ctx.sect = sect;
+    ctx.nesting_level = 0;
+
+    switch (lookup->lookup_type) {
+        case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT:
+        case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT:
+        case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT:
+        case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING:
+        case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING:
+            /* positioning never changes the length, the output stays aliased to the input */
+            hz_sequence_clear_output(sect);
+
+            while (sect->cursor < sect->length) {
+                if (hz_sequence_skip_inert_glyphs(sect, active_glyphs, ctx.layout->glyph_count))
+                    continue;
+
+                if (!hz_ot_layout_apply_gpos_lookup_at(&ctx, lookup))
+                    hz_sequence_next_node(sect);
+            }
 
-        node = node->prev;
+            hz_sequence_swap(sect);
+            break;
+        default:
+            hz_ot_layout_apply_gpos_range(lookup, sect, 0, sect->length);
+            break;
     }
 
-    return node;
+    /* cursive attachments, possibly made by nested lookups, are resolved before
+     * the next lookup reads the positions */
+    if (sect->flags & HZ_SEQUENCE_FLAG_CURSIVE_CHAINS)
+        hz_sequence_resolve_cursive_chains(sect);
 }
 
-hz_sequence_node_t *
-hz_ot_layout_find_next_with_class(hz_sequence_node_t *node, hz_glyph_class_t gc)
+/* the kern table pairs the glyphs around marks */
+static const hz_glyph_filter_t hz_kern_glyph_filter = { HZ_GLYPH_CLASS_MARK, NULL, 0 };
+
+hz_bool_t
+hz_ot_layout_apply_kern_table(hz_face_t *face, hz_sequence_t *sect)
 {
-    node = node->next;
-    while (node != NULL) {
-        if (node->gc == gc) {
-            /* found node with required class */
-            break;
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    size_t index, next;
+    int16_t kerning;
+
+    if (layout == NULL || layout->kern_table == NULL || layout->gpos_has_kerning)
+        return HZ_FALSE;
+
+    /* marks are skipped, pairs are formed by the glyphs around them */
+    for (index = 0; index < sect->length; index = next) {
+        hz_sequence_node_t *node = &sect->nodes[index];
+
+        if (node->gc & HZ_GLYPH_CLASS_MARK) {
+            next = index + 1;
+            continue;
         }
 
-        node = node->next;
+        next = hz_next_index_not_ignored(sect, index, &hz_kern_glyph_filter);
+        if (next >= sect->length)
+            break;
+
+        kerning = hz_kern_table_get(layout->kern_table, node->id, sect->nodes[next].id);
+        if (kerning) {
+            node->x_advance += kerning;
+            hz_sequence_set_unsafe_to_break(sect, index, next + 1);
+        }
     }
 
-    return node;
+    return HZ_TRUE;
 }
 
-void
-hz_ot_layout_apply_gpos_lookup(hz_face_t *face,
-                               hz_stream_t *table,
-                               hz_feature_t feature,
-                               hz_sequence_t *sect)
+/* gathers the indices of the lookups the wanted features apply from a GSUB or
+ * GPOS table, picked the way the features are applied */
+static void
+hz_ot_layout_gather_lookups(hz_face_t *face,
+                            const hz_byte_t *data,
+                            hz_tag_t script,
+                            hz_tag_t language,
+                            const hz_array_t *wanted_features,
+                            hz_array_t *lookup_indices)
 {
-    uint16_t lookup_type;
-    uint16_t lookup_flags;
-    uint16_t subtable_count;
-    hz_stream_read16(table, &lookup_type);
-    hz_stream_read16(table, &lookup_flags);
-    hz_stream_read16(table, &subtable_count);
+    hz_stream_t *table, *feature_list;
+    hz_map_t *feature_map;
+    uint32_t version;
+    uint16_t script_list_offset, feature_list_offset, feature_count, feature_index;
+    size_t i;
 
-    HZ_LOG("lookup_type: %d\n", lookup.lookup_type);
-    HZ_LOG("lookup_flag: %d\n", lookup.lookup_flags);
-    HZ_LOG("subtable_count: %d\n", lookup.subtable_count);
-    hz_glyph_class_t gcignore = hz_ignored_classes_from_lookup_flags(lookup_flags);
+    if (data == NULL)
+        return;
 
-    uint16_t subtable_index = 0;
-    while (subtable_index < subtable_count) {
-        hz_offset16_t offset;
-        hz_stream_read16(table, &offset);
-        hz_stream_t *subtable = hz_stream_create(table->data + offset, 0, 0);
-        uint16_t format;
-        hz_stream_read16(subtable, &format);
+    table = hz_stream_create(data, 0, 0);
+    hz_stream_read32(table, &version);
+    hz_stream_read16(table, &script_list_offset);
+    hz_stream_read16(table, &feature_list_offset);
+    hz_stream_destroy(table);
 
-        switch (lookup_type) {
-            case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT: {
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT: {
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT: {
-                if (format == 1) {
-                    /* 4k stack buffer */
-                    uint8_t buff[4096];
-                    hz_monotonic_allocator_t ma = hz_monotonic_allocator_create(buff, 4096);
+    if (hz_ot_layout_choose_lang_sys(face, (hz_byte_t *) data + script_list_offset,
+                                     script, language) == NULL)
+        return;
 
-                    hz_offset16_t coverage_offset;
-                    uint16_t record_count, record_index = 0;
-                    hz_entry_exit_record_t *records;
-                    hz_map_t *coverage_map = hz_map_create();
+    feature_list = hz_stream_create(data + feature_list_offset, 0, 0);
+    feature_map = hz_map_create();
+    hz_stream_read16(feature_list, &feature_count);
 
-                    hz_stream_read16(subtable, &coverage_offset);
-                    hz_stream_read16(subtable, &record_count);
+    for (feature_index = 0; feature_index < feature_count; ++feature_index) {
+        hz_tag_t tag;
+        uint16_t offset;
+        hz_stream_read32(feature_list, &tag);
+        hz_stream_read16(feature_list, &offset);
+        hz_map_set_value(feature_map, hz_ot_feature_from_tag(tag), offset);
+    }
 
-                    records = hz_monotonic_allocator_alloc(&ma, sizeof(hz_entry_exit_record_t) * record_count);
+    for (i = 0; i < hz_array_size(wanted_features); ++i) {
+        hz_feature_t feature = hz_array_at(wanted_features, i);
 
-                    while (record_index < record_count) {
-                        hz_entry_exit_record_t *rec = &records[record_index];
-                        hz_stream_read16(subtable, &rec->entry_anchor_offset);
-                        hz_stream_read16(subtable, &rec->exit_anchor_offset);
-                        ++record_index;
-                    }
+        if (hz_map_value_exists(feature_map, feature))
+            hz_ot_layout_feature_get_lookups(feature_list->data + hz_map_get_value(feature_map, feature),
+                                             lookup_indices);
+    }
+
+    hz_map_destroy(feature_map);
+    hz_stream_destroy(feature_list);
+}
 
-                    /* get coverage glyph to index map */
-                    hz_ot_layout_parse_coverage(subtable->data + coverage_offset, coverage_map, NULL);
+/* coverage of the glyphs a subtable can be applied at, the glyphs that start a
+ * match, NULL if it has none */
+static const hz_coverage_t *
+hz_lookup_subtable_get_coverage(const hz_lookup_table_t *lookup,
+                                const hz_lookup_subtable_t *subtable,
+                                hz_bool_t is_gsub)
+{
+    if (is_gsub) {
+        switch (lookup->lookup_type) {
+            case HZ_GSUB_LOOKUP_TYPE_SINGLE_SUBSTITUTION:
+                return subtable->compiled.single_subst != NULL
+                    ? subtable->compiled.single_subst->coverage : NULL;
+            case HZ_GSUB_LOOKUP_TYPE_MULTIPLE_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_ALTERNATE_SUBSTITUTION:
+                return subtable->compiled.multiple_subst != NULL
+                    ? subtable->compiled.multiple_subst->coverage : NULL;
+            case HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION:
+                return subtable->compiled.ligature_subst != NULL
+                    ? subtable->compiled.ligature_subst->coverage : NULL;
+            case HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION:
+            case HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION:
+                return subtable->compiled.context != NULL
+                    ? subtable->compiled.context->coverage : NULL;
+            case HZ_GSUB_LOOKUP_TYPE_REVERSE_CHAINING_CONTEXTUAL_SINGLE_SUBSTITUTION:
+                return subtable->compiled.reverse_chain_subst != NULL
+                    ? subtable->compiled.reverse_chain_subst->coverage : NULL;
+        }
+    } else {
+        switch (lookup->lookup_type) {
+            case HZ_GPOS_LOOKUP_TYPE_SINGLE_ADJUSTMENT:
+                return subtable->compiled.single_pos != NULL
+                    ? subtable->compiled.single_pos->coverage : NULL;
+            case HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT:
+                return subtable->compiled.pair_pos != NULL
+                    ? subtable->compiled.pair_pos->coverage : NULL;
+            case HZ_GPOS_LOOKUP_TYPE_CURSIVE_ATTACHMENT:
+                return subtable->compiled.cursive_pos != NULL
+                    ? subtable->compiled.cursive_pos->coverage : NULL;
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT:
+            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT:
+                return subtable->compiled.mark_attach_pos != NULL
+                    ? subtable->compiled.mark_attach_pos->mark_coverage : NULL;
+            case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING:
+            case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING:
+                return subtable->compiled.context != NULL
+                    ? subtable->compiled.context->coverage : NULL;
+        }
+    }
 
+    return NULL;
+}
 
-                    /* position glyphs */
-                    hz_sequence_node_t *g;
+/* whether the lookup is a (chained) sequence context one */
+static hz_bool_t
+hz_lookup_table_is_context(const hz_lookup_table_t *lookup, hz_bool_t is_gsub)
+{
+    if (is_gsub)
+        return lookup->lookup_type == HZ_GSUB_LOOKUP_TYPE_CONTEXTUAL_SUBSTITUTION
+            || lookup->lookup_type == HZ_GSUB_LOOKUP_TYPE_CHAINED_CONTEXTS_SUBSTITUTION;
 
-                    for (g = sect->root; g != NULL; g = g->next) {
-                        if (hz_map_value_exists(coverage_map, g->id)) {
-                            uint16_t curr_idx = hz_map_get_value(coverage_map, g->id);
-                            const hz_entry_exit_record_t *curr_rec = records + curr_idx;
-                            hz_anchor_pair_t curr_pair = hz_ot_layout_read_anchor_pair(subtable->data, curr_rec);
+    return lookup->lookup_type == HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING
+        || lookup->lookup_type == HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING;
+}
 
-                            if (curr_pair.has_exit && g->next != NULL) {
-                                uint16_t next_idx = hz_map_get_value(coverage_map, g->next->id);
-                                const hz_entry_exit_record_t *next_rec = records + next_idx;
-                                hz_anchor_pair_t next_pair = hz_ot_layout_read_anchor_pair(subtable->data, next_rec);
+/* whether some glyph of the set, not skipped by the filter, matches a value of a rule */
+static hz_bool_t
+hz_context_value_matches_set(const hz_context_t *context,
+                             const hz_class_def_t *class_def,
+                             uint32_t value_index,
+                             const hz_glyph_filter_t *filter,
+                             const hz_sequence_node_t *glyphs,
+                             const uint64_t *set,
+                             size_t glyph_count)
+{
+    size_t i;
 
-                                int16_t y_delta = next_pair.entry.y_coord - curr_pair.exit.y_coord;
-                                int16_t x_delta = next_pair.entry.x_coord - curr_pair.exit.x_coord;
+    for (i = 0; i < glyph_count; ++i) {
+        if (((set[i >> 6] >> (i & 63)) & 1) && !hz_glyph_filter_skips(filter, &glyphs[i])
+            && hz_context_match_glyph(context, class_def, value_index, glyphs[i].id))
+            return HZ_TRUE;
+    }
 
-                                /* TODO: implement */
-                            }
-                        }
-                    }
+    return HZ_FALSE;
+}
 
-                    /* release resources */
-                    hz_monotonic_allocator_free(&ma, records);
-                    hz_monotonic_allocator_release(&ma);
-                    hz_map_destroy(coverage_map);
-                } else {
-                    /* error */
-                }
+/* whether a rule of the context subtable starting at the glyph id can match a
+ * text made only of the glyphs of the set */
+static hz_bool_t
+hz_context_matches_set(const hz_context_t *context,
+                       const hz_glyph_filter_t *filter,
+                       hz_index_t id,
+                       const hz_sequence_node_t *glyphs,
+                       const uint64_t *set,
+                       size_t glyph_count)
+{
+    uint32_t set_index, rule_index;
 
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_BASE_ATTACHMENT: {
-                /* attach mark to base glyph point */
-                if (format == 1) {
-                    uint8_t buff[4096];
-                    hz_monotonic_allocator_t ma = hz_monotonic_allocator_create(buff, 4096);
-
-                    hz_offset16_t mark_coverage_offset;
-                    hz_offset16_t base_coverage_offset;
-                    uint16_t mark_class_count;
-                    hz_offset16_t mark_array_offset;
-                    hz_offset16_t base_array_offset;
-                    hz_map_t *mark_map = hz_map_create();
-                    hz_map_t *base_map = hz_map_create();
-                    hz_sequence_node_t *g;
-                    hz_mark_record_t *mark_records;
-                    uint16_t *base_anchor_offsets;
-
-                    hz_stream_read16(subtable, &mark_coverage_offset);
-                    hz_stream_read16(subtable, &base_coverage_offset);
-                    hz_stream_read16(subtable, &mark_class_count);
-                    hz_stream_read16(subtable, &mark_array_offset);
-                    hz_stream_read16(subtable, &base_array_offset);
-
-                    /* parse coverages */
-                    hz_ot_layout_parse_coverage(subtable->data + mark_coverage_offset, mark_map, NULL);
-                    hz_ot_layout_parse_coverage(subtable->data + base_coverage_offset, base_map, NULL);
-
-                    /* parse arrays */
-                    uint16_t mark_count;
-                    uint16_t base_count;
-
-                    {
-                        /* parsing mark array */
-                        hz_stream_t *marks = hz_stream_create(subtable->data + mark_array_offset, 0, 0);
-                        hz_stream_read16(marks, &mark_count);
-                        mark_records = hz_monotonic_allocator_alloc(&ma, sizeof(hz_mark_record_t) * mark_count);
-                        uint16_t mark_index = 0;
-
-                        while (mark_index < mark_count) {
-                            hz_mark_record_t *mark = &mark_records[mark_index];
-
-                            hz_stream_read16(marks, &mark->mark_class);
-                            hz_stream_read16(marks, &mark->mark_anchor_offset);
-
-                            ++mark_index;
-                        }
+    switch (context->format) {
+        case 1: set_index = hz_coverage_search(context->coverage, id); break;
+        case 2: set_index = hz_class_def_get(context->input_class_def, id); break;
+        default: set_index = 0; break;
+    }
 
-                        hz_stream_destroy(marks);
-                    }
+    if (set_index >= context->set_count)
+        return HZ_FALSE;
 
-                    {
-                        /* parsing base array */
-                        hz_stream_t *bases = hz_stream_create(subtable->data + base_array_offset, 0, 0);
-                        hz_stream_read16(bases, &base_count);
-                        base_anchor_offsets = malloc(base_count * mark_class_count * sizeof(uint32_t));
-                        hz_stream_read16_n(bases, base_count * mark_class_count, base_anchor_offsets);
-                        hz_stream_destroy(bases);
-                    }
+    for (rule_index = context->set_rules[set_index]; rule_index < context->set_rules[set_index + 1]; ++rule_index) {
+        const hz_context_rule_t *rule = &context->rules[rule_index];
+        uint32_t input_value = rule->first_value + rule->backtrack_count;
+        uint32_t lookahead_value = input_value + rule->input_count - 1;
+        hz_bool_t matches = HZ_TRUE;
+        uint16_t i;
 
+        for (i = 0; matches && i < rule->backtrack_count; ++i)
+            matches = hz_context_value_matches_set(context, context->backtrack_class_def, rule->first_value + i,
+                                                   filter, glyphs, set, glyph_count);
 
-                    /* go over every glyph and position marks in relation to their base */
-                    for (g = sect->root; g != NULL; g = g->next) {
-                        if (g->gc & HZ_GLYPH_CLASS_MARK) {
-                            /* position mark in relation to previous base if it exists */
-                            hz_sequence_node_t *prev_base = hz_ot_layout_find_prev_with_class(g, HZ_GLYPH_CLASS_BASE);
-
-                            if (prev_base != NULL) {
-                                /* there actually is a previous base in the section */
-                                if (hz_map_value_exists(base_map, prev_base->id) &&
-                                hz_map_value_exists(mark_map, g->id)) {
-                                    /* both the mark and base are covered by the table
-                                     * position mark in relation to base glyph
-                                     * */
-                                    uint16_t mark_index = hz_map_get_value(mark_map, g->id);
-                                    HZ_ASSERT(mark_index < mark_count);
-
-                                    hz_mark_record_t *mark = &mark_records[ mark_index ];
-                                    uint16_t base_index = hz_map_get_value(base_map, prev_base->id);
-
-                                    HZ_ASSERT(mark->mark_class < mark_class_count);
-                                    uint16_t base_anchor_offset = base_anchor_offsets[ base_index * mark_class_count + mark->mark_class ];
-
-                                    /* check if the base anchor is NULL */
-                                    if (base_anchor_offset != 0) {
-                                        hz_anchor_t base_anchor = hz_ot_layout_read_anchor(subtable->data
-                                                + base_array_offset + base_anchor_offset);
-                                        hz_anchor_t mark_anchor = hz_ot_layout_read_anchor(subtable->data
-                                                + mark_array_offset + mark->mark_anchor_offset);
-
-                                        hz_metrics_t *base_metric = hz_face_get_glyph_metrics(face, prev_base->id);
-                                        hz_metrics_t *mark_metric = hz_face_get_glyph_metrics(face, g->id);
-
-                                        int32_t x1 = mark_anchor.x_coord;
-                                        int32_t y1 = mark_anchor.y_coord;
-                                        int32_t x2 = base_anchor.x_coord;
-                                        int32_t y2 = base_anchor.y_coord;
-
-                                        g->x_offset = x2 - x1;
-                                        g->y_offset = y2 - y1;
-                                    }
-                                }
-                            }
-                        }
-                    }
+        for (i = 1; matches && i < rule->input_count; ++i)
+            matches = hz_context_value_matches_set(context, context->input_class_def, input_value + i - 1,
+                                                   filter, glyphs, set, glyph_count);
 
-                    HZ_FREE(base_anchor_offsets);
-                    hz_monotonic_allocator_free(&ma, mark_records);
-                    hz_monotonic_allocator_release(&ma);
-                    hz_map_destroy(mark_map);
-                    hz_map_destroy(base_map);
-                } else {
-                    /* error */
-                }
+        for (i = 0; matches && i < rule->lookahead_count; ++i)
+            matches = hz_context_value_matches_set(context, context->lookahead_class_def, lookahead_value + i,
+                                                   filter, glyphs, set, glyph_count);
+
+        if (matches)
+            return HZ_TRUE;
+    }
+
+    return HZ_FALSE;
+}
 
+/* whether a ligature below the trie node can be made of glyphs of the set */
+static hz_bool_t
+hz_ligature_subst_matches_set(const hz_ligature_subst_t *subst,
+                              uint32_t node_index,
+                              const hz_glyph_filter_t *filter,
+                              const hz_sequence_node_t *glyphs,
+                              const uint64_t *set,
+                              size_t glyph_count)
+{
+    const hz_ligature_trie_node_t *node = &subst->nodes[node_index];
+    uint32_t edge;
+    size_t i;
+
+    if (node->order != HZ_LIGATURE_TRIE_NO_LIGATURE)
+        return HZ_TRUE;
+
+    for (edge = node->first_edge; edge < node->first_edge + node->edge_count; ++edge) {
+        for (i = 0; i < glyph_count; ++i) {
+            if (((set[i >> 6] >> (i & 63)) & 1) && !hz_glyph_filter_skips(filter, &glyphs[i])
+                && glyphs[i].id == subst->edge_glyphs[edge]) {
+                if (hz_ligature_subst_matches_set(subst, subst->edge_nodes[edge], filter,
+                                                  glyphs, set, glyph_count))
+                    return HZ_TRUE;
                 break;
             }
-            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_LIGATURE_ATTACHMENT: {
-                if (format == 1) {
-                    hz_offset16_t mark_coverage_offset;
-                    hz_offset16_t ligature_coverage_offset;
-                    uint16_t mark_class_count;
-                    hz_offset16_t mark_array_offset;
-                    hz_offset16_t ligature_array_offset;
-
-                    hz_mark_record_t *mark_records;
-                    uint16_t mark_count;
-                    hz_offset16_t *ligature_attach_offsets;
-                    uint16_t ligature_count;
-
-                    /* mark and base pointers */
-                    hz_sequence_node_t *m, *l;
-
-                    hz_map_t *mark_map = hz_map_create();
-                    hz_map_t *ligature_map = hz_map_create();
-
-                    hz_stream_read16(subtable, (uint16_t *)&mark_coverage_offset);
-                    hz_stream_read16(subtable, (uint16_t *)&ligature_coverage_offset);
-                    hz_stream_read16(subtable, &mark_class_count);
-                    hz_stream_read16(subtable, (uint16_t *)&mark_array_offset);
-                    hz_stream_read16(subtable, (uint16_t *)&ligature_array_offset);
-
-                    /* parse coverages */
-                    hz_ot_layout_parse_coverage(subtable->data + mark_coverage_offset, mark_map, NULL);
-                    hz_ot_layout_parse_coverage(subtable->data + ligature_coverage_offset, ligature_map, NULL);
-
-                    {
-                        /* parse mark array */
-                        uint16_t mark_index;
-                        hz_stream_t *marks = hz_stream_create(subtable->data + mark_array_offset,
-                                                              0, 0);
-                        hz_stream_read16(marks, &mark_count);
-                        mark_records = HZ_MALLOC(sizeof(hz_mark_record_t) * mark_count);
-
-                        for (mark_index = 0; mark_index < mark_count; ++mark_index) {
-                            hz_mark_record_t *mark = &mark_records[mark_index];
-
-                            hz_stream_read16(marks, &mark->mark_class);
-                            hz_stream_read16(marks, &mark->mark_anchor_offset);
-                        }
-
-                        hz_stream_destroy(marks);
-                    }
+        }
+    }
 
-                    {
-                        /* parse ligature array */
-                        uint16_t ligature_index;
-                        hz_stream_t *ligatures = hz_stream_create(subtable->data + ligature_array_offset,
-                                                                  0, 0);
-                        hz_stream_read16(ligatures, &ligature_count);
-                        ligature_attach_offsets = HZ_MALLOC(ligature_count * sizeof(uint16_t));
-                        hz_stream_read16_n(ligatures, ligature_count, ligature_attach_offsets);
+    return HZ_FALSE;
+}
 
-                        hz_stream_destroy(ligatures);
-                    }
+/* clears the simple bit of the glyphs of the set the lookup can be applied at
+ * in a text made only of glyphs of the set */
+static void
+hz_lookup_table_clear_simple(const hz_lookup_table_t *lookup,
+                             hz_bool_t is_gsub,
+                             const hz_sequence_node_t *glyphs,
+                             const uint64_t *set,
+                             size_t glyph_count,
+                             uint64_t *simple)
+{
+    uint16_t subtable_index;
+    size_t i;
 
-                    /* go through section glyphs and adjust marks */
-                    for (m = sect->root; m != NULL; m = m->next) {
-                        if (m->gc & HZ_GLYPH_CLASS_MARK) {
-                            if (hz_map_value_exists(mark_map, m->id)) {
-                                l = hz_prev_node_not_of_class(m, HZ_GLYPH_CLASS_MARK, NULL);
+    for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+        const hz_lookup_subtable_t *subtable = &lookup->subtables[subtable_index];
+        const hz_coverage_t *coverage = hz_lookup_subtable_get_coverage(lookup, subtable, is_gsub);
 
-                                if (l->gc & HZ_GLYPH_CLASS_LIGATURE) {
-                                    if (hz_map_value_exists(ligature_map, l->id)) {
-                                        uint16_t mark_index = hz_map_get_value(mark_map, m->id);
-                                        hz_mark_record_t *mark_record = mark_records + mark_index;
+        if (coverage == NULL)
+            continue;
 
-                                        uint16_t ligature_index = hz_map_get_value(ligature_map, l->id);
-                                        hz_offset16_t ligature_attach_offset = ligature_attach_offsets[ligature_index];
+        for (i = 0; i < glyph_count; ++i) {
+            int32_t coverage_index;
 
-                                        hz_stream_t *ligature_attach_table = hz_stream_create(
-                                                subtable->data + ligature_array_offset + ligature_attach_offset,
-                                                0, 0);
+            if (hz_glyph_filter_skips(&lookup->filter, &glyphs[i]))
+                continue;
 
-                                        uint16_t component_count;
-                                        hz_stream_read16(ligature_attach_table, &component_count);
+            coverage_index = hz_coverage_search(coverage, glyphs[i].id);
+            if (coverage_index < 0)
+                continue;
 
-                                        hz_offset16_t *anchor_offsets = (hz_offset16_t *)
-                                                (ligature_attach_table->data + ligature_attach_table->offset);
+            /* rules and ligatures asking for glyphs outside of the set never match */
+            if (hz_lookup_table_is_context(lookup, is_gsub)
+                && !hz_context_matches_set(subtable->compiled.context, &lookup->filter,
+                                           glyphs[i].id, glyphs, set, glyph_count))
+                continue;
 
-                                        hz_offset16_t ligature_anchor_offset = bswap16(
-                                                anchor_offsets[m->cid * mark_class_count + mark_record->mark_class]);
+            if (is_gsub && lookup->lookup_type == HZ_GSUB_LOOKUP_TYPE_LIGATURE_SUBSTITUTION
+                && (coverage_index >= subtable->compiled.ligature_subst->root_count
+                    || !hz_ligature_subst_matches_set(subtable->compiled.ligature_subst,
+                                                      subtable->compiled.ligature_subst->roots[coverage_index],
+                                                      &lookup->filter, glyphs, set, glyph_count)))
+                continue;
 
-                                        if (mark_record->mark_anchor_offset && ligature_anchor_offset) {
-                                            hz_anchor_t mark_anchor = hz_ot_layout_read_anchor(subtable->data
-                                                    + mark_array_offset
-                                                    + mark_record->mark_anchor_offset);
+            simple[i >> 6] &= ~((uint64_t) 1 << (i & 63));
+        }
+    }
+}
 
-                                            hz_anchor_t ligature_anchor = hz_ot_layout_read_anchor(subtable->data
-                                                    + ligature_array_offset
-                                                    + ligature_attach_offset
-                                                    + ligature_anchor_offset);
+void
+hz_ot_layout_gather_simple_glyphs(hz_face_t *face,
+                                  hz_tag_t script,
+                                  hz_tag_t language,
+                                  const hz_array_t *wanted_features,
+                                  hz_bool_t kern_table,
+                                  const hz_sequence_node_t *glyphs,
+                                  size_t glyph_count,
+                                  uint64_t *simple,
+                                  int16_t *kerning,
+                                  uint64_t *kerned)
+{
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    const hz_face_ot_tables_t *tables = hz_face_get_ot_tables(face);
+    size_t set_words = (glyph_count + 63) / 64;
+    hz_array_t *gsub_lookups, *gpos_lookups;
+    uint64_t *set;
+    size_t i, first, second;
+
+    memset(kerning, 0, glyph_count * glyph_count * sizeof(int16_t));
+    memset(kerned, 0, (glyph_count * glyph_count + 63) / 64 * sizeof(uint64_t));
+    memset(simple, 0, set_words * sizeof(uint64_t));
+
+    /* marks are kerned and attached over, they're never simple */
+    for (i = 0; i < glyph_count; ++i)
+        if (!(glyphs[i].gc & HZ_GLYPH_CLASS_MARK))
+            simple[i >> 6] |= (uint64_t) 1 << (i & 63);
+
+    if (layout == NULL)
+        return;
+
+    /* the lookups are matched against text made of the glyphs that could be
+     * simple, a glyph some lookup applies at in such a text isn't */
+    set = HZ_MALLOC((set_words ? set_words : 1) * sizeof(uint64_t));
+    memcpy(set, simple, set_words * sizeof(uint64_t));
+
+    gsub_lookups = hz_array_create();
+    hz_ot_layout_gather_lookups(face, tables->GSUB_table, script, language, wanted_features, gsub_lookups);
+    for (i = 0; i < hz_array_size(gsub_lookups); ++i) {
+        uint16_t lookup_index = hz_array_at(gsub_lookups, i);
+        if (lookup_index < layout->gsub_lookup_count)
+            hz_lookup_table_clear_simple(&layout->gsub_lookups[lookup_index], HZ_TRUE,
+                                         glyphs, set, glyph_count, simple);
+    }
 
-                                            int32_t x1 = mark_anchor.x_coord;
-                                            int32_t y1 = mark_anchor.y_coord;
-                                            int32_t x2 = ligature_anchor.x_coord;
-                                            int32_t y2 = ligature_anchor.y_coord;
+    gpos_lookups = hz_array_create();
+    hz_ot_layout_gather_lookups(face, tables->GPOS_table, script, language, wanted_features, gpos_lookups);
+    for (i = 0; i < hz_array_size(gpos_lookups); ++i) {
+        uint16_t lookup_index = hz_array_at(gpos_lookups, i);
+        const hz_lookup_table_t *lookup;
 
-                                            m->x_offset = x2 - x1;
-                                            m->y_offset = y2 - y1;
-                                        }
+        if (lookup_index >= layout->gpos_lookup_count)
+            continue;
 
-                                        hz_stream_destroy(ligature_attach_table);
-                                    }
-                                }
-                            }
-                        }
-                    }
+        lookup = &layout->gpos_lookups[lookup_index];
+        if (lookup->lookup_type != HZ_GPOS_LOOKUP_TYPE_PAIR_ADJUSTMENT) {
+            hz_lookup_table_clear_simple(lookup, HZ_FALSE, glyphs, set, glyph_count, simple);
+            continue;
+        }
 
-                    /* destroy */
-                    HZ_FREE(mark_records);
-                    HZ_FREE(ligature_attach_offsets);
-                    hz_map_destroy(mark_map);
-                    hz_map_destroy(ligature_map);
-                } else {
-                    /* error */
-                }
-                break;
+        /* pairs are adjusted by the first subtable that has them, only advances
+         * of first glyphs the lookup doesn't skip over keep a glyph simple */
+        for (first = 0; first < glyph_count; ++first) {
+            if (hz_glyph_filter_skips(&lookup->filter, &glyphs[first])) {
+                simple[first >> 6] &= ~((uint64_t) 1 << (first & 63));
+                continue;
             }
-            case HZ_GPOS_LOOKUP_TYPE_MARK_TO_MARK_ATTACHMENT: {
-                if (format == 1) {
-                    hz_offset16_t mark1_coverage_offset;
-                    hz_offset16_t mark2_coverage_offset;
-                    uint16_t mark_class_count;
-                    hz_offset16_t mark1_array_offset;
-                    hz_offset16_t mark2_array_offset;
-                    hz_map_t *mark1_map = hz_map_create();
-                    hz_map_t *mark2_map = hz_map_create();
-                    hz_mark_record_t *mark1_records;
-                    hz_offset16_t *mark2_anchor_offsets;
-                    uint16_t mark1_count, mark2_count;
-                    hz_sequence_node_t *node;
-
-                    hz_stream_read16(subtable, &mark1_coverage_offset);
-                    hz_stream_read16(subtable, &mark2_coverage_offset);
-                    hz_stream_read16(subtable, &mark_class_count);
-                    hz_stream_read16(subtable, &mark1_array_offset);
-                    hz_stream_read16(subtable, &mark2_array_offset);
-
-                    /* parse coverages */
-                    hz_ot_layout_parse_coverage(subtable->data + mark1_coverage_offset, mark1_map, NULL);
-                    hz_ot_layout_parse_coverage(subtable->data + mark2_coverage_offset, mark2_map, NULL);
-
-                    /* parse mark arrays */
-                    {
-                        /* parse mark1 array */
-                        uint16_t mark_index;
-                        hz_stream_t *mark_array = hz_stream_create(subtable->data + mark1_array_offset,0,0);
-                        hz_stream_read16(mark_array, &mark1_count);
-                        mark1_records = HZ_MALLOC(sizeof(hz_mark_record_t) * mark1_count);
-                        for (mark_index = 0; mark_index < mark1_count; ++mark_index) {
-                            hz_mark_record_t *record = mark1_records + mark_index;
-                            hz_stream_read16(mark_array, &record->mark_class);
-                            hz_stream_read16(mark_array, &record->mark_anchor_offset);
-                        }
 
-                        hz_stream_destroy(mark_array);
-                    }
+            for (second = 0; second < glyph_count; ++second) {
+                size_t pair = first * glyph_count + second;
+                uint16_t subtable_index;
 
-                    {
-                        /* parse mark2 array */
-                        hz_stream_t *mark_array = hz_stream_create(subtable->data + mark2_array_offset,0,0);
-                        hz_stream_read16(mark_array, &mark2_count);
-                        mark2_anchor_offsets = HZ_MALLOC(sizeof(uint16_t) * mark_class_count * mark2_count);
-                        hz_stream_read16_n(mark_array, mark_class_count * mark2_count, mark2_anchor_offsets);
-                        hz_stream_destroy(mark_array);
-                    }
+                for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+                    const hz_pair_pos_t *pos = lookup->subtables[subtable_index].compiled.pair_pos;
+                    uint32_t value_index;
 
-                    /* go over every glyph and position marks in relation to their base mark */
-                    for (node = sect->root; node != NULL; node = node->next) {
-                        if (node->gc & HZ_GLYPH_CLASS_MARK) {
-                            /* glyph is of mark class, position in relation to last mark */
-                            hz_sequence_node_t *prev_node = hz_prev_node_not_of_class(node, gcignore, NULL);
-                            if (prev_node != NULL) {
-                                /* previous mark found, check if both glyph's ids are found in the
-                                 * coverage maps.
-                                 * */
-                                if (hz_map_value_exists(mark1_map, node->id) &&
-                                    hz_map_value_exists(mark2_map, prev_node->id)) {
-                                    /* both marks glyphs are covered */
-                                    uint16_t mark1_index = hz_map_get_value(mark1_map, node->id);
-                                    HZ_ASSERT(mark1_index < mark1_count);
-                                    hz_mark_record_t *mark1 = &mark1_records[ mark1_index ];
-
-                                    uint16_t mark2_index = hz_map_get_value(mark2_map, prev_node->id);
-                                    HZ_ASSERT(mark1->mark_class < mark_class_count);
-                                    uint16_t mark2_anchor_offset = mark2_anchor_offsets[ mark2_index * mark_class_count
-                                                                                         + mark1->mark_class ];
-
-                                    /* check if the base anchor is NULL */
-                                    if (mark2_anchor_offset != 0) {
-                                        hz_anchor_t mark2_anchor = hz_ot_layout_read_anchor(
-                                                subtable->data + mark2_array_offset + mark2_anchor_offset);
-                                        hz_anchor_t mark1_anchor = hz_ot_layout_read_anchor(
-                                                subtable->data + mark1_array_offset + mark1->mark_anchor_offset);
-
-                                        hz_metrics_t *base_metric = hz_face_get_glyph_metrics(face, prev_node->id);
-                                        hz_metrics_t *mark_metric = hz_face_get_glyph_metrics(face, node->id);
-
-                                        int32_t x1 = mark1_anchor.x_coord;
-                                        int32_t y1 = mark1_anchor.y_coord;
-                                        int32_t x2 = mark2_anchor.x_coord;
-                                        int32_t y2 = mark2_anchor.y_coord;
-
-                                        node->x_offset += x2 - x1;
-                                        node->y_offset += y2 - y1;
-                                    }
-                                }
-                            }
-                        }
-                    }
+                    if (pos == NULL || !hz_pair_pos_get(pos, glyphs[first].id, glyphs[second].id, &value_index))
+                        continue;
 
+                    if (pos->x_advances != NULL) {
+                        kerning[pair] += pos->x_advances[value_index];
+                        kerned[pair >> 6] |= (uint64_t) 1 << (pair & 63);
+                    } else {
+                        simple[first >> 6] &= ~((uint64_t) 1 << (first & 63));
+                    }
+                    break;
+                }
+            }
+        }
+    }
 
-                    HZ_FREE(mark1_records);
-                    HZ_FREE(mark2_anchor_offsets);
-                    hz_map_destroy(mark1_map);
-                    hz_map_destroy(mark2_map);
+    if (kern_table && layout->kern_table != NULL && !layout->gpos_has_kerning) {
+        for (first = 0; first < glyph_count; ++first) {
+            for (second = 0; second < glyph_count; ++second) {
+                size_t pair = first * glyph_count + second;
+                int16_t value = hz_kern_table_get(layout->kern_table, glyphs[first].id, glyphs[second].id);
 
-                } else {
-                    /* error */
+                if (value) {
+                    kerning[pair] += value;
+                    kerned[pair >> 6] |= (uint64_t) 1 << (pair & 63);
                 }
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_CONTEXT_POSITIONING: {
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_CHAINED_CONTEXT_POSITIONING: {
-                break;
-            }
-            case HZ_GPOS_LOOKUP_TYPE_EXTENSION_POSITIONING: {
-                break;
-            }
-            default: {
-                break;
             }
         }
+    }
 
-        hz_stream_destroy(subtable);
-        ++subtable_index;
+    hz_array_destroy(gpos_lookups);
+    hz_array_destroy(gsub_lookups);
+    HZ_FREE(set);
+}
+
+/* sets the bits of the glyphs some lookup of a table can be applied at */
+static void
+hz_ot_layout_fill_active_glyphs(const hz_ot_layout_t *layout,
+                                const hz_lookup_table_t *lookups,
+                                uint16_t lookup_count,
+                                hz_bool_t is_gsub,
+                                const hz_array_t *lookup_indices,
+                                uint64_t *active_glyphs)
+{
+    size_t i;
+    uint16_t subtable_index;
+
+    memset(active_glyphs, 0, layout->bitset_words * sizeof(uint64_t));
+
+    for (i = 0; i < hz_array_size(lookup_indices); ++i) {
+        uint16_t lookup_index = hz_array_at(lookup_indices, i);
+        const hz_lookup_table_t *lookup;
+
+        if (lookup_index >= lookup_count)
+            continue;
+
+        lookup = &lookups[lookup_index];
+        for (subtable_index = 0; subtable_index < lookup->subtable_count; ++subtable_index) {
+            const hz_coverage_t *coverage =
+                hz_lookup_subtable_get_coverage(lookup, &lookup->subtables[subtable_index], is_gsub);
+
+            if (coverage != NULL)
+                hz_coverage_fill_bitset(coverage, active_glyphs, layout->glyph_count);
+        }
     }
 }
 
+void
+hz_ot_layout_gather_active_glyphs(hz_face_t *face,
+                                  hz_tag_t script,
+                                  hz_tag_t language,
+                                  const hz_array_t *wanted_features,
+                                  uint64_t *gsub_glyphs,
+                                  uint64_t *gpos_glyphs)
+{
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    const hz_face_ot_tables_t *tables = hz_face_get_ot_tables(face);
+    hz_array_t *lookup_indices;
+
+    lookup_indices = hz_array_create();
+    hz_ot_layout_gather_lookups(face, tables->GSUB_table, script, language, wanted_features, lookup_indices);
+    hz_ot_layout_fill_active_glyphs(layout, layout->gsub_lookups, layout->gsub_lookup_count, HZ_TRUE,
+                                    lookup_indices, gsub_glyphs);
+    hz_array_destroy(lookup_indices);
+
+    lookup_indices = hz_array_create();
+    hz_ot_layout_gather_lookups(face, tables->GPOS_table, script, language, wanted_features, lookup_indices);
+    hz_ot_layout_fill_active_glyphs(layout, layout->gpos_lookups, layout->gpos_lookup_count, HZ_FALSE,
+                                    lookup_indices, gpos_glyphs);
+    hz_array_destroy(lookup_indices);
+}
+
 hz_tag_t
 hz_ot_script_to_tag(hz_script_t script)
 {
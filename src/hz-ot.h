@@ -7,6 +7,12 @@
 #include "hz-base.h"
 #include "hz-font.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -518,6 +524,16 @@ typedef enum hz_glyph_class_t {
 #define HZ_BIT(x) (1 << (x))
 
 
+/*  Enum: hz_glyph_flag_t
+ *      Flags shaping sets on glyphs.
+ *
+ *      HZ_GLYPH_FLAG_UNSAFE_TO_BREAK - The glyph was shaped in context with the glyphs
+ *      before it, shaping the text on both sides of it apart gives different glyphs.
+ * */
+typedef enum hz_glyph_flag_t {
+    HZ_GLYPH_FLAG_UNSAFE_TO_BREAK = 0x01
+} hz_glyph_flag_t;
+
 typedef struct hz_sequence_node_t hz_sequence_node_t;
 
 /*  Struct: hz_section_node_t
@@ -525,37 +541,178 @@ typedef struct hz_sequence_node_t hz_sequence_node_t;
  *
  *  Fields:
  *      codepoint - Initial codepoint for this glyph.
+ *      cluster - Offset of the character this glyph was shaped from in the loaded text,
+ *      in code units of its encoding, see <hz_encoding_t>. While shaping it indexes the
+ *      sequence's text instead. Ligatures merge the clusters of their components and of
+ *      the glyphs between them, multiple substitutions copy it to every glyph.
  *      id - Glyph's ID.
  *      x_offset - X offset.
  *      y_offset - Y offset.
  *      x_advance - X advance (horizontal layout).
  *      y_advance - Y advance (vertical layout).
+ *      attach_chain - Offset to the parent glyph of a pending cursive attachment.
+ *      flags - Glyph flags, see <hz_glyph_flag_t>.
  *      glyph_class - Glyph's class.
  * */
 
 struct hz_sequence_node_t {
     hz_unicode_t codepoint; /* initial codepoint */
+    uint32_t cluster; /* offset of the source character */
     hz_index_t id; /* glyph index */
     uint16_t cid; /* component index */
     int16_t x_offset;
     int16_t y_offset;
     int16_t x_advance;
     int16_t y_advance;
+    int16_t attach_chain; /* offset to the glyph this one is cursively attached to */
+    uint8_t flags;
     hz_glyph_class_t gc: HZ_GLYPH_CLASS_BIT_FIELD;
-    hz_sequence_node_t *prev, *next;
 };
 
+/*  Struct: hz_glyph_filter_t
+ *      Glyphs a lookup skips over, compiled from its flags when the face is loaded.
+ *
+ *  Fields:
+ *      gcignore - Ignored glyph classes.
+ *      mark_glyphs - Bitset of the marks the lookup doesn't skip, taken from the
+ *      GDEF mark glyph set or mark attachment class, NULL if it keeps every mark.
+ *      glyph_count - Number of glyphs mark_glyphs holds bits for.
+ * */
+typedef struct hz_glyph_filter_t {
+    hz_glyph_class_t gcignore;
+    const uint64_t *mark_glyphs;
+    uint32_t glyph_count;
+} hz_glyph_filter_t;
+
+/* whether the filter skips the glyph of node */
+static hz_bool_t
+hz_glyph_filter_skips(const hz_glyph_filter_t *filter, const hz_sequence_node_t *node)
+{
+    if (node->gc & filter->gcignore)
+        return HZ_TRUE;
+
+    if ((node->gc & HZ_GLYPH_CLASS_MARK) && filter->mark_glyphs != NULL)
+        return node->id >= filter->glyph_count
+            || !((filter->mark_glyphs[node->id >> 6] >> (node->id & 63)) & 1);
+
+    return HZ_FALSE;
+}
+
 /*  Struct: hz_section_t
- *      Section of text for shaping.
+ *      Section of text for shaping, the glyphs are kept in a growable array.
+ *
+ *      While a substitution lookup is applied the glyphs are read from
+ *      nodes at cursor and written to out_nodes. The output aliases nodes
+ *      as long as it doesn't outgrow the consumed input, so one-to-one and
+ *      many-to-one substitutions work in place. Once a substitution outputs
+ *      more glyphs than it consumed, the output moves to spare_nodes and the
+ *      two arrays are swapped when the lookup is done.
  *
  *  Fields:
- *      root - Root of a doubly linked list for the glyph nodes.
- *      flags - Shaping flags.
+ *      nodes - Glyph nodes.
+ *      length - Number of glyph nodes.
+ *      capacity - Number of glyph nodes nodes and spare_nodes can hold.
+ *      out_nodes - Output of the substitution being applied.
+ *      out_length - Number of output glyph nodes.
+ *      spare_nodes - Array out_nodes is moved to once it can't alias nodes.
+ *      cursor - Index of the next input glyph node.
+ *      flags - Shaping flags, see <hz_sequence_flag_t>.
+ *      width - Sum of the glyph advances.
+ *      skip_cache - Skip indices of the glyphs, rebuilt lazily as the glyphs change.
+ *      text - Codepoints the sequence was loaded from.
+ *      text_offsets - Offset of every codepoint in the loaded text, in code units.
+ *      text_length - Number of codepoints.
+ *      text_capacity - Number of codepoints text and text_offsets can hold.
+ *      text_size - Size of the loaded text in code units.
+ *      encoding - Encoding of the loaded text.
  * */
+/* number of glyph filters a sequence keeps skip indices for */
+#define HZ_SKIP_INDEX_SLOT_COUNT 4
+
+/*  Struct: hz_skip_index_t
+ *      Indices of the glyphs not ignored by a lookup, built lazily for one glyph
+ *      filter so skipping over ignored glyphs is a single read.
+ *
+ *  Fields:
+ *      gcignore - Ignored glyph classes of the filter.
+ *      mark_glyphs - Mark bitset of the filter.
+ *      used - Whether the slot holds the indices of the filter.
+ *      capacity - Number of entries next and prev can hold.
+ *      next - Entry i is the first input index past i that isn't ignored, the length if there is none.
+ *      next_first - First valid entry of next, the entries up to the length are valid.
+ *      prev - Entry i is one past the last output index before i that isn't ignored, zero if there is none.
+ *      prev_count - Number of valid entries of prev.
+ * */
+typedef struct hz_skip_index_t {
+    hz_glyph_class_t gcignore;
+    const uint64_t *mark_glyphs;
+    hz_bool_t used;
+    size_t capacity;
+    uint32_t *next;
+    size_t next_first;
+    uint32_t *prev;
+    size_t prev_count;
+} hz_skip_index_t;
+
+/*  Struct: hz_skip_cache_t
+ *      Skip indices of the glyph filters last used on a sequence.
+ *
+ *  Fields:
+ *      slots - Skip indices.
+ *      next_slot - Slot claimed next by a filter that has none.
+ * */
+typedef struct hz_skip_cache_t {
+    hz_skip_index_t slots[HZ_SKIP_INDEX_SLOT_COUNT];
+    unsigned int next_slot;
+} hz_skip_cache_t;
+
+/*  Enum: hz_sequence_flag_t
+ *      Flags of a sequence being shaped.
+ *
+ *      HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT - The glyphs are in the logical order of right-to-left text.
+ *      HZ_SEQUENCE_FLAG_CURSIVE_CHAINS - Some glyphs hold cursive attachments left to resolve.
+ *      HZ_SEQUENCE_FLAG_X_POSITIONS - Set by the caller, shaping ends by filling x_positions.
+ * */
+typedef enum hz_sequence_flag_t {
+    HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT = 0x01,
+    HZ_SEQUENCE_FLAG_CURSIVE_CHAINS = 0x02,
+    HZ_SEQUENCE_FLAG_X_POSITIONS = 0x04
+} hz_sequence_flag_t;
+
+/*  Enum: hz_encoding_t
+ *      Encodings text is loaded from, clusters count their code units.
+ *
+ *      HZ_ENCODING_UTF8 - UTF-8, clusters are byte offsets.
+ *      HZ_ENCODING_UTF16 - UTF-16, clusters are offsets in 16-bit units.
+ *      HZ_ENCODING_UTF32 - Codepoints, clusters are codepoint indices.
+ *      HZ_ENCODING_LATIN1 - ISO-8859-1, clusters are byte offsets.
+ * */
+typedef enum hz_encoding_t {
+    HZ_ENCODING_UTF8,
+    HZ_ENCODING_UTF16,
+    HZ_ENCODING_UTF32,
+    HZ_ENCODING_LATIN1
+} hz_encoding_t;
+
 typedef struct hz_sequence_t {
-    hz_sequence_node_t *root;
+    hz_sequence_node_t *nodes;
+    size_t length;
+    size_t capacity;
+    hz_sequence_node_t *out_nodes;
+    size_t out_length;
+    hz_sequence_node_t *spare_nodes;
+    size_t cursor;
     int flags;
     int64_t width;
+    hz_skip_cache_t *skip_cache;
+    hz_unicode_t *text;
+    uint32_t *text_offsets;
+    size_t text_length;
+    size_t text_capacity;
+    size_t text_size;
+    hz_encoding_t encoding;
+    int64_t *x_positions; /* pen x before every glyph in visual order and the width after them */
+    size_t x_positions_capacity;
 } hz_sequence_t;
 
 static hz_language_t
@@ -570,238 +727,714 @@ hz_lang(const char *s) {
 static hz_sequence_t *
 hz_sequence_create(void) {
     hz_sequence_t *sequence = (hz_sequence_t *) HZ_MALLOC(sizeof(hz_sequence_t));
-    sequence->root = NULL;
+    sequence->nodes = NULL;
+    sequence->length = 0;
+    sequence->capacity = 0;
+    sequence->out_nodes = NULL;
+    sequence->out_length = 0;
+    sequence->spare_nodes = NULL;
+    sequence->cursor = 0;
     sequence->flags = 0;
     sequence->width = 0;
+    sequence->skip_cache = (hz_skip_cache_t *) HZ_MALLOC(sizeof(hz_skip_cache_t));
+    memset(sequence->skip_cache, 0, sizeof(hz_skip_cache_t));
+    sequence->text = NULL;
+    sequence->text_offsets = NULL;
+    sequence->text_length = 0;
+    sequence->text_capacity = 0;
+    sequence->text_size = 0;
+    sequence->encoding = HZ_ENCODING_UTF8;
+    sequence->x_positions = NULL;
+    sequence->x_positions_capacity = 0;
     return sequence;
 }
 
+/* forgets every skip index, the glyphs were rearranged or reclassified */
 static void
-hz_sequence_add(hz_sequence_t *sect, hz_sequence_node_t *new_node)
+hz_sequence_reset_skip_indices(hz_sequence_t *sequence)
 {
-    new_node->prev = NULL;
-    new_node->next = NULL;
-
-    if (sect->root == NULL)
-        sect->root = new_node;
-    else {
-        hz_sequence_node_t *curr_node;
-        curr_node = sect->root;
-        while (curr_node->next != NULL) {
-            curr_node = curr_node->next;
+    size_t i;
+
+    for (i = 0; i < HZ_SKIP_INDEX_SLOT_COUNT; ++i) {
+        sequence->skip_cache->slots[i].next_first = (size_t) -1;
+        sequence->skip_cache->slots[i].prev_count = 0;
+    }
+}
+
+/* the input glyphs before index were replaced, the next entries before it
+ * depend on them */
+static void
+hz_sequence_invalidate_input_skips(hz_sequence_t *sequence, size_t index)
+{
+    size_t i;
+
+    for (i = 0; i < HZ_SKIP_INDEX_SLOT_COUNT; ++i)
+        if (sequence->skip_cache->slots[i].next_first < index)
+            sequence->skip_cache->slots[i].next_first = index;
+}
+
+/* the output glyphs from index on were dropped, the prev entries past it
+ * depend on them */
+static void
+hz_sequence_invalidate_output_skips(hz_sequence_t *sequence, size_t index)
+{
+    size_t i;
+
+    for (i = 0; i < HZ_SKIP_INDEX_SLOT_COUNT; ++i)
+        if (sequence->skip_cache->slots[i].prev_count > index + 1)
+            sequence->skip_cache->slots[i].prev_count = index + 1;
+}
+
+/* skip indices of the filter, a filter without any claims the slots in turn */
+static hz_skip_index_t *
+hz_sequence_get_skip_index(const hz_sequence_t *sequence, const hz_glyph_filter_t *filter)
+{
+    hz_skip_cache_t *cache = sequence->skip_cache;
+    hz_skip_index_t *skip = NULL;
+    size_t i;
+
+    for (i = 0; i < HZ_SKIP_INDEX_SLOT_COUNT; ++i) {
+        if (cache->slots[i].used && cache->slots[i].gcignore == filter->gcignore
+            && cache->slots[i].mark_glyphs == filter->mark_glyphs) {
+            skip = &cache->slots[i];
+            break;
         }
+    }
+
+    if (skip == NULL) {
+        skip = &cache->slots[cache->next_slot];
+        cache->next_slot = (cache->next_slot + 1) % HZ_SKIP_INDEX_SLOT_COUNT;
+        skip->gcignore = filter->gcignore;
+        skip->mark_glyphs = filter->mark_glyphs;
+        skip->used = HZ_TRUE;
+        skip->next_first = (size_t) -1;
+        skip->prev_count = 0;
+    }
 
-        curr_node->next = new_node;
-        new_node->prev = curr_node;
+    /* the output may outgrow the input, both fit in the capacity */
+    if (skip->capacity < sequence->capacity + 1) {
+        skip->capacity = sequence->capacity + 1;
+        skip->next = (uint32_t *) HZ_REALLOC(skip->next, skip->capacity * sizeof(uint32_t));
+        skip->prev = (uint32_t *) HZ_REALLOC(skip->prev, skip->capacity * sizeof(uint32_t));
+        skip->next_first = (size_t) -1;
+        skip->prev_count = 0;
     }
+
+    if (skip->next_first > sequence->length)
+        skip->next_first = sequence->length;
+
+    return skip;
 }
 
+/* first input index past index whose glyph the filter doesn't skip, the length
+ * if there is none, the entries down to index are built on first use */
 static size_t
-hz_sequence_node_count(hz_sequence_node_t *node) {
-    size_t count = 0;
+hz_sequence_next_index(const hz_sequence_t *sequence, size_t index, const hz_glyph_filter_t *filter)
+{
+    hz_skip_index_t *skip = hz_sequence_get_skip_index(sequence, filter);
+
+    while (skip->next_first > index) {
+        size_t i = --skip->next_first;
 
-    while (node != NULL) {
-        ++count;
-        node = node->next;
+        if (i + 1 >= sequence->length)
+            skip->next[i] = (uint32_t) sequence->length;
+        else if (hz_glyph_filter_skips(filter, &sequence->nodes[i + 1]))
+            skip->next[i] = skip->next[i + 1];
+        else
+            skip->next[i] = (uint32_t) (i + 1);
     }
 
-    return count;
+    return skip->next[index];
 }
 
-static hz_sequence_node_t *
-hz_sequence_last_node(hz_sequence_node_t *node) {
-    while (node->next != NULL) {
-        node = node->next;
+/* one past the last output index before count whose glyph the filter doesn't
+ * skip, zero if there is none, the entries up to count are built on first use */
+static size_t
+hz_sequence_prev_output_index(const hz_sequence_t *sequence, size_t count, const hz_glyph_filter_t *filter)
+{
+    hz_skip_index_t *skip = hz_sequence_get_skip_index(sequence, filter);
+
+    while (skip->prev_count <= count) {
+        size_t i = skip->prev_count++;
+
+        if (i == 0)
+            skip->prev[i] = 0;
+        else if (hz_glyph_filter_skips(filter, &sequence->out_nodes[i - 1]))
+            skip->prev[i] = skip->prev[i - 1];
+        else
+            skip->prev[i] = (uint32_t) i;
     }
 
-    return node;
+    return skip->prev[count];
 }
 
-static hz_bool_t
-hz_sequence_rem_next_n_nodes(hz_sequence_node_t *g, size_t n)
+/* the input glyphs in (first, end) were shaped in context with the glyphs
+ * before them, the first one starts the context */
+static void
+hz_sequence_set_unsafe_to_break(hz_sequence_t *sequence, size_t first, size_t end)
 {
-    hz_sequence_node_t *next, *curr = g->next;
-    size_t i = 0;
-    if (n == 0) return HZ_TRUE;
+    size_t i;
 
-    while (curr != NULL && i < n) {
-        next = curr->next;
-        HZ_FREE(curr);
-        curr = next;
-        ++i;
+    for (i = first + 1; i < end && i < sequence->length; ++i)
+        sequence->nodes[i].flags |= HZ_GLYPH_FLAG_UNSAFE_TO_BREAK;
+}
+
+/* like hz_sequence_set_unsafe_to_break for a context starting in the output at
+ * out_first and ending in the input at end */
+static void
+hz_sequence_set_unsafe_to_break_from_output(hz_sequence_t *sequence, size_t out_first, size_t end)
+{
+    size_t i;
+
+    if (out_first >= sequence->out_length) {
+        hz_sequence_set_unsafe_to_break(sequence, sequence->cursor, end);
+        return;
     }
 
-    g->next = curr;
-    if (curr != NULL)
-        curr->prev = g;
+    for (i = out_first + 1; i < sequence->out_length; ++i)
+        sequence->out_nodes[i].flags |= HZ_GLYPH_FLAG_UNSAFE_TO_BREAK;
 
-    return HZ_TRUE;
+    for (i = sequence->cursor; i < end && i < sequence->length; ++i)
+        sequence->nodes[i].flags |= HZ_GLYPH_FLAG_UNSAFE_TO_BREAK;
+}
+
+/* grows both glyph arrays geometrically so they hold at least size nodes */
+static void
+hz_sequence_reserve(hz_sequence_t *sequence, size_t size)
+{
+    hz_bool_t aliased = sequence->out_nodes == sequence->nodes;
+    size_t capacity = sequence->capacity ? sequence->capacity : 16;
+
+    if (size <= sequence->capacity)
+        return;
+
+    while (capacity < size)
+        capacity *= 2;
+
+    sequence->nodes = (hz_sequence_node_t *) HZ_REALLOC(sequence->nodes,
+        capacity * sizeof(hz_sequence_node_t));
+    sequence->spare_nodes = (hz_sequence_node_t *) HZ_REALLOC(sequence->spare_nodes,
+        capacity * sizeof(hz_sequence_node_t));
+    sequence->out_nodes = aliased ? sequence->nodes : sequence->spare_nodes;
+    sequence->capacity = capacity;
+}
+
+/* grows the text geometrically so it holds at least size codepoints */
+static void
+hz_sequence_reserve_text(hz_sequence_t *sequence, size_t size)
+{
+    size_t capacity = sequence->text_capacity ? sequence->text_capacity : 16;
+
+    if (size <= sequence->text_capacity)
+        return;
+
+    while (capacity < size)
+        capacity *= 2;
+
+    sequence->text = (hz_unicode_t *) HZ_REALLOC(sequence->text, capacity * sizeof(hz_unicode_t));
+    sequence->text_offsets = (uint32_t *) HZ_REALLOC(sequence->text_offsets, capacity * sizeof(uint32_t));
+    sequence->text_capacity = capacity;
+}
+
+/* number of code units the codepoint takes in the encoding */
+static size_t
+hz_encoding_char_size(hz_encoding_t encoding, hz_unicode_t codepoint)
+{
+    switch (encoding) {
+        case HZ_ENCODING_UTF8:
+            return codepoint < 0x80 ? 1 : codepoint < 0x800 ? 2 : codepoint < 0x10000 ? 3 : 4;
+        case HZ_ENCODING_UTF16:
+            return codepoint < 0x10000 ? 1 : 2;
+        default:
+            return 1;
+    }
+}
+
+/* index of the first codepoint of the text at or past offset */
+static size_t
+hz_sequence_text_index(const hz_sequence_t *sequence, size_t offset)
+{
+    size_t low = 0, high = sequence->text_length;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (sequence->text_offsets[mid] < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* turns the clusters from text indices into offsets once shaping is done */
+static void
+hz_sequence_map_clusters(hz_sequence_t *sequence)
+{
+    size_t i;
+
+    for (i = 0; i < sequence->length; ++i) {
+        uint32_t index = sequence->nodes[i].cluster;
+        sequence->nodes[i].cluster = index < sequence->text_length
+            ? sequence->text_offsets[index] : (uint32_t) sequence->text_size;
+    }
+}
+
+static void
+hz_sequence_add(hz_sequence_t *sequence, const hz_sequence_node_t *node)
+{
+    hz_sequence_reserve(sequence, sequence->length + 1);
+    sequence->nodes[sequence->length++] = *node;
+    hz_sequence_reset_skip_indices(sequence);
+}
+
+/* starts a substitution pass over the whole sequence */
+static void
+hz_sequence_clear_output(hz_sequence_t *sequence)
+{
+    sequence->out_nodes = sequence->nodes;
+    sequence->out_length = 0;
+    sequence->cursor = 0;
+    hz_sequence_reset_skip_indices(sequence);
 }
 
-/* removes n nodes starting from start
- * including start
+/* makes room to output num_out nodes while consuming num_in input nodes */
+static void
+hz_sequence_make_room_for(hz_sequence_t *sequence, size_t num_in, size_t num_out)
+{
+    hz_sequence_reserve(sequence, sequence->out_length + num_out);
+
+    if (sequence->out_nodes == sequence->nodes
+        && sequence->out_length + num_out > sequence->cursor + num_in) {
+        /* output would overwrite input that wasn't read yet */
+        memcpy(sequence->spare_nodes, sequence->nodes,
+               sequence->out_length * sizeof(hz_sequence_node_t));
+        sequence->out_nodes = sequence->spare_nodes;
+    }
+}
+
+/* copies the node at the cursor to the output */
+static void
+hz_sequence_next_node(hz_sequence_t *sequence)
+{
+    if (sequence->out_nodes != sequence->nodes
+        || sequence->out_length != sequence->cursor) {
+        hz_sequence_make_room_for(sequence, 1, 1);
+        sequence->out_nodes[sequence->out_length] = sequence->nodes[sequence->cursor];
+    }
+
+    ++sequence->out_length;
+    ++sequence->cursor;
+}
+
+/* appends a node to the output without consuming input */
+static void
+hz_sequence_output_node(hz_sequence_t *sequence, const hz_sequence_node_t *node)
+{
+    hz_sequence_make_room_for(sequence, 0, 1);
+    sequence->out_nodes[sequence->out_length++] = *node;
+}
+
+/* consumes the node at the cursor without outputting it */
+static void
+hz_sequence_skip_node(hz_sequence_t *sequence)
+{
+    ++sequence->cursor;
+}
+
+/* moves the output position to index, either by outputting input nodes
+ * or by handing output nodes back to the input
  * */
 static hz_bool_t
-hz_sequence_rem_node_range(hz_sequence_node_t *n1, hz_sequence_node_t *n2) {
-    hz_sequence_node_t *next, *n = n1->next;
+hz_sequence_move_to(hz_sequence_t *sequence, size_t index)
+{
+    if (sequence->out_length < index) {
+        size_t count = index - sequence->out_length;
+
+        if (sequence->cursor + count > sequence->length)
+            return HZ_FALSE;
+
+        hz_sequence_make_room_for(sequence, count, count);
+        memmove(sequence->out_nodes + sequence->out_length,
+                sequence->nodes + sequence->cursor,
+                count * sizeof(hz_sequence_node_t));
+        sequence->cursor += count;
+        sequence->out_length += count;
+    } else if (sequence->out_length > index) {
+        size_t count = sequence->out_length - index;
+
+        if (sequence->cursor < count) {
+            /* only possible while the output has its own array,
+             * shift the unread input forward to make room */
+            size_t shift = count - sequence->cursor;
+            hz_sequence_reserve(sequence, sequence->length + shift);
+            memmove(sequence->nodes + sequence->cursor + shift,
+                    sequence->nodes + sequence->cursor,
+                    (sequence->length - sequence->cursor) * sizeof(hz_sequence_node_t));
+            sequence->cursor += shift;
+            sequence->length += shift;
+            hz_sequence_reset_skip_indices(sequence);
+        }
 
-    while (n != NULL && n != n2) {
-        next = n->next;
-        HZ_FREE(n);
-        n = next;
+        hz_sequence_invalidate_input_skips(sequence, sequence->cursor);
+        sequence->cursor -= count;
+        sequence->out_length -= count;
+        hz_sequence_invalidate_output_skips(sequence, sequence->out_length);
+        memmove(sequence->nodes + sequence->cursor,
+                sequence->out_nodes + sequence->out_length,
+                count * sizeof(hz_sequence_node_t));
     }
 
-    n1->next = n2;
-    n2->prev = n1;
     return HZ_TRUE;
 }
 
-typedef struct {
-    const hz_byte_t *mem;
-    hz_size_t length;
-    hz_size_t offset;
-} hz_utf8_dec_t;
+/* ends a substitution pass, the output becomes the sequence */
+static void
+hz_sequence_swap(hz_sequence_t *sequence)
+{
+    hz_sequence_move_to(sequence,
+                        sequence->out_length + sequence->length - sequence->cursor);
+
+    if (sequence->out_nodes != sequence->nodes) {
+        sequence->spare_nodes = sequence->nodes;
+        sequence->nodes = sequence->out_nodes;
+    }
 
-#define HZ_UTF8_END -1
-#define HZ_UTF8_ERROR -2
+    sequence->length = sequence->out_length;
+    sequence->out_length = 0;
+    sequence->cursor = 0;
+    hz_sequence_reset_skip_indices(sequence);
+}
 
-static int
-hz_utf8_get(hz_utf8_dec_t *dec) {
-    if (dec->offset >= dec->length)
-        return HZ_UTF8_END;
+/* stands in for ill-formed input, each maximal subpart of an ill-formed UTF-8
+ * sequence and each lone surrogate becomes one replacement character */
+#define HZ_REPLACEMENT_CHARACTER 0xFFFD
 
-    return dec->mem[dec->offset++];
+/* makes room for count more characters, the loaders write them in place */
+static void
+hz_sequence_begin_load(hz_sequence_t *sequence, size_t count, hz_encoding_t encoding)
+{
+    hz_sequence_reserve(sequence, sequence->length + count);
+    hz_sequence_reserve_text(sequence, sequence->text_length + count);
+    sequence->encoding = encoding;
 }
 
-static int
-hz_utf8_cont(hz_utf8_dec_t *dec) {
-    int c = hz_utf8_get(dec);
-    return ((c & 0xC0) == 0x80)
-           ? (c & 0x3F)
-           : HZ_UTF8_ERROR;
+/* appends a character taking size code units to the text and its glyph to the
+ * sequence, room was made by hz_sequence_begin_load */
+static void
+hz_sequence_put_char(hz_sequence_t *sequence, hz_unicode_t codepoint, size_t size)
+{
+    hz_sequence_node_t *node = &sequence->nodes[sequence->length++];
+
+    memset(node, 0, sizeof(hz_sequence_node_t));
+    node->codepoint = codepoint;
+    node->cluster = (uint32_t) sequence->text_length;
+    node->gc = HZ_GLYPH_CLASS_ZERO;
+    sequence->text[sequence->text_length] = codepoint;
+    sequence->text_offsets[sequence->text_length++] = (uint32_t) sequence->text_size;
+    sequence->text_size += size;
 }
 
-static int
-hz_utf8_next(hz_utf8_dec_t *dec) {
-    int c;
-    int c1;
-    int c2;
-    int c3;
-    int r;
-    c = hz_utf8_get(dec);
+/* appends count characters of one code unit each, the bytes are their codepoints */
+static void
+hz_sequence_put_bytes(hz_sequence_t *sequence, const uint8_t *bytes, size_t count)
+{
+    hz_unicode_t *text = sequence->text + sequence->text_length;
+    uint32_t *offsets = sequence->text_offsets + sequence->text_length;
+    uint32_t offset = (uint32_t) sequence->text_size;
+    size_t i = 0;
 
-    /*
-        Zero continuation (0 to 127)
-    */
-    if ((c & 0x80) == 0) {
-        return c;
+#if defined(__AVX2__)
+    {
+        __m256i step = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadl_epi64((const __m128i *) (bytes + i));
+            _mm256_storeu_si256((__m256i *) (text + i), _mm256_cvtepu8_epi32(v));
+            _mm256_storeu_si256((__m256i *) (offsets + i),
+                                _mm256_add_epi32(_mm256_set1_epi32((int) (offset + i)), step));
+        }
     }
+#elif defined(__SSE2__)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i step = _mm_set_epi32(3, 2, 1, 0);
+
+        for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+            __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+            size_t k;
+
+            _mm_storeu_si128((__m128i *) (text + i), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *) (text + i + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128((__m128i *) (text + i + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128((__m128i *) (text + i + 12), _mm_unpackhi_epi16(hi, zero));
+
+            for (k = 0; k < 16; k += 4)
+                _mm_storeu_si128((__m128i *) (offsets + i + k),
+                                 _mm_add_epi32(_mm_set1_epi32((int) (offset + i + k)), step));
+        }
+    }
+#endif
 
-    /*
-        One continuation (128 to 2047)
-    */
-    if ((c & 0xE0) == 0xC0) {
-        c1 = hz_utf8_cont(dec);
-        if (c1 >= 0) {
-            r = ((c & 0x1F) << 6) | c1;
-            if (r >= 128) {
-                return r;
-            }
+    for (; i < count; ++i) {
+        text[i] = bytes[i];
+        offsets[i] = offset + (uint32_t) i;
+    }
+
+    for (i = 0; i < count; ++i) {
+        hz_sequence_node_t *node = &sequence->nodes[sequence->length + i];
+
+        memset(node, 0, sizeof(hz_sequence_node_t));
+        node->codepoint = text[i];
+        node->cluster = (uint32_t) (sequence->text_length + i);
+        node->gc = HZ_GLYPH_CLASS_ZERO;
+    }
+
+    sequence->length += count;
+    sequence->text_length += count;
+    sequence->text_size += count;
+}
+
+/* number of bytes before the first one that isn't ASCII */
+static size_t
+hz_utf8_ascii_length(const uint8_t *bytes, size_t length)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= length; i += 32) {
+        int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (bytes + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (bytes + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+            break;
+    }
+
+    while (i < length && bytes[i] < 0x80)
+        ++i;
+
+    return i;
+}
+
+/* length of the sequence a UTF-8 lead byte starts, zero for bytes that can't lead */
+static const uint8_t hz_utf8_sequence_lengths[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* decodes the UTF-8 sequence at bytes and returns the number of bytes it takes.
+ * An ill-formed sequence decodes to the replacement character and takes its
+ * maximal subpart, the bytes up to the one that can't continue it
+ * */
+static size_t
+hz_utf8_decode(const uint8_t *bytes, size_t length, hz_unicode_t *codepoint)
+{
+    size_t size = hz_utf8_sequence_lengths[bytes[0]], i;
+    uint8_t low = 0x80, high = 0xBF;
+    hz_unicode_t c;
+
+    *codepoint = HZ_REPLACEMENT_CHARACTER;
+
+    if (size <= 1) {
+        if (size == 1)
+            *codepoint = bytes[0];
+        return 1;
+    }
+
+    /* the second byte rules out overlong forms, surrogates and codepoints past U+10FFFF */
+    switch (bytes[0]) {
+        case 0xE0: low = 0xA0; break;
+        case 0xED: high = 0x9F; break;
+        case 0xF0: low = 0x90; break;
+        case 0xF4: high = 0x8F; break;
+    }
+
+    c = bytes[0] & (0x7F >> size);
+    for (i = 1; i < size; ++i) {
+        if (i >= length || bytes[i] < low || bytes[i] > high)
+            return i;
+
+        c = (c << 6) | (bytes[i] & 0x3F);
+        low = 0x80;
+        high = 0xBF;
+    }
+
+    *codepoint = c;
+    return size;
+}
+
+/*  Function: hz_sequence_load_utf8
+ *      Appends UTF-8 text to a sequence, clusters are byte offsets. Runs of ASCII
+ *      are validated and widened in blocks, ill-formed sequences are replaced
+ *      with U+FFFD.
+ *
+ *  Parameters:
+ *      sequence - The sequence.
+ *      text - The text.
+ *      len - Size of the text in bytes.
+ * */
+static void
+hz_sequence_load_utf8(hz_sequence_t *sequence, const hz_char *text, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *) text;
+    size_t offset = 0;
+
+    /* every byte is at most one character */
+    hz_sequence_begin_load(sequence, len, HZ_ENCODING_UTF8);
+
+    while (offset < len) {
+        if (bytes[offset] < 0x80) {
+            size_t count = hz_utf8_ascii_length(bytes + offset, len - offset);
+            hz_sequence_put_bytes(sequence, bytes + offset, count);
+            offset += count;
+        } else {
+            hz_unicode_t codepoint;
+            size_t size = hz_utf8_decode(bytes + offset, len - offset, &codepoint);
+            hz_sequence_put_char(sequence, codepoint, size);
+            offset += size;
         }
+    }
+
+    hz_sequence_reset_skip_indices(sequence);
+}
+
+/*  Function: hz_sequence_load_utf16
+ *      Appends UTF-16 text in native byte order to a sequence, clusters are offsets
+ *      in 16-bit units. Lone surrogates are replaced with U+FFFD.
+ * */
+static void
+hz_sequence_load_utf16(hz_sequence_t *sequence, const uint16_t *text, size_t len)
+{
+    size_t offset = 0;
+
+    hz_sequence_begin_load(sequence, len, HZ_ENCODING_UTF16);
+
+    while (offset < len) {
+        uint16_t unit = text[offset];
 
-        /*
-            Two continuations (2048 to 55295 and 57344 to 65535)
-        */
-    } else if ((c & 0xF0) == 0xE0) {
-        c1 = hz_utf8_cont(dec);
-        c2 = hz_utf8_cont(dec);
-        if ((c1 | c2) >= 0) {
-            r = ((c & 0x0F) << 12) | (c1 << 6) | c2;
-            if (r >= 2048 && (r < 55296 || r > 57343)) {
-                return r;
+#if defined(__SSE2__)
+        /* blocks without surrogates are characters of one unit each */
+        if (offset + 8 <= len) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (text + offset));
+            __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short) 0xF800)),
+                                                 _mm_set1_epi16((short) 0xD800));
+
+            if (!_mm_movemask_epi8(surrogates)) {
+                size_t end = offset + 8;
+                for (; offset < end; ++offset)
+                    hz_sequence_put_char(sequence, text[offset], 1);
+                continue;
             }
         }
+#endif
 
-        /*
-            Three continuations (65536 to 1114111)
-        */
-    } else if ((c & 0xF8) == 0xF0) {
-        c1 = hz_utf8_cont(dec);
-        c2 = hz_utf8_cont(dec);
-        c3 = hz_utf8_cont(dec);
-        if ((c1 | c2 | c3) >= 0) {
-            r = ((c & 0x07) << 18) | (c1 << 12) | (c2 << 6) | c3;
-            if (r >= 65536 && r <= 1114111) {
-                return r;
-            }
+        if (unit < 0xD800 || unit > 0xDFFF) {
+            hz_sequence_put_char(sequence, unit, 1);
+            ++offset;
+        } else if (unit < 0xDC00 && offset + 1 < len
+                   && text[offset + 1] >= 0xDC00 && text[offset + 1] <= 0xDFFF) {
+            hz_sequence_put_char(sequence, 0x10000 + (((hz_unicode_t) unit - 0xD800) << 10)
+                                           + (text[offset + 1] - 0xDC00), 2);
+            offset += 2;
+        } else {
+            hz_sequence_put_char(sequence, HZ_REPLACEMENT_CHARACTER, 1);
+            ++offset;
         }
     }
 
-    return HZ_UTF8_ERROR;
+    hz_sequence_reset_skip_indices(sequence);
 }
 
-
+/*  Function: hz_sequence_load_utf32
+ *      Appends codepoints to a sequence, clusters are codepoint indices. Surrogates
+ *      and values past U+10FFFF are replaced with U+FFFD.
+ * */
 static void
-hz_sequence_load_utf8(hz_sequence_t *sect, const hz_char *text, size_t len) {
-    hz_unicode_t code;
-    int ch;
-
-    hz_utf8_dec_t dec;
-    dec.mem = (const hz_byte_t *) text;
-    dec.length = len;
-    dec.offset = 0;
-
-    /* TODO: do proper error handling for the UTF-8 decoder */
-    while ((ch = hz_utf8_next(&dec)) > 0) {
-        hz_sequence_node_t *node = (hz_sequence_node_t *) HZ_MALLOC(sizeof(hz_sequence_node_t));
-        node->codepoint = ch;
-        node->id = 0;
-        node->cid = 0;
-        node->gc = HZ_GLYPH_CLASS_ZERO;
-        node->x_advance = 0;
-        node->y_advance = 0;
-        node->x_offset = 0;
-        node->y_offset = 0;
-        hz_sequence_add(sect, node);
+hz_sequence_load_utf32(hz_sequence_t *sequence, const uint32_t *text, size_t len)
+{
+    size_t i;
+
+    hz_sequence_begin_load(sequence, len, HZ_ENCODING_UTF32);
+
+    for (i = 0; i < len; ++i) {
+        hz_unicode_t codepoint = text[i];
+
+        if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+            codepoint = HZ_REPLACEMENT_CHARACTER;
+
+        hz_sequence_put_char(sequence, codepoint, 1);
     }
+
+    hz_sequence_reset_skip_indices(sequence);
+}
+
+/*  Function: hz_sequence_load_latin1
+ *      Appends ISO-8859-1 text to a sequence, clusters are byte offsets.
+ * */
+static void
+hz_sequence_load_latin1(hz_sequence_t *sequence, const hz_char *text, size_t len)
+{
+    hz_sequence_begin_load(sequence, len, HZ_ENCODING_LATIN1);
+    hz_sequence_put_bytes(sequence, (const uint8_t *) text, len);
+    hz_sequence_reset_skip_indices(sequence);
 }
 
 static void
 hz_sequence_load_unicode(hz_sequence_t *sequence, const hz_unicode_t *codepoints, size_t size)
 {
-    size_t i;
-    for (i = 0; i < size; ++i) {
-        hz_sequence_node_t *node = (hz_sequence_node_t *)HZ_MALLOC(sizeof(hz_sequence_node_t));
-        node->codepoint = codepoints[i];
-        node->id = 0;
-        node->cid = 0;
-        node->gc = HZ_GLYPH_CLASS_ZERO;
-        node->x_advance = 0;
-        node->y_advance = 0;
-        node->x_offset = 0;
-        node->y_offset = 0;
-        hz_sequence_add(sequence, node);
-    }
+    hz_sequence_load_utf32(sequence, codepoints, size);
 }
 
 static void
 hz_sequence_load_utf8_zt(hz_sequence_t *sequence, const hz_char *text) {
-    hz_sequence_load_utf8(sequence, text, UINT64_MAX);
+    hz_sequence_load_utf8(sequence, text, strlen((const char *) text));
 }
 
 static void
 hz_sequence_destroy(hz_sequence_t *sequence) {
-    hz_sequence_node_t *node = sequence->root;
-
-    while (node != NULL) {
-        hz_sequence_node_t *node_tmp = node;
-        node = node->next;
-        node_tmp->prev = NULL;
-        node_tmp->next = NULL;
-        HZ_FREE(node_tmp);
+    size_t i;
+
+    for (i = 0; i < HZ_SKIP_INDEX_SLOT_COUNT; ++i) {
+        HZ_FREE(sequence->skip_cache->slots[i].next);
+        HZ_FREE(sequence->skip_cache->slots[i].prev);
     }
 
-    sequence->root = NULL;
+    HZ_FREE(sequence->skip_cache);
+    HZ_FREE(sequence->text);
+    HZ_FREE(sequence->text_offsets);
+    HZ_FREE(sequence->x_positions);
+    HZ_FREE(sequence->nodes);
+    HZ_FREE(sequence->spare_nodes);
     HZ_FREE(sequence);
 }
 
@@ -923,14 +1556,132 @@ typedef enum hz_gpos_lookup_type_t {
     HZ_GPOS_LOOKUP_TYPE_EXTENSION_POSITIONING = 9,
 } hz_gpos_lookup_type_t;
 
+typedef enum hz_value_format_flag_t {
+    /* Includes horizontal adjustment for placement */
+    HZ_VALUE_FORMAT_X_PLACEMENT = 0x0001,
+
+    /* Includes vertical adjustment for placement */
+    HZ_VALUE_FORMAT_Y_PLACEMENT = 0x0002,
+
+    /* Includes horizontal adjustment for advance */
+    HZ_VALUE_FORMAT_X_ADVANCE = 0x0004,
+
+    /* Includes vertical adjustment for advance */
+    HZ_VALUE_FORMAT_Y_ADVANCE = 0x0008,
+
+    /* Includes Device table (non-variable font) / VariationIndex table (variable font) for horizontal placement */
+    HZ_VALUE_FORMAT_X_PLACEMENT_DEVICE = 0x0010,
+
+    /* Includes Device table (non-variable font) / VariationIndex table (variable font) for vertical placement */
+    HZ_VALUE_FORMAT_Y_PLACEMENT_DEVICE = 0x0020,
+
+    /* Includes Device table (non-variable font) / VariationIndex table (variable font) for horizontal advance */
+    HZ_VALUE_FORMAT_X_ADVANCE_DEVICE = 0x0040,
+
+    /* Includes Device table (non-variable font) / VariationIndex table (variable font) for vertical advance */
+    HZ_VALUE_FORMAT_Y_ADVANCE_DEVICE = 0x0080
+} hz_value_format_flag_t;
+
+typedef struct hz_single_subst_t hz_single_subst_t;
+typedef struct hz_multiple_subst_t hz_multiple_subst_t;
+typedef struct hz_ligature_subst_t hz_ligature_subst_t;
+typedef struct hz_context_t hz_context_t;
+typedef struct hz_reverse_chain_subst_t hz_reverse_chain_subst_t;
+typedef struct hz_single_pos_t hz_single_pos_t;
+typedef struct hz_pair_pos_t hz_pair_pos_t;
+typedef struct hz_cursive_pos_t hz_cursive_pos_t;
+typedef struct hz_mark_attach_pos_t hz_mark_attach_pos_t;
+typedef struct hz_kern_table_t hz_kern_table_t;
+
+/*  Struct: hz_lookup_subtable_t
+ *      Lookup subtable, with its compiled form for the types that have one.
+ *
+ *  Fields:
+ *      data - Raw subtable, extension subtables already resolved.
+ *      format - Subtable format.
+ *      compiled - Compiled subtable, NULL for types applied from the raw data.
+ * */
+typedef struct hz_lookup_subtable_t {
+    const hz_byte_t *data;
+    uint16_t format;
+    union {
+        hz_single_subst_t *single_subst;
+        hz_multiple_subst_t *multiple_subst; /* also AlternateSubst */
+        hz_ligature_subst_t *ligature_subst;
+        hz_context_t *context;
+        hz_reverse_chain_subst_t *reverse_chain_subst;
+        hz_single_pos_t *single_pos;
+        hz_pair_pos_t *pair_pos;
+        hz_cursive_pos_t *cursive_pos;
+        hz_mark_attach_pos_t *mark_attach_pos; /* MarkBase, MarkLig and MarkMark */
+    } compiled;
+} hz_lookup_subtable_t;
+
+/*  Struct: hz_lookup_table_t
+ *      Lookup compiled from a GSUB or GPOS LookupList.
+ *
+ *  Fields:
+ *      lookup_type - Lookup type, extension lookups are replaced by their real type.
+ *      lookup_flags - Lookup flags.
+ *      subtable_count - Number of subtables.
+ *      subtables - Array of subtables.
+ *      mark_filtering_set - Index of the mark glyph set, if UseMarkFilteringSet is set.
+ *      filter - Glyphs skipped by the lookup, see <hz_glyph_filter_t>.
+ * */
 typedef struct hz_lookup_table_t {
     uint16_t lookup_type;
     uint16_t lookup_flags;
     uint16_t subtable_count;
-    hz_offset32_t *subtable_offsets;
+    hz_lookup_subtable_t *subtables;
     uint16_t mark_filtering_set;
+    hz_glyph_filter_t filter;
 } hz_lookup_table_t;
 
+/*  Struct: hz_ot_layout_t
+ *      Layout tables of a face, compiled once when the face is loaded and
+ *      read-only afterwards.
+ *
+ *  Fields:
+ *      gsub_lookup_count - Number of GSUB lookups.
+ *      gsub_lookups - GSUB lookups, indexed like the GSUB LookupList.
+ *      gpos_lookup_count - Number of GPOS lookups.
+ *      gpos_lookups - GPOS lookups, indexed like the GPOS LookupList.
+ *      gpos_has_kerning - Whether GPOS has a 'kern' feature with lookups.
+ *      kern_table - Compiled legacy 'kern' table, NULL if the face has none.
+ *      glyph_count - Number of glyphs of the face.
+ *      mark_attach_classes - GDEF mark attachment class of every glyph, NULL if GDEF has none.
+ *      mark_attach_class_count - Number of mark attachment classes, class zero included.
+ *      mark_attach_class_glyphs - Bitset of the glyphs of every mark attachment class.
+ *      mark_glyph_set_count - Number of GDEF mark glyph sets.
+ *      mark_glyph_sets - Bitset of the glyphs of every mark glyph set.
+ *      bitset_words - Number of 64-bit words of a glyph bitset.
+ *      lig_caret_coverage - Ligature glyphs of the GDEF LigCaretList, NULL if GDEF has none.
+ *      lig_glyph_count - Number of ligatures the LigCaretList has carets for.
+ *      lig_caret_starts - Index of the first caret of every covered ligature, one more
+ *      entry than the coverage ends the last ligature's carets.
+ *      lig_carets - Caret coordinates of the ligatures in font units, increasing in
+ *      every ligature.
+ * */
+struct hz_ot_layout_t {
+    uint16_t gsub_lookup_count;
+    hz_lookup_table_t *gsub_lookups;
+    uint16_t gpos_lookup_count;
+    hz_lookup_table_t *gpos_lookups;
+    hz_bool_t gpos_has_kerning;
+    hz_kern_table_t *kern_table;
+    uint32_t glyph_count;
+    uint8_t *mark_attach_classes;
+    uint16_t mark_attach_class_count;
+    uint64_t *mark_attach_class_glyphs;
+    uint16_t mark_glyph_set_count;
+    uint64_t *mark_glyph_sets;
+    size_t bitset_words;
+    struct hz_coverage_t *lig_caret_coverage;
+    uint16_t lig_glyph_count;
+    uint32_t *lig_caret_starts;
+    int16_t *lig_carets;
+};
+
 typedef struct hz_coverage_format1_t {
     hz_uint16 coverageFormat; /* Format identifier — format = 1 */
     hz_uint16 glyphCount; /* Number of glyphs in the glyph array */
@@ -949,6 +1700,61 @@ typedef struct hz_coverage_format2_t {
     hz_range_rec_t *rangeRecords; /* Array of glyph ranges — ordered by startGlyphID. */
 } hz_coverage_format2_t;
 
+/*  Struct: hz_coverage_t
+ *      Coverage table compiled for lookups. Format 1 keeps the sorted glyph array,
+ *      format 2 keeps the sorted ranges with the coverage index of their first glyph.
+ *      Dense coverages also get a bitmap with a rank per 64-bit word, so a query is
+ *      a bit test and a popcount.
+ *
+ *  Fields:
+ *      format - Coverage format, 1 or 2.
+ *      count - Number of glyphs (format 1) or ranges (format 2).
+ *      glyphs - Sorted glyph ids (format 1).
+ *      ranges - Sorted range records (format 2).
+ *      first - First glyph id of the bitmap.
+ *      span - Number of glyph ids the bitmap spans, zero if there is no bitmap.
+ *      bitmap - One bit per glyph id starting at first.
+ *      ranks - Coverage index of the first set bit of every bitmap word.
+ * */
+typedef struct hz_coverage_t {
+    uint16_t format;
+    uint16_t count;
+    hz_index_t *glyphs;
+    hz_range_rec_t *ranges;
+    hz_index_t first;
+    uint32_t span;
+    uint64_t *bitmap;
+    uint16_t *ranks;
+} hz_coverage_t;
+
+/*  Function: hz_coverage_create
+ *      Compiles a Coverage table.
+ *
+ *  Parameters:
+ *      data - Pointer to the start of the Coverage table.
+ *
+ *  Returns:
+ *      The compiled coverage, or NULL if the format is unknown.
+ * */
+hz_coverage_t *
+hz_coverage_create(const uint8_t *data);
+
+void
+hz_coverage_destroy(hz_coverage_t *coverage);
+
+/*  Function: hz_coverage_search
+ *      Looks up the coverage index of a glyph, without allocating.
+ *
+ *  Parameters:
+ *      coverage - The compiled coverage.
+ *      id - Glyph id.
+ *
+ *  Returns:
+ *      The coverage index, or -1 if the glyph is not covered.
+ * */
+int32_t
+hz_coverage_search(const hz_coverage_t *coverage, hz_index_t id);
+
 
 struct hz_class_def_format1_t {
     hz_uint16 format; /* Format identifier — format = 1 */
@@ -969,6 +1775,53 @@ struct hz_class_def_format2_t {
     struct hz_class_range_rec_t *rangeRecords;
 };
 
+/*  Struct: hz_class_def_t
+ *      ClassDef table compiled for lookups. Glyphs within the span of the table get
+ *      a dense array of classes, sparse format 2 tables keep their sorted ranges.
+ *
+ *  Fields:
+ *      first - First glyph id of the dense array.
+ *      count - Number of glyph ids in the dense array, zero if there is none.
+ *      classes - Class of every glyph id starting at first.
+ *      range_count - Number of ranges, used when there is no dense array.
+ *      ranges - Sorted class ranges.
+ * */
+typedef struct hz_class_def_t {
+    hz_index_t first;
+    uint32_t count;
+    uint16_t *classes;
+    uint16_t range_count;
+    struct hz_class_range_rec_t *ranges;
+} hz_class_def_t;
+
+/*  Function: hz_class_def_create
+ *      Compiles a ClassDef table.
+ *
+ *  Parameters:
+ *      data - Pointer to the start of the ClassDef table.
+ *
+ *  Returns:
+ *      The compiled class definition, or NULL if the format is unknown.
+ * */
+hz_class_def_t *
+hz_class_def_create(const uint8_t *data);
+
+void
+hz_class_def_destroy(hz_class_def_t *class_def);
+
+/*  Function: hz_class_def_get
+ *      Looks up the class of a glyph, glyphs not assigned to a class are in class 0.
+ *
+ *  Parameters:
+ *      class_def - The compiled class definition.
+ *      id - Glyph id.
+ *
+ *  Returns:
+ *      The glyph's class.
+ * */
+uint16_t
+hz_class_def_get(const hz_class_def_t *class_def, hz_index_t id);
+
 typedef enum hz_delta_format_t {
     /* Signed 2-bit value, 8 values per uint16 */
     HZ_DELTA_FORMAT_LOCAL_2_BIT = 0x0001,
@@ -1163,18 +2016,42 @@ hz_ot_layout_gather_glyphs(hz_face_t *face,
                            const hz_array_t *wanted_features,
                            hz_set_t *glyphs);
 
+/*  Function: hz_ot_layout_apply_gsub_features
+ *      Applies the GSUB lookups of the wanted features to a sequence.
+ *
+ *  Parameters:
+ *      face - The face.
+ *      script - Script tag.
+ *      language - Language tag.
+ *      wanted_features - Features applied.
+ *      active_glyphs - Bitset of the glyphs the lookups can be applied at, see
+ *      <hz_ot_layout_gather_active_glyphs>, runs of other glyphs are skipped.
+ *      NULL to try every glyph.
+ *      sect - The sequence.
+ *
+ *  Returns:
+ *      HZ_FALSE if the face has no layout or no language system for the script, HZ_TRUE otherwise.
+ * */
 hz_bool_t
 hz_ot_layout_apply_gsub_features(hz_face_t *face,
                                  hz_tag_t script,
                                  hz_tag_t language,
                                  const hz_array_t *wanted_features,
+                                 const uint64_t *active_glyphs,
                                  hz_sequence_t *sect);
 
+/*  Function: hz_ot_layout_apply_gpos_features
+ *      Like <hz_ot_layout_apply_gsub_features>, for the GPOS lookups. When only
+ *      the advances are wanted the mark attachment lookups are skipped, they
+ *      only move marks by their offsets.
+ * */
 hz_bool_t
 hz_ot_layout_apply_gpos_features(hz_face_t *face,
                                  hz_tag_t script,
                                  hz_tag_t language,
                                  const hz_array_t *wanted_features,
+                                 const uint64_t *active_glyphs,
+                                 hz_bool_t advances_only,
                                  hz_sequence_t *sect);
 
 void
@@ -1191,17 +2068,116 @@ hz_ot_layout_lookup_would_substitute(hz_face_t *face,
                                      hz_bool_t zero_context);
 
 
+/*  Function: hz_ot_layout_create
+ *      Compiles the GSUB and GPOS lookups of a face.
+ *
+ *  Parameters:
+ *      face - The face, with its OpenType tables set.
+ *
+ *  Returns:
+ *      The compiled layout.
+ * */
+hz_ot_layout_t *
+hz_ot_layout_create(hz_face_t *face);
+
+void
+hz_ot_layout_destroy(hz_ot_layout_t *layout);
+
 void
 hz_ot_layout_apply_gsub_lookup(hz_face_t *face,
-                               hz_stream_t *table,
+                               const hz_lookup_table_t *lookup,
                                hz_feature_t feature,
+                               const uint64_t *active_glyphs,
                                hz_sequence_t *sect);
 void
 hz_ot_layout_apply_gpos_lookup(hz_face_t *face,
-                               hz_stream_t *table,
+                               const hz_lookup_table_t *lookup,
                                hz_feature_t feature,
+                               const uint64_t *active_glyphs,
                                hz_sequence_t *sect);
 
+/*  Function: hz_ot_layout_apply_kern_table
+ *      Kerns a sequence with the legacy 'kern' table, unless GPOS kerns the face.
+ *
+ *  Parameters:
+ *      face - The face.
+ *      sect - The sequence, with its advances set.
+ *
+ *  Returns:
+ *      HZ_TRUE if the 'kern' table was applied, HZ_FALSE otherwise.
+ * */
+hz_bool_t
+hz_ot_layout_apply_kern_table(hz_face_t *face, hz_sequence_t *sect);
+
+/*  Function: hz_ot_layout_get_ligature_carets
+ *      Gets the carets GDEF places between the components of a ligature glyph.
+ *
+ *  Parameters:
+ *      layout - The layout of the face.
+ *      id - The ligature glyph.
+ *      carets - Set to the caret coordinates from the glyph's origin, in font units
+ *      and increasing.
+ *
+ *  Returns:
+ *      The number of carets, zero if GDEF has none for the glyph.
+ * */
+uint16_t
+hz_ot_layout_get_ligature_carets(const hz_ot_layout_t *layout, hz_index_t id, const int16_t **carets);
+
+/*  Function: hz_ot_layout_gather_simple_glyphs
+ *      Finds the glyphs of a set that the wanted features leave alone but for
+ *      kerning, and the kerning of every pair of them. A text made of simple
+ *      glyphs is shaped by looking their advances up and kerning the pairs.
+ *
+ *  Parameters:
+ *      face - The face.
+ *      script - Script tag.
+ *      language - Language tag.
+ *      wanted_features - Features applied.
+ *      kern_table - Whether the legacy 'kern' table is applied too.
+ *      glyphs - The glyphs, with their ids and glyph classes set.
+ *      glyph_count - Number of glyphs, n.
+ *      simple - Bitset of n bits, set for the glyphs no lookup substitutes and
+ *      only pair adjustments of their advance position.
+ *      kerning - n * n adjustments of the advance of the first glyph of a pair,
+ *      indexed by first * n + second.
+ *      kerned - Bitset of n * n bits, set for the pairs some kerning matched,
+ *      even when it adjusts them by zero.
+ * */
+void
+hz_ot_layout_gather_simple_glyphs(hz_face_t *face,
+                                  hz_tag_t script,
+                                  hz_tag_t language,
+                                  const hz_array_t *wanted_features,
+                                  hz_bool_t kern_table,
+                                  const hz_sequence_node_t *glyphs,
+                                  size_t glyph_count,
+                                  uint64_t *simple,
+                                  int16_t *kerning,
+                                  uint64_t *kerned);
+
+/*  Function: hz_ot_layout_gather_active_glyphs
+ *      Finds the glyphs the lookups of the wanted features can be applied at,
+ *      the glyphs that start a match of one of their subtables. Lookups never
+ *      change the other glyphs, the ones a plan leaves inert.
+ *
+ *  Parameters:
+ *      face - The face, with its layout compiled.
+ *      script - Script tag.
+ *      language - Language tag.
+ *      wanted_features - Features applied.
+ *      gsub_glyphs - Glyph bitset of bitset_words words, see <hz_ot_layout_t>,
+ *      set for the glyphs of the GSUB lookups.
+ *      gpos_glyphs - Same for the GPOS lookups.
+ * */
+void
+hz_ot_layout_gather_active_glyphs(hz_face_t *face,
+                                  hz_tag_t script,
+                                  hz_tag_t language,
+                                  const hz_array_t *wanted_features,
+                                  uint64_t *gsub_glyphs,
+                                  uint64_t *gpos_glyphs);
+
 hz_tag_t
 hz_ot_script_to_tag(hz_script_t script);
 
@@ -0,0 +1,666 @@
+#include "hz-shape-cache.h"
+
+typedef struct hz_shape_cache_entry_t hz_shape_cache_entry_t;
+
+/* an entry and its glyphs and text are one allocation, the glyphs follow the
+ * entry and the text follows the glyphs */
+struct hz_shape_cache_entry_t {
+    hz_shape_cache_entry_t *bucket_next;
+    hz_shape_cache_entry_t *clock_prev, *clock_next;
+    uint64_t hash;
+    const hz_face_t *face;
+    uint64_t plan_id;
+    hz_direction_t dir;
+    size_t text_length;
+    size_t length;
+    int64_t width;
+    size_t size;
+    hz_bool_t referenced;
+};
+
+struct hz_shape_cache_t {
+    hz_shape_cache_entry_t **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    hz_shape_cache_entry_t *clock_hand;
+    size_t size;
+    size_t byte_budget;
+};
+
+#define HZ_SHAPE_CACHE_MIN_BUCKETS 64
+
+static hz_sequence_node_t *
+hz_shape_cache_entry_nodes(hz_shape_cache_entry_t *entry)
+{
+    return (hz_sequence_node_t *) (entry + 1);
+}
+
+static hz_unicode_t *
+hz_shape_cache_entry_text(hz_shape_cache_entry_t *entry)
+{
+    return (hz_unicode_t *) (hz_shape_cache_entry_nodes(entry) + entry->length);
+}
+
+/* 64-bit FNV-1a over the text, mixed with the rest of the key */
+static uint64_t
+hz_shape_cache_hash(const hz_shape_cache_key_t *key)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t i;
+
+    for (i = 0; i < key->text_length; ++i)
+        hash = (hash ^ key->text[i]) * 0x100000001B3ULL;
+
+    hash = (hash ^ (uint64_t) (size_t) key->face) * 0x100000001B3ULL;
+    hash = (hash ^ key->plan_id) * 0x100000001B3ULL;
+    hash = (hash ^ (uint64_t) key->dir) * 0x100000001B3ULL;
+
+    /* the low bits of a product only depend on the low bits of its factors,
+     * fold the high bits in before they pick a bucket */
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static hz_bool_t
+hz_shape_cache_entry_matches(hz_shape_cache_entry_t *entry,
+                             const hz_shape_cache_key_t *key,
+                             uint64_t hash)
+{
+    return entry->hash == hash
+        && entry->face == key->face
+        && entry->plan_id == key->plan_id
+        && entry->dir == key->dir
+        && entry->text_length == key->text_length
+        && !memcmp(hz_shape_cache_entry_text(entry), key->text, key->text_length * sizeof(hz_unicode_t));
+}
+
+hz_shape_cache_t *
+hz_shape_cache_create(size_t byte_budget)
+{
+    hz_shape_cache_t *cache = HZ_ALLOC(hz_shape_cache_t);
+    cache->bucket_count = HZ_SHAPE_CACHE_MIN_BUCKETS;
+    cache->buckets = calloc(cache->bucket_count, sizeof(hz_shape_cache_entry_t *));
+    cache->entry_count = 0;
+    cache->clock_hand = NULL;
+    cache->size = 0;
+    cache->byte_budget = byte_budget;
+    return cache;
+}
+
+void
+hz_shape_cache_clear(hz_shape_cache_t *cache)
+{
+    size_t i;
+
+    for (i = 0; i < cache->bucket_count; ++i) {
+        hz_shape_cache_entry_t *entry = cache->buckets[i];
+
+        while (entry != NULL) {
+            hz_shape_cache_entry_t *next = entry->bucket_next;
+            HZ_FREE(entry);
+            entry = next;
+        }
+
+        cache->buckets[i] = NULL;
+    }
+
+    cache->entry_count = 0;
+    cache->clock_hand = NULL;
+    cache->size = 0;
+}
+
+void
+hz_shape_cache_destroy(hz_shape_cache_t *cache)
+{
+    hz_shape_cache_clear(cache);
+    HZ_FREE(cache->buckets);
+    HZ_FREE(cache);
+}
+
+size_t
+hz_shape_cache_get_size(const hz_shape_cache_t *cache)
+{
+    return cache->size;
+}
+
+hz_bool_t
+hz_shape_cache_lookup(hz_shape_cache_t *cache,
+                      const hz_shape_cache_key_t *key,
+                      hz_sequence_t *sequence)
+{
+    uint64_t hash = hz_shape_cache_hash(key);
+    hz_shape_cache_entry_t *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+
+    for (; entry != NULL; entry = entry->bucket_next) {
+        if (hz_shape_cache_entry_matches(entry, key, hash)) {
+            entry->referenced = HZ_TRUE;
+            hz_sequence_reserve(sequence, entry->length);
+            memcpy(sequence->nodes, hz_shape_cache_entry_nodes(entry),
+                   entry->length * sizeof(hz_sequence_node_t));
+            sequence->length = entry->length;
+            sequence->width = entry->width;
+            hz_sequence_reset_skip_indices(sequence);
+            return HZ_TRUE;
+        }
+    }
+
+    return HZ_FALSE;
+}
+
+static void
+hz_shape_cache_unlink(hz_shape_cache_t *cache, hz_shape_cache_entry_t *entry)
+{
+    hz_shape_cache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+
+    while (*link != entry)
+        link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+
+    if (entry->clock_next == entry) {
+        cache->clock_hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (cache->clock_hand == entry)
+            cache->clock_hand = entry->clock_next;
+    }
+
+    cache->size -= entry->size;
+    --cache->entry_count;
+}
+
+/* sweeps the clock hand, evicting the first entry not hit since the last sweep
+ * passed it, until size more bytes fit in the budget */
+static void
+hz_shape_cache_make_room(hz_shape_cache_t *cache, size_t size)
+{
+    while (cache->clock_hand != NULL && cache->size + size > cache->byte_budget) {
+        hz_shape_cache_entry_t *entry = cache->clock_hand;
+
+        if (entry->referenced) {
+            entry->referenced = HZ_FALSE;
+            cache->clock_hand = entry->clock_next;
+        } else {
+            hz_shape_cache_unlink(cache, entry);
+            HZ_FREE(entry);
+        }
+    }
+}
+
+static void
+hz_shape_cache_grow_buckets(hz_shape_cache_t *cache)
+{
+    size_t bucket_count = cache->bucket_count * 2;
+    hz_shape_cache_entry_t **buckets = calloc(bucket_count, sizeof(hz_shape_cache_entry_t *));
+    size_t i;
+
+    for (i = 0; i < cache->bucket_count; ++i) {
+        hz_shape_cache_entry_t *entry = cache->buckets[i];
+
+        while (entry != NULL) {
+            hz_shape_cache_entry_t *next = entry->bucket_next;
+            hz_shape_cache_entry_t **bucket = &buckets[entry->hash & (bucket_count - 1)];
+            entry->bucket_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    HZ_FREE(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+}
+
+void
+hz_shape_cache_insert(hz_shape_cache_t *cache,
+                      const hz_shape_cache_key_t *key,
+                      const hz_sequence_t *sequence)
+{
+    uint64_t hash = hz_shape_cache_hash(key);
+    size_t size = sizeof(hz_shape_cache_entry_t)
+        + sequence->length * sizeof(hz_sequence_node_t)
+        + key->text_length * sizeof(hz_unicode_t);
+    hz_shape_cache_entry_t *entry, **bucket;
+
+    if (size > cache->byte_budget)
+        return;
+
+    for (entry = cache->buckets[hash & (cache->bucket_count - 1)]; entry != NULL; entry = entry->bucket_next)
+        if (hz_shape_cache_entry_matches(entry, key, hash))
+            return;
+
+    hz_shape_cache_make_room(cache, size);
+
+    entry = (hz_shape_cache_entry_t *) HZ_MALLOC(size);
+    entry->hash = hash;
+    entry->face = key->face;
+    entry->plan_id = key->plan_id;
+    entry->dir = key->dir;
+    entry->text_length = key->text_length;
+    entry->length = sequence->length;
+    entry->width = sequence->width;
+    entry->size = size;
+    entry->referenced = HZ_FALSE;
+    memcpy(hz_shape_cache_entry_nodes(entry), sequence->nodes, sequence->length * sizeof(hz_sequence_node_t));
+    memcpy(hz_shape_cache_entry_text(entry), key->text, key->text_length * sizeof(hz_unicode_t));
+
+    if (cache->entry_count >= cache->bucket_count)
+        hz_shape_cache_grow_buckets(cache);
+
+    bucket = &cache->buckets[hash & (cache->bucket_count - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+
+    /* new entries go right behind the hand, the last the sweep reaches */
+    if (cache->clock_hand == NULL) {
+        entry->clock_prev = entry->clock_next = entry;
+        cache->clock_hand = entry;
+    } else {
+        entry->clock_next = cache->clock_hand;
+        entry->clock_prev = cache->clock_hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        cache->clock_hand->clock_prev = entry;
+    }
+
+    cache->size += size;
+    ++cache->entry_count;
+}
+
+/* ways of a bucket of the shared cache, a key can only live in its bucket */
+#define HZ_SHARED_SHAPE_CACHE_WAYS 4
+#define HZ_SHARED_SHAPE_CACHE_NONE ((uint32_t) -1)
+/* bytes of the arena per bucket, the average size of a run it expects */
+#define HZ_SHARED_SHAPE_CACHE_BUCKET_BYTES 1024
+#define HZ_CACHE_LINE 64
+#define HZ_CACHE_LINE_ROUND(size) (((size) + HZ_CACHE_LINE - 1) / HZ_CACHE_LINE * HZ_CACHE_LINE)
+
+/* slots are read by any thread while the shard's writer updates them, the
+ * version is odd while the slot changes and bumped once it is done */
+typedef struct hz_shared_shape_cache_slot_t {
+    uint32_t version;
+    uint32_t size; /* zero if the slot is empty */
+    uint32_t offset;
+    uint64_t hash;
+} hz_shared_shape_cache_slot_t;
+
+/* a run in the arena of a shard, its glyphs and text follow it */
+typedef struct hz_shared_shape_cache_entry_t {
+    const hz_face_t *face;
+    uint64_t plan_id;
+    int64_t width;
+    uint32_t dir;
+    uint32_t text_length;
+    uint32_t length;
+    uint32_t size;
+} hz_shared_shape_cache_entry_t;
+
+/* the runs of a shard in the order they were written to the arena, only used
+ * by the writer */
+typedef struct hz_shared_shape_cache_record_t {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t slot; /* slot of the run, none once the slot was given to another run */
+} hz_shared_shape_cache_record_t;
+
+/* the arena is written as a ring, the oldest runs are evicted as the head
+ * wraps over them. Lookups only read the fields before the padding, the
+ * writer's fields after it are on other cache lines. */
+typedef struct hz_shared_shape_cache_shard_t {
+    hz_byte_t *arena;
+    size_t arena_size;
+    hz_shared_shape_cache_slot_t *slots;
+    char padding[HZ_CACHE_LINE];
+    hz_bool_t lock;
+    size_t head;
+    uint32_t *slot_records;
+    hz_shared_shape_cache_record_t *records;
+    uint32_t record_capacity;
+    uint32_t record_first;
+    uint32_t record_count;
+    uint64_t insertions;
+    uint64_t evictions;
+} hz_shared_shape_cache_shard_t;
+
+/* shards take whole cache lines, the array of them starts on one */
+typedef union hz_shared_shape_cache_line_shard_t {
+    hz_shared_shape_cache_shard_t shard;
+    char lines[HZ_CACHE_LINE_ROUND(sizeof(hz_shared_shape_cache_shard_t))];
+} hz_shared_shape_cache_line_shard_t;
+
+struct hz_shared_shape_cache_t {
+    hz_shared_shape_cache_line_shard_t *shards;
+    void *shard_memory;
+    unsigned int shard_bits;
+    uint32_t bucket_count;
+    /* lookups are tallied by the contexts and added here in batches */
+    char padding[HZ_CACHE_LINE];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+hz_shared_shape_cache_t *
+hz_shared_shape_cache_create(size_t byte_budget, unsigned int shard_count)
+{
+    hz_shared_shape_cache_t *cache = HZ_ALLOC(hz_shared_shape_cache_t);
+    size_t arena_size;
+    unsigned int i;
+
+    cache->shard_bits = 0;
+    while ((1U << cache->shard_bits) < shard_count)
+        ++cache->shard_bits;
+    shard_count = 1U << cache->shard_bits;
+
+    /* offsets into an arena are 32-bit */
+    arena_size = (byte_budget / shard_count) & ~(size_t) 7;
+    if (arena_size > 0x7FFFFFF8)
+        arena_size = 0x7FFFFFF8;
+
+    cache->bucket_count = 16;
+    while (cache->bucket_count * HZ_SHARED_SHAPE_CACHE_WAYS * HZ_SHARED_SHAPE_CACHE_BUCKET_BYTES < arena_size)
+        cache->bucket_count *= 2;
+
+    cache->shard_memory = calloc(1, shard_count * sizeof(hz_shared_shape_cache_line_shard_t)
+                                 + HZ_CACHE_LINE - 1);
+    cache->shards = (hz_shared_shape_cache_line_shard_t *)
+        HZ_CACHE_LINE_ROUND((uintptr_t) cache->shard_memory);
+    cache->hits = 0;
+    cache->misses = 0;
+    for (i = 0; i < shard_count; ++i) {
+        hz_shared_shape_cache_shard_t *shard = &cache->shards[i].shard;
+        uint32_t slot_count = cache->bucket_count * HZ_SHARED_SHAPE_CACHE_WAYS;
+
+        shard->arena = HZ_MALLOC(arena_size ? arena_size : 1);
+        shard->arena_size = arena_size;
+        shard->slots = calloc(slot_count, sizeof(hz_shared_shape_cache_slot_t));
+        shard->slot_records = HZ_MALLOC(slot_count * sizeof(uint32_t));
+        memset(shard->slot_records, 0xFF, slot_count * sizeof(uint32_t));
+        shard->record_capacity = slot_count * 2;
+        shard->records = HZ_MALLOC(shard->record_capacity * sizeof(hz_shared_shape_cache_record_t));
+    }
+
+    return cache;
+}
+
+void
+hz_shared_shape_cache_destroy(hz_shared_shape_cache_t *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < (1U << cache->shard_bits); ++i) {
+        HZ_FREE(cache->shards[i].shard.arena);
+        HZ_FREE(cache->shards[i].shard.slots);
+        HZ_FREE(cache->shards[i].shard.slot_records);
+        HZ_FREE(cache->shards[i].shard.records);
+    }
+
+    HZ_FREE(cache->shard_memory);
+    HZ_FREE(cache);
+}
+
+static hz_shared_shape_cache_shard_t *
+hz_shared_shape_cache_get_shard(const hz_shared_shape_cache_t *cache, uint64_t hash)
+{
+    /* the low bits pick the bucket, the high ones the shard */
+    return &cache->shards[cache->shard_bits ? hash >> (64 - cache->shard_bits) : 0].shard;
+}
+
+static hz_shared_shape_cache_slot_t *
+hz_shared_shape_cache_get_bucket(const hz_shared_shape_cache_t *cache,
+                                 hz_shared_shape_cache_shard_t *shard,
+                                 uint64_t hash)
+{
+    return &shard->slots[(hash & (cache->bucket_count - 1)) * HZ_SHARED_SHAPE_CACHE_WAYS];
+}
+
+hz_bool_t
+hz_shared_shape_cache_lookup(hz_shared_shape_cache_t *cache,
+                             const hz_shape_cache_key_t *key,
+                             hz_sequence_t *sequence)
+{
+    uint64_t hash = hz_shape_cache_hash(key);
+    hz_shared_shape_cache_shard_t *shard = hz_shared_shape_cache_get_shard(cache, hash);
+    hz_shared_shape_cache_slot_t *bucket = hz_shared_shape_cache_get_bucket(cache, shard, hash);
+    unsigned int way;
+
+    for (way = 0; way < HZ_SHARED_SHAPE_CACHE_WAYS; ++way) {
+        hz_shared_shape_cache_slot_t *slot = &bucket[way];
+        hz_shared_shape_cache_entry_t entry;
+        const hz_byte_t *data;
+        uint32_t version, size, offset;
+        hz_bool_t matches;
+
+        version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+        if (version & 1)
+            continue;
+
+        size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+        offset = __atomic_load_n(&slot->offset, __ATOMIC_RELAXED);
+        if (!size || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+            continue;
+
+        /* the slot may be torn by a concurrent write, bound everything read
+         * through it by the arena before the version tells */
+        if (offset > shard->arena_size || size > shard->arena_size - offset
+            || size < sizeof(hz_shared_shape_cache_entry_t))
+            continue;
+
+        data = shard->arena + offset;
+        memcpy(&entry, data, sizeof(entry));
+        data += sizeof(entry);
+
+        matches = entry.size == size
+            && sizeof(entry) + (uint64_t) entry.length * sizeof(hz_sequence_node_t)
+               + (uint64_t) entry.text_length * sizeof(hz_unicode_t) <= size
+            && entry.face == key->face
+            && entry.plan_id == key->plan_id
+            && entry.dir == (uint32_t) key->dir
+            && entry.text_length == key->text_length
+            && !memcmp(data + entry.length * sizeof(hz_sequence_node_t), key->text,
+                       key->text_length * sizeof(hz_unicode_t));
+
+        /* copied aside, the sequence keeps its text until the copy is known good */
+        if (matches) {
+            hz_sequence_reserve(sequence, entry.length);
+            memcpy(sequence->spare_nodes, data, entry.length * sizeof(hz_sequence_node_t));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->version, __ATOMIC_RELAXED) != version || !matches)
+            continue;
+
+        {
+            hz_sequence_node_t *nodes = sequence->nodes;
+            sequence->nodes = sequence->spare_nodes;
+            sequence->spare_nodes = nodes;
+            sequence->out_nodes = sequence->nodes;
+        }
+
+        sequence->length = entry.length;
+        sequence->width = entry.width;
+        hz_sequence_reset_skip_indices(sequence);
+        return HZ_TRUE;
+    }
+
+    return HZ_FALSE;
+}
+
+static void
+hz_shared_shape_cache_lock(hz_shared_shape_cache_shard_t *shard)
+{
+    while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&shard->lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static void
+hz_shared_shape_cache_unlock(hz_shared_shape_cache_shard_t *shard)
+{
+    __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+}
+
+/* empties a slot, readers that already read it see the version change */
+static void
+hz_shared_shape_cache_clear_slot(hz_shared_shape_cache_slot_t *slot)
+{
+    uint32_t version = slot->version;
+
+    __atomic_store_n(&slot->version, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->size, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->version, version + 2, __ATOMIC_RELEASE);
+}
+
+static void
+hz_shared_shape_cache_evict_oldest(hz_shared_shape_cache_shard_t *shard)
+{
+    hz_shared_shape_cache_record_t *record = &shard->records[shard->record_first];
+
+    if (record->slot != HZ_SHARED_SHAPE_CACHE_NONE) {
+        hz_shared_shape_cache_clear_slot(&shard->slots[record->slot]);
+        shard->slot_records[record->slot] = HZ_SHARED_SHAPE_CACHE_NONE;
+        __atomic_fetch_add(&shard->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+    shard->record_first = (shard->record_first + 1) % shard->record_capacity;
+    --shard->record_count;
+}
+
+void
+hz_shared_shape_cache_insert(hz_shared_shape_cache_t *cache,
+                             const hz_shape_cache_key_t *key,
+                             const hz_sequence_t *sequence)
+{
+    uint64_t hash = hz_shape_cache_hash(key);
+    hz_shared_shape_cache_shard_t *shard = hz_shared_shape_cache_get_shard(cache, hash);
+    hz_shared_shape_cache_slot_t *bucket = hz_shared_shape_cache_get_bucket(cache, shard, hash);
+    size_t size = (sizeof(hz_shared_shape_cache_entry_t)
+                   + sequence->length * sizeof(hz_sequence_node_t)
+                   + key->text_length * sizeof(hz_unicode_t) + 7) & ~(size_t) 7;
+    hz_shared_shape_cache_entry_t *entry;
+    hz_shared_shape_cache_slot_t *slot = NULL;
+    uint32_t record_index, slot_index, oldest_position = 0;
+    unsigned int way;
+
+    if (size > shard->arena_size)
+        return;
+
+    hz_shared_shape_cache_lock(shard);
+
+    /* another thread may have shaped the same text meanwhile */
+    for (way = 0; way < HZ_SHARED_SHAPE_CACHE_WAYS; ++way) {
+        entry = (hz_shared_shape_cache_entry_t *) (shard->arena + bucket[way].offset);
+
+        if (bucket[way].size && bucket[way].hash == hash
+            && entry->face == key->face && entry->plan_id == key->plan_id
+            && entry->dir == (uint32_t) key->dir && entry->text_length == key->text_length
+            && !memcmp((const hz_byte_t *) (entry + 1) + entry->length * sizeof(hz_sequence_node_t),
+                       key->text, key->text_length * sizeof(hz_unicode_t))) {
+            hz_shared_shape_cache_unlock(shard);
+            return;
+        }
+    }
+
+    if (shard->record_count == shard->record_capacity)
+        hz_shared_shape_cache_evict_oldest(shard);
+
+    /* the oldest runs follow the head, wrapping evicts the runs up to the end */
+    if (shard->head + size > shard->arena_size) {
+        while (shard->record_count && shard->records[shard->record_first].offset >= shard->head)
+            hz_shared_shape_cache_evict_oldest(shard);
+        shard->head = 0;
+    }
+
+    while (shard->record_count
+           && shard->records[shard->record_first].offset >= shard->head
+           && shard->records[shard->record_first].offset < shard->head + size)
+        hz_shared_shape_cache_evict_oldest(shard);
+
+    /* an empty way, or else the way holding the oldest run */
+    for (way = 0; way < HZ_SHARED_SHAPE_CACHE_WAYS; ++way) {
+        uint32_t position;
+
+        if (!bucket[way].size) {
+            slot = &bucket[way];
+            break;
+        }
+
+        /* position of the way's run from the oldest record */
+        position = (shard->slot_records[&bucket[way] - shard->slots]
+                    + shard->record_capacity - shard->record_first) % shard->record_capacity;
+        if (slot == NULL || position < oldest_position) {
+            slot = &bucket[way];
+            oldest_position = position;
+        }
+    }
+
+    slot_index = (uint32_t) (slot - shard->slots);
+    if (slot->size) {
+        shard->records[shard->slot_records[slot_index]].slot = HZ_SHARED_SHAPE_CACHE_NONE;
+        hz_shared_shape_cache_clear_slot(slot);
+        __atomic_fetch_add(&shard->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+    /* the slots over the arena range were cleared before it is overwritten */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    entry = (hz_shared_shape_cache_entry_t *) (shard->arena + shard->head);
+    entry->face = key->face;
+    entry->plan_id = key->plan_id;
+    entry->width = sequence->width;
+    entry->dir = (uint32_t) key->dir;
+    entry->text_length = (uint32_t) key->text_length;
+    entry->length = (uint32_t) sequence->length;
+    entry->size = (uint32_t) size;
+    memcpy(entry + 1, sequence->nodes, sequence->length * sizeof(hz_sequence_node_t));
+    memcpy((hz_byte_t *) (entry + 1) + sequence->length * sizeof(hz_sequence_node_t),
+           key->text, key->text_length * sizeof(hz_unicode_t));
+
+    record_index = (shard->record_first + shard->record_count++) % shard->record_capacity;
+    shard->records[record_index].offset = (uint32_t) shard->head;
+    shard->records[record_index].size = (uint32_t) size;
+    shard->records[record_index].slot = slot_index;
+    shard->slot_records[slot_index] = record_index;
+
+    {
+        uint32_t version = slot->version;
+
+        __atomic_store_n(&slot->version, version + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->offset, (uint32_t) shard->head, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->size, (uint32_t) size, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->version, version + 2, __ATOMIC_RELEASE);
+    }
+
+    shard->head += size;
+    __atomic_fetch_add(&shard->insertions, 1, __ATOMIC_RELAXED);
+    hz_shared_shape_cache_unlock(shard);
+}
+
+void
+hz_shared_shape_cache_add_lookups(hz_shared_shape_cache_t *cache,
+                                  uint64_t hits, uint64_t misses)
+{
+    if (hits)
+        __atomic_fetch_add(&cache->hits, hits, __ATOMIC_RELAXED);
+    if (misses)
+        __atomic_fetch_add(&cache->misses, misses, __ATOMIC_RELAXED);
+}
+
+void
+hz_shared_shape_cache_get_stats(const hz_shared_shape_cache_t *cache,
+                                hz_shape_cache_stats_t *stats)
+{
+    unsigned int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    for (i = 0; i < (1U << cache->shard_bits); ++i) {
+        const hz_shared_shape_cache_shard_t *shard = &cache->shards[i].shard;
+        stats->insertions += __atomic_load_n(&shard->insertions, __ATOMIC_RELAXED);
+        stats->evictions += __atomic_load_n(&shard->evictions, __ATOMIC_RELAXED);
+    }
+}
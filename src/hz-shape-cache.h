@@ -0,0 +1,161 @@
+#ifndef HZ_SHAPE_CACHE_H
+#define HZ_SHAPE_CACHE_H
+
+#include "hz-ot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct hz_shape_cache_t hz_shape_cache_t;
+typedef struct hz_shared_shape_cache_t hz_shared_shape_cache_t;
+
+/*  Struct: hz_shape_cache_key_t
+ *      Everything the result of shaping a text depends on.
+ *
+ *  Fields:
+ *      face - Face the text is shaped with.
+ *      plan_id - Hash of the script, language and features, see <hz_context_get_plan_id>.
+ *      dir - Writing direction.
+ *      text - Codepoints of the text.
+ *      text_length - Number of codepoints.
+ * */
+typedef struct hz_shape_cache_key_t {
+    const hz_face_t *face;
+    uint64_t plan_id;
+    hz_direction_t dir;
+    const hz_unicode_t *text;
+    size_t text_length;
+} hz_shape_cache_key_t;
+
+/*  Function: hz_shape_cache_create
+ *      Creates a cache of shaped runs. Once the runs outgrow the byte budget the
+ *      cache evicts the ones least recently hit, following the CLOCK policy.
+ *
+ *  Parameters:
+ *      byte_budget - Number of bytes the cached runs may take.
+ *
+ *  Returns:
+ *      The cache.
+ * */
+hz_shape_cache_t *
+hz_shape_cache_create(size_t byte_budget);
+
+void
+hz_shape_cache_destroy(hz_shape_cache_t *cache);
+
+void
+hz_shape_cache_clear(hz_shape_cache_t *cache);
+
+/*  Function: hz_shape_cache_get_size
+ *      Returns the number of bytes the cached runs take.
+ * */
+size_t
+hz_shape_cache_get_size(const hz_shape_cache_t *cache);
+
+/*  Function: hz_shape_cache_lookup
+ *      Looks a shaped run up and copies its glyphs into the sequence on a hit.
+ *
+ *  Parameters:
+ *      cache - The cache.
+ *      key - Key of the run.
+ *      sequence - Sequence receiving the glyphs.
+ *
+ *  Returns:
+ *      Whether the run was cached.
+ * */
+hz_bool_t
+hz_shape_cache_lookup(hz_shape_cache_t *cache,
+                      const hz_shape_cache_key_t *key,
+                      hz_sequence_t *sequence);
+
+/*  Function: hz_shape_cache_insert
+ *      Caches the glyphs of a shaped sequence, runs bigger than the whole budget
+ *      aren't cached.
+ *
+ *  Parameters:
+ *      cache - The cache.
+ *      key - Key of the run.
+ *      sequence - The shaped sequence.
+ * */
+void
+hz_shape_cache_insert(hz_shape_cache_t *cache,
+                      const hz_shape_cache_key_t *key,
+                      const hz_sequence_t *sequence);
+
+/*  Struct: hz_shape_cache_stats_t
+ *      Counters of a shared shape cache, summed over its shards.
+ *
+ *  Fields:
+ *      hits - Lookups that found their run, as added by <hz_shared_shape_cache_add_lookups>.
+ *      misses - Lookups that didn't.
+ *      insertions - Runs cached.
+ *      evictions - Runs evicted to make room for others.
+ * */
+typedef struct hz_shape_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+} hz_shape_cache_stats_t;
+
+/*  Function: hz_shared_shape_cache_create
+ *      Creates a cache of shaped runs shared by threads. Keys are spread over
+ *      shards that each own a slice of the byte budget and evict on their own.
+ *      Lookups take no lock, they validate the slot they read with its version
+ *      and only insertions lock the shard they write to.
+ *
+ *  Parameters:
+ *      byte_budget - Number of bytes the cached runs may take.
+ *      shard_count - Number of shards, rounded up to a power of two.
+ *
+ *  Returns:
+ *      The cache.
+ * */
+hz_shared_shape_cache_t *
+hz_shared_shape_cache_create(size_t byte_budget, unsigned int shard_count);
+
+void
+hz_shared_shape_cache_destroy(hz_shared_shape_cache_t *cache);
+
+/*  Function: hz_shared_shape_cache_lookup
+ *      Like <hz_shape_cache_lookup>, callable from any thread. The sequence is
+ *      left untouched on a miss.
+ * */
+hz_bool_t
+hz_shared_shape_cache_lookup(hz_shared_shape_cache_t *cache,
+                             const hz_shape_cache_key_t *key,
+                             hz_sequence_t *sequence);
+
+/*  Function: hz_shared_shape_cache_insert
+ *      Like <hz_shape_cache_insert>, callable from any thread.
+ * */
+void
+hz_shared_shape_cache_insert(hz_shared_shape_cache_t *cache,
+                             const hz_shape_cache_key_t *key,
+                             const hz_sequence_t *sequence);
+
+/*  Function: hz_shared_shape_cache_add_lookups
+ *      Adds to the hits and misses of the cache. Lookups don't count themselves
+ *      so that they write nothing shared, contexts tally theirs and add them in
+ *      batches, and all of them once the context is destroyed or its shared
+ *      cache changes.
+ *
+ *  Parameters:
+ *      cache - The cache.
+ *      hits - Lookups that found their run.
+ *      misses - Lookups that didn't.
+ * */
+void
+hz_shared_shape_cache_add_lookups(hz_shared_shape_cache_t *cache,
+                                  uint64_t hits, uint64_t misses);
+
+void
+hz_shared_shape_cache_get_stats(const hz_shared_shape_cache_t *cache,
+                                hz_shape_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HZ_SHAPE_CACHE_H */
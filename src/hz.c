@@ -1,7 +1,55 @@
 #include "hz.h"
+#include "hz-ot-shape-complex-arabic.h"
 #include "util/hz-array.h"
 #include "util/hz-map.h"
 
+/* number of codepoints of basic Latin, the characters of the ASCII fast path */
+#define HZ_ASCII_COUNT 128
+
+/*  Struct: hz_shape_plan_t
+ *      What shaping precomputes for a face, script, language and features.
+ *
+ *  Fields:
+ *      face - Face the plan was built for.
+ *      plan_id - Plan id it was built for, see <hz_context_get_plan_id>.
+ *      ascii_simple - Bitset of the ASCII characters that no lookup substitutes and
+ *      only kerning positions, text made of them takes the ASCII fast path.
+ *      ascii_ids - Nominal glyph of every ASCII character.
+ *      ascii_gcs - Glyph class of every ASCII character's glyph.
+ *      ascii_x_advances - Advance of every ASCII character's glyph.
+ *      ascii_y_advances - Vertical advance of every ASCII character's glyph.
+ *      ascii_kerning - Kerning of every pair of ASCII characters, first * 128 + second.
+ *      ascii_kerned - Bitset of the pairs kerning matched, they're unsafe to break.
+ *      gsub_glyphs - Bitset of the glyphs the GSUB lookups can be applied at, NULL
+ *      if the face has no layout. Runs of other glyphs are skipped by the lookups.
+ *      gpos_glyphs - Same for the GPOS lookups.
+ *      glyph_count - Number of glyphs the bitsets hold bits for.
+ * */
+struct hz_shape_plan_t {
+    const hz_face_t *face;
+    uint64_t plan_id;
+    uint64_t ascii_simple[HZ_ASCII_COUNT / 64];
+    hz_index_t ascii_ids[HZ_ASCII_COUNT];
+    hz_glyph_class_t ascii_gcs[HZ_ASCII_COUNT];
+    int16_t ascii_x_advances[HZ_ASCII_COUNT];
+    int16_t ascii_y_advances[HZ_ASCII_COUNT];
+    int16_t ascii_kerning[HZ_ASCII_COUNT * HZ_ASCII_COUNT];
+    uint64_t ascii_kerned[HZ_ASCII_COUNT * HZ_ASCII_COUNT / 64];
+    uint64_t *gsub_glyphs;
+    uint64_t *gpos_glyphs;
+    uint32_t glyph_count;
+};
+
+static void
+hz_shape_plan_destroy(hz_shape_plan_t *plan)
+{
+    if (plan != NULL) {
+        HZ_FREE(plan->gsub_glyphs);
+        HZ_FREE(plan->gpos_glyphs);
+        HZ_FREE(plan);
+    }
+}
+
 
 void
 hz_context_set_features(hz_context_t *ctx, hz_array_t *features)
@@ -16,6 +64,12 @@ hz_context_create(hz_font_t *font)
 
     ctx->font = font;
 //    ctx->features = hz_array_create();
+    ctx->shape_cache = NULL;
+    ctx->shared_shape_cache = NULL;
+    ctx->shared_shape_cache_hits = 0;
+    ctx->shared_shape_cache_misses = 0;
+    ctx->plan = NULL;
+    ctx->scratch_sequence = NULL;
 
     return ctx;
 }
@@ -38,9 +92,75 @@ hz_context_set_direction(hz_context_t *ctx, hz_direction_t dir)
     ctx->dir = dir;
 }
 
+void
+hz_context_set_shape_cache(hz_context_t *ctx, hz_shape_cache_t *cache)
+{
+    ctx->shape_cache = cache;
+}
+
+/* lookups of the shared cache tallied by a context before they are added to it */
+#define HZ_SHARED_SHAPE_CACHE_LOOKUP_BATCH 256
+
+static void
+hz_context_flush_shared_shape_cache_lookups(hz_context_t *ctx)
+{
+    if (ctx->shared_shape_cache != NULL)
+        hz_shared_shape_cache_add_lookups(ctx->shared_shape_cache,
+                                          ctx->shared_shape_cache_hits,
+                                          ctx->shared_shape_cache_misses);
+    ctx->shared_shape_cache_hits = 0;
+    ctx->shared_shape_cache_misses = 0;
+}
+
+void
+hz_context_set_shared_shape_cache(hz_context_t *ctx, hz_shared_shape_cache_t *cache)
+{
+    hz_context_flush_shared_shape_cache_lookups(ctx);
+    ctx->shared_shape_cache = cache;
+}
+
+/* looks the key up in the shared cache, counting the lookup in the context so
+ * that lookups don't write to memory other threads read */
+static hz_bool_t
+hz_context_lookup_shared_shape_cache(hz_context_t *ctx, const hz_shape_cache_key_t *key,
+                                     hz_sequence_t *sequence)
+{
+    hz_bool_t hit = hz_shared_shape_cache_lookup(ctx->shared_shape_cache, key, sequence);
+
+    if (hit)
+        ++ctx->shared_shape_cache_hits;
+    else
+        ++ctx->shared_shape_cache_misses;
+
+    if (ctx->shared_shape_cache_hits + ctx->shared_shape_cache_misses
+        >= HZ_SHARED_SHAPE_CACHE_LOOKUP_BATCH)
+        hz_context_flush_shared_shape_cache_lookups(ctx);
+
+    return hit;
+}
+
+uint64_t
+hz_context_get_plan_id(const hz_context_t *ctx)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t i;
+
+    hash = (hash ^ (uint64_t) ctx->script) * 0x100000001B3ULL;
+    hash = (hash ^ (uint64_t) ctx->language) * 0x100000001B3ULL;
+
+    for (i = 0; i < hz_array_size(ctx->features); ++i)
+        hash = (hash ^ hz_array_at(ctx->features, i)) * 0x100000001B3ULL;
+
+    return hash;
+}
+
 void
 hz_context_destroy(hz_context_t *ctx)
 {
+    hz_context_flush_shared_shape_cache_lookups(ctx);
+    hz_shape_plan_destroy(ctx->plan);
+    if (ctx->scratch_sequence != NULL)
+        hz_sequence_destroy(ctx->scratch_sequence);
     free(ctx);
 }
 
@@ -176,11 +296,11 @@ hz_cmap_apply_encoding(hz_stream_t *table, hz_sequence_t *sequence,
             st.id_range_offsets = (uint16_t *)(curr_addr + 3*seg_jmp + sizeof(uint16_t));
 
             /* map unicode characters to glyph indices in sequenceion */
-            hz_sequence_node_t *curr_node = sequence->root;
+            size_t i;
 
-            while (curr_node != NULL) {
+            for (i = 0; i < sequence->length; ++i) {
+                hz_sequence_node_t *curr_node = &sequence->nodes[i];
                 curr_node->id = hz_cmap_unicode_to_id(&st, curr_node->codepoint);
-                curr_node = curr_node->next;
             }
             break;
         }
@@ -350,24 +470,22 @@ hz_ot_parse_gdef_table(hz_context_t *ctx, hz_sequence_t *sequence)
     hz_stream_t *table = hz_stream_create(hz_face_get_ot_tables(face)->GDEF_table,0,0);
     uint32_t version;
 
-    hz_offset16_t glyph_class_def_offset;
-    hz_offset16_t attach_list_offset;
-    hz_offset16_t lig_caret_list_offset;
-    hz_offset16_t mark_attach_class_def_offset;
+    hz_offset16_t glyph_class_def_offset = 0;
+    hz_offset16_t attach_list_offset = 0;
+    hz_offset16_t lig_caret_list_offset = 0;
+    hz_offset16_t mark_attach_class_def_offset = 0;
 
     hz_stream_read32(table, &version);
 
     switch (version) {
         case 0x00010000: /* 1.0 */
+        case 0x00010002: /* 1.2, mark glyph sets follow and are compiled with the layout */
+        case 0x00010003: /* 1.3 */
             hz_stream_read16(table, &glyph_class_def_offset);
             hz_stream_read16(table, &attach_list_offset);
             hz_stream_read16(table, &lig_caret_list_offset);
             hz_stream_read16(table, &mark_attach_class_def_offset);
             break;
-        case 0x00010002: /* 1.2 */
-            break;
-        case 0x00010003: /* 1.3 */
-            break;
         default: /* error */
             break;
     }
@@ -376,7 +494,7 @@ hz_ot_parse_gdef_table(hz_context_t *ctx, hz_sequence_t *sequence)
         /* glyph class def isn't nil */
         hz_stream_t *subtable = hz_stream_create(table->data + glyph_class_def_offset, 0, 0);
         hz_map_t *class_map = hz_map_create();
-        hz_sequence_node_t *curr_node = sequence->root;
+        size_t i;
         uint16_t class_format;
         hz_stream_read16(subtable, &class_format);
         switch (class_format) {
@@ -403,7 +521,8 @@ hz_ot_parse_gdef_table(hz_context_t *ctx, hz_sequence_t *sequence)
         }
 
         /* set glyph class values if in map */
-        while (curr_node != NULL) {
+        for (i = 0; i < sequence->length; ++i) {
+            hz_sequence_node_t *curr_node = &sequence->nodes[i];
             hz_index_t gid = curr_node->id;
             if (hz_map_value_exists(class_map, gid)) {
                 curr_node->gc = hz_map_get_value(class_map, gid);
@@ -411,8 +530,6 @@ hz_ot_parse_gdef_table(hz_context_t *ctx, hz_sequence_t *sequence)
                 /* set default glyph class if current glyph id isn't found */
                 curr_node->gc = HZ_GLYPH_CLASS_ZERO;
             }
-
-            curr_node = curr_node->next;
         }
 
         hz_map_destroy(class_map);
@@ -518,8 +635,9 @@ hz_apply_tt1_metrics(hz_face_t *face, hz_sequence_t *sequence)
 //    }
 
     /* apply the metrics to position the glyphs */
-    hz_sequence_node_t *curr_node = sequence->root;
-    while (curr_node != NULL) {
+    size_t i;
+    for (i = 0; i < sequence->length; ++i) {
+        hz_sequence_node_t *curr_node = &sequence->nodes[i];
         hz_index_t id = curr_node->id;
         hz_metrics_t *metric = hz_face_get_glyph_metrics(face, id);
 
@@ -527,8 +645,6 @@ hz_apply_tt1_metrics(hz_face_t *face, hz_sequence_t *sequence)
         curr_node->y_advance = metric->y_advance;
         curr_node->x_offset = 0;
         curr_node->y_offset = 0;
-
-        curr_node = curr_node->next;
     }
 
     HZ_FREE(left_side_bearings);
@@ -537,27 +653,50 @@ hz_apply_tt1_metrics(hz_face_t *face, hz_sequence_t *sequence)
 
 static void
 hz_apply_rtl_switch(hz_sequence_t *sequence) {
-    hz_sequence_node_t *node = hz_sequence_last_node(sequence->root);
-    sequence->root = node;
+    size_t i, j;
 
-    while (node != NULL) {
-        hz_sequence_node_t *prev, *next;
-        prev = node->prev;
-        next = node->next;
-        node->next = prev;
-        node->prev = next;
-        node = prev;
+    for (i = 0, j = sequence->length; i + 1 < j; ++i, --j) {
+        hz_sequence_node_t tmp = sequence->nodes[i];
+        sequence->nodes[i] = sequence->nodes[j - 1];
+        sequence->nodes[j - 1] = tmp;
     }
 }
 
 static void
 hz_compute_sequence_width(hz_sequence_t *sequence) {
-    hz_sequence_node_t *node = sequence->root;
+    size_t i;
+
+    for (i = 0; i < sequence->length; ++i)
+        sequence->width += sequence->nodes[i].x_advance;
+}
+
+/* fills the prefix sums of the advances from glyph first on, the positions
+ * before it are kept. They're dropped when the caller no longer wants them so
+ * none are ever stale */
+static void
+hz_sequence_fill_x_positions(hz_sequence_t *sequence, size_t first)
+{
+    size_t i;
 
-    while (node != NULL) {
-        sequence->width += node->x_advance;
-        node = node->next;
+    if (!(sequence->flags & HZ_SEQUENCE_FLAG_X_POSITIONS)) {
+        HZ_FREE(sequence->x_positions);
+        sequence->x_positions = NULL;
+        sequence->x_positions_capacity = 0;
+        return;
     }
+
+    if (sequence->x_positions == NULL)
+        first = 0;
+
+    if (sequence->x_positions_capacity < sequence->length + 1) {
+        sequence->x_positions_capacity = sequence->length + 1;
+        sequence->x_positions = (int64_t *) HZ_REALLOC(sequence->x_positions,
+            sequence->x_positions_capacity * sizeof(int64_t));
+    }
+
+    sequence->x_positions[0] = 0;
+    for (i = first; i < sequence->length; ++i)
+        sequence->x_positions[i + 1] = sequence->x_positions[i] + sequence->nodes[i].x_advance;
 }
 
 void
@@ -567,17 +706,183 @@ hz_setup_sequence_glyph_info(hz_context_t *ctx, hz_sequence_t *sequence) {
     if (tables->GDEF_table != NULL) {
         hz_ot_parse_gdef_table(ctx, sequence);
     } else {
-        hz_sequence_node_t *node = sequence->root;
+        size_t i;
+
+        for (i = 0; i < sequence->length; ++i)
+            sequence->nodes[i].gc = HZ_GLYPH_CLASS_BASE;
+    }
+
+    hz_sequence_reset_skip_indices(sequence);
+}
+
+/* maps the ASCII characters and reads their metrics the way shaping does, then
+ * checks which of them the features leave to kerning alone */
+static hz_shape_plan_t *
+hz_shape_plan_create(hz_context_t *ctx, uint64_t plan_id)
+{
+    hz_shape_plan_t *plan = HZ_ALLOC(hz_shape_plan_t);
+    hz_face_t *face = hz_font_get_face(ctx->font);
+    const hz_ot_layout_t *layout = hz_face_get_ot_layout(face);
+    hz_sequence_t *ascii = hz_sequence_create();
+    hz_unicode_t codepoints[HZ_ASCII_COUNT];
+    size_t i;
+
+    for (i = 0; i < HZ_ASCII_COUNT; ++i)
+        codepoints[i] = (hz_unicode_t) i;
+
+    hz_sequence_load_unicode(ascii, codepoints, HZ_ASCII_COUNT);
+    hz_map_to_nominal_forms(ctx, ascii);
+    hz_setup_sequence_glyph_info(ctx, ascii);
+    hz_apply_tt1_metrics(face, ascii);
+
+    plan->face = face;
+    plan->plan_id = plan_id;
+
+    for (i = 0; i < HZ_ASCII_COUNT; ++i) {
+        plan->ascii_ids[i] = ascii->nodes[i].id;
+        plan->ascii_gcs[i] = ascii->nodes[i].gc;
+        plan->ascii_x_advances[i] = ascii->nodes[i].x_advance;
+        plan->ascii_y_advances[i] = ascii->nodes[i].y_advance;
+    }
+
+    hz_ot_layout_gather_simple_glyphs(face,
+                                      hz_ot_script_to_tag(ctx->script),
+                                      hz_ot_language_to_tag(ctx->language),
+                                      ctx->features,
+                                      hz_array_has(ctx->features, HZ_FEATURE_KERN, NULL),
+                                      ascii->nodes, HZ_ASCII_COUNT,
+                                      plan->ascii_simple, plan->ascii_kerning, plan->ascii_kerned);
+
+    plan->gsub_glyphs = NULL;
+    plan->gpos_glyphs = NULL;
+    plan->glyph_count = 0;
+    if (layout != NULL) {
+        plan->glyph_count = layout->glyph_count;
+        plan->gsub_glyphs = HZ_MALLOC((layout->bitset_words ? layout->bitset_words : 1) * sizeof(uint64_t));
+        plan->gpos_glyphs = HZ_MALLOC((layout->bitset_words ? layout->bitset_words : 1) * sizeof(uint64_t));
+        hz_ot_layout_gather_active_glyphs(face,
+                                          hz_ot_script_to_tag(ctx->script),
+                                          hz_ot_language_to_tag(ctx->language),
+                                          ctx->features,
+                                          plan->gsub_glyphs, plan->gpos_glyphs);
+    }
+
+    hz_sequence_destroy(ascii);
+    return plan;
+}
+
+/* the context's plan, rebuilt if the face or anything the plan id hashes changed */
+static const hz_shape_plan_t *
+hz_context_get_shape_plan(hz_context_t *ctx)
+{
+    uint64_t plan_id = hz_context_get_plan_id(ctx);
+
+    if (ctx->plan == NULL || ctx->plan->face != hz_font_get_face(ctx->font) || ctx->plan->plan_id != plan_id) {
+        hz_shape_plan_destroy(ctx->plan);
+        ctx->plan = hz_shape_plan_create(ctx, plan_id);
+    }
+
+    return ctx->plan;
+}
+
+/* whether some glyph of the sequence is in the bitset of glyphs lookups can be
+ * applied at, the lookups leave the sequence alone otherwise */
+static hz_bool_t
+hz_shape_plan_is_active(const hz_shape_plan_t *plan, const uint64_t *active_glyphs,
+                        const hz_sequence_t *sequence)
+{
+    size_t i;
 
-        while (node != NULL) {
-            node->gc = HZ_GLYPH_CLASS_BASE;
-            node = node->next;
+    if (active_glyphs == NULL)
+        return HZ_TRUE;
+
+    for (i = 0; i < sequence->length; ++i) {
+        hz_index_t id = sequence->nodes[i].id;
+
+        if (id >= plan->glyph_count || ((active_glyphs[id >> 6] >> (id & 63)) & 1))
+            return HZ_TRUE;
+    }
+
+    return HZ_FALSE;
+}
+
+/* whether every character of the sequence takes the ASCII fast path */
+static hz_bool_t
+hz_shape_plan_is_simple(const hz_shape_plan_t *plan, const hz_sequence_t *sequence)
+{
+    size_t i;
+
+    for (i = 0; i < sequence->length; ++i) {
+        hz_unicode_t c = sequence->nodes[i].codepoint;
+
+        if (c >= HZ_ASCII_COUNT || !((plan->ascii_simple[c >> 6] >> (c & 63)) & 1))
+            return HZ_FALSE;
+    }
+
+    return HZ_TRUE;
+}
+
+/* like hz_shape_plan_is_simple, for the codepoints of a text */
+static hz_bool_t
+hz_shape_plan_is_simple_text(const hz_shape_plan_t *plan, const hz_unicode_t *text, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i) {
+        hz_unicode_t c = text[i];
+
+        if (c >= HZ_ASCII_COUNT || !((plan->ascii_simple[c >> 6] >> (c & 63)) & 1))
+            return HZ_FALSE;
+    }
+
+    return HZ_TRUE;
+}
+
+/* shapes simple ASCII text with the plan's tables, giving the glyphs the full
+ * pipeline gives them: nominal glyphs, their advances and the kerning of pairs */
+static void
+hz_shape_simple(const hz_shape_plan_t *plan, hz_sequence_t *sequence)
+{
+    hz_sequence_node_t *nodes = sequence->nodes;
+    int64_t width = 0;
+    size_t i;
+
+    for (i = 0; i < sequence->length; ++i) {
+        hz_unicode_t c = nodes[i].codepoint;
+
+        nodes[i].id = plan->ascii_ids[c];
+        nodes[i].gc = plan->ascii_gcs[c];
+        nodes[i].x_advance = plan->ascii_x_advances[c];
+        nodes[i].y_advance = plan->ascii_y_advances[c];
+        nodes[i].x_offset = 0;
+        nodes[i].y_offset = 0;
+
+        if (i > 0) {
+            size_t pair = nodes[i - 1].codepoint * HZ_ASCII_COUNT + c;
+
+            if ((plan->ascii_kerned[pair >> 6] >> (pair & 63)) & 1) {
+                nodes[i - 1].x_advance += plan->ascii_kerning[pair];
+                nodes[i].flags |= HZ_GLYPH_FLAG_UNSAFE_TO_BREAK;
+                width += plan->ascii_kerning[pair];
+            }
         }
+
+        width += nodes[i].x_advance;
     }
+
+    hz_sequence_reset_skip_indices(sequence);
+
+    if (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT)
+        hz_apply_rtl_switch(sequence);
+
+    sequence->width += width;
 }
 
-void
-hz_shape_full(hz_context_t *ctx, hz_sequence_t *sequence)
+/* maps the characters to glyphs, substitutes and positions them. When only the
+ * advances are wanted the lookups that can't change them are skipped */
+static void
+hz_shape_layout(hz_context_t *ctx, const hz_shape_plan_t *plan, hz_sequence_t *sequence,
+                hz_bool_t advances_only)
 {
     hz_face_t *face = hz_font_get_face(ctx->font);
     hz_tag_t script_tag = hz_ot_script_to_tag(ctx->script);
@@ -590,25 +895,682 @@ hz_shape_full(hz_context_t *ctx, hz_sequence_t *sequence)
     /* sets glyph class information */
     hz_setup_sequence_glyph_info(ctx, sequence);
 
-    /* substitute glyphs */
-    if (tables->GSUB_table != NULL)
+    if (ctx->script == HZ_SCRIPT_ARABIC)
+        hz_ot_shape_complex_arabic_flag_joins(sequence);
+
+    /* substitute glyphs, unless no lookup applies at any of them */
+    if (tables->GSUB_table != NULL && hz_shape_plan_is_active(plan, plan->gsub_glyphs, sequence))
         hz_ot_layout_apply_gsub_features(face, script_tag,
                                          language_tag,
                                          ctx->features,
+                                         plan->gsub_glyphs,
                                          sequence);
 
     /* position glyphs */
     hz_apply_tt1_metrics(face, sequence);
-    if (tables->GPOS_table != NULL)
+    if (tables->GPOS_table != NULL && hz_shape_plan_is_active(plan, plan->gpos_glyphs, sequence))
         hz_ot_layout_apply_gpos_features(face, script_tag,
                                          language_tag,
                                          ctx->features,
+                                         plan->gpos_glyphs,
+                                         advances_only,
                                          sequence);
 
+    /* fall back to the legacy kern table when GPOS doesn't kern */
+    if (hz_array_has(ctx->features, HZ_FEATURE_KERN, NULL))
+        hz_ot_layout_apply_kern_table(face, sequence);
+}
+
+/* texts up to this many codepoints are keyed without allocating */
+#define HZ_SHAPE_CACHE_KEY_BUFFER_SIZE 128
+
+/* shapes the sequence leaving the clusters as text indices, the form the shape
+ * caches keep them in as they don't depend on the encoding of the text */
+static void
+hz_shape_glyphs(hz_context_t *ctx, hz_sequence_t *sequence)
+{
+    hz_face_t *face = hz_font_get_face(ctx->font);
+    const hz_shape_plan_t *plan = hz_context_get_shape_plan(ctx);
+    hz_unicode_t key_buffer[HZ_SHAPE_CACHE_KEY_BUFFER_SIZE];
+    hz_shape_cache_key_t key;
+
+    /* the width is the one of this shaping whether it hits a cache or not,
+     * never added to what an earlier shaping left */
+    sequence->width = 0;
+
+    if (ctx->dir == HZ_DIRECTION_RTL)
+        sequence->flags |= HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT;
+    else
+        sequence->flags &= ~HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT;
+
+    /* simple ASCII text is shaped faster than the caches are looked up */
+    if (hz_shape_plan_is_simple(plan, sequence)) {
+        hz_shape_simple(plan, sequence);
+        return;
+    }
+
+    if (ctx->shape_cache != NULL || ctx->shared_shape_cache != NULL) {
+        hz_unicode_t *text = sequence->length <= HZ_SHAPE_CACHE_KEY_BUFFER_SIZE ? key_buffer
+            : (hz_unicode_t *) HZ_MALLOC(sequence->length * sizeof(hz_unicode_t));
+        size_t i;
+
+        for (i = 0; i < sequence->length; ++i)
+            text[i] = sequence->nodes[i].codepoint;
+
+        key.face = face;
+        key.plan_id = plan->plan_id;
+        key.dir = ctx->dir;
+        key.text = text;
+        key.text_length = sequence->length;
+
+        if ((ctx->shape_cache != NULL && hz_shape_cache_lookup(ctx->shape_cache, &key, sequence))
+            || (ctx->shared_shape_cache != NULL
+                && hz_context_lookup_shared_shape_cache(ctx, &key, sequence))) {
+            if (text != key_buffer)
+                HZ_FREE(text);
+            return;
+        }
+    }
+
+    hz_shape_layout(ctx, plan, sequence, HZ_FALSE);
+
     if (ctx->dir == HZ_DIRECTION_RTL)
         hz_apply_rtl_switch(sequence);
 
     hz_compute_sequence_width(sequence);
+
+    if (ctx->shape_cache != NULL || ctx->shared_shape_cache != NULL) {
+        if (ctx->shape_cache != NULL)
+            hz_shape_cache_insert(ctx->shape_cache, &key, sequence);
+        if (ctx->shared_shape_cache != NULL)
+            hz_shared_shape_cache_insert(ctx->shared_shape_cache, &key, sequence);
+        if (key.text != key_buffer)
+            HZ_FREE((hz_unicode_t *) key.text);
+    }
+}
+
+void
+hz_shape_full(hz_context_t *ctx, hz_sequence_t *sequence)
+{
+    hz_shape_glyphs(ctx, sequence);
+    hz_sequence_map_clusters(sequence);
+    hz_sequence_fill_x_positions(sequence, 0);
+}
+
+/* the context's scratch sequence, emptied for shaping a text into it */
+static hz_sequence_t *
+hz_context_get_scratch_sequence(hz_context_t *ctx)
+{
+    hz_sequence_t *sect;
+
+    if (ctx->scratch_sequence == NULL)
+        ctx->scratch_sequence = hz_sequence_create();
+
+    sect = ctx->scratch_sequence;
+    sect->length = 0;
+    sect->text_length = 0;
+    sect->text_size = 0;
+    sect->width = 0;
+    sect->flags = 0;
+    return sect;
+}
+
+/* measures simple ASCII text with the plan's tables, the kerning of a pair
+ * widens the cluster of its first character */
+static int64_t
+hz_measure_simple(const hz_shape_plan_t *plan, const hz_sequence_t *sequence, int64_t *cluster_widths)
+{
+    const hz_unicode_t *text = sequence->text;
+    int64_t width = 0;
+    size_t i;
+
+    for (i = 0; i < sequence->text_length; ++i) {
+        int16_t x_advance = plan->ascii_x_advances[text[i]];
+
+        if (i > 0) {
+            size_t pair = text[i - 1] * HZ_ASCII_COUNT + text[i];
+
+            if ((plan->ascii_kerned[pair >> 6] >> (pair & 63)) & 1) {
+                width += plan->ascii_kerning[pair];
+                if (cluster_widths != NULL)
+                    cluster_widths[sequence->text_offsets[i - 1]] += plan->ascii_kerning[pair];
+            }
+        }
+
+        width += x_advance;
+        if (cluster_widths != NULL)
+            cluster_widths[sequence->text_offsets[i]] += x_advance;
+    }
+
+    return width;
+}
+
+int64_t
+hz_shape_measure(hz_context_t *ctx, const hz_sequence_t *sequence, int64_t *cluster_widths)
+{
+    const hz_shape_plan_t *plan = hz_context_get_shape_plan(ctx);
+    hz_shape_cache_key_t key;
+    hz_sequence_t *sect;
+    int64_t width = 0;
+    size_t i;
+
+    if (cluster_widths != NULL)
+        memset(cluster_widths, 0, sequence->text_size * sizeof(int64_t));
+
+    if (hz_shape_plan_is_simple_text(plan, sequence->text, sequence->text_length))
+        return hz_measure_simple(plan, sequence, cluster_widths);
+
+    /* the glyphs are shaped in the context's scratch sequence, loaded from the
+     * text so the caller's glyphs are left as they are */
+    sect = hz_context_get_scratch_sequence(ctx);
+    hz_sequence_reserve(sect, sequence->text_length);
+    for (i = 0; i < sequence->text_length; ++i) {
+        hz_sequence_node_t *node = &sect->nodes[i];
+
+        memset(node, 0, sizeof(hz_sequence_node_t));
+        node->codepoint = sequence->text[i];
+        node->cluster = (uint32_t) i;
+        node->gc = HZ_GLYPH_CLASS_ZERO;
+    }
+
+    sect->length = sequence->text_length;
+    sect->flags = ctx->dir == HZ_DIRECTION_RTL ? HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT : 0;
+    hz_sequence_reset_skip_indices(sect);
+
+    /* a cached run has the advances too, measured runs aren't cached as their
+     * marks aren't positioned */
+    key.face = hz_font_get_face(ctx->font);
+    key.plan_id = plan->plan_id;
+    key.dir = ctx->dir;
+    key.text = sequence->text;
+    key.text_length = sequence->text_length;
+
+    if (!(ctx->shape_cache != NULL && hz_shape_cache_lookup(ctx->shape_cache, &key, sect))
+        && !(ctx->shared_shape_cache != NULL
+             && hz_context_lookup_shared_shape_cache(ctx, &key, sect)))
+        hz_shape_layout(ctx, plan, sect, HZ_TRUE);
+
+    for (i = 0; i < sect->length; ++i) {
+        const hz_sequence_node_t *node = &sect->nodes[i];
+
+        width += node->x_advance;
+        if (cluster_widths != NULL && node->cluster < sequence->text_length)
+            cluster_widths[sequence->text_offsets[node->cluster]] += node->x_advance;
+    }
+
+    return width;
+}
+
+/* glyph at logical index, the glyphs of right-to-left text are kept in visual order */
+static const hz_sequence_node_t *
+hz_sequence_logical_node(const hz_sequence_t *sequence, size_t index)
+{
+    if (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT)
+        return &sequence->nodes[sequence->length - 1 - index];
+
+    return &sequence->nodes[index];
+}
+
+/* logical index of the first glyph whose cluster is at least cluster */
+static size_t
+hz_sequence_find_cluster(const hz_sequence_t *sequence, size_t cluster)
+{
+    size_t low = 0, high = sequence->length;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (hz_sequence_logical_node(sequence, mid)->cluster < cluster)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* whether the text can be broken right before the glyph at logical index */
+static hz_bool_t
+hz_sequence_is_safe_to_break(const hz_sequence_t *sequence, size_t index)
+{
+    const hz_sequence_node_t *node;
+
+    if (index == 0 || index >= sequence->length)
+        return HZ_TRUE;
+
+    node = hz_sequence_logical_node(sequence, index);
+    return !(node->flags & HZ_GLYPH_FLAG_UNSAFE_TO_BREAK)
+        && hz_sequence_logical_node(sequence, index - 1)->cluster != node->cluster;
+}
+
+/* whether the glyphs at logical indices [first, end) of a and [b_first, b_end) of b
+ * are shaped the same */
+static hz_bool_t
+hz_sequence_glyphs_match(const hz_sequence_t *a, size_t first, size_t end,
+                         const hz_sequence_t *b, size_t b_first, size_t b_end)
+{
+    if (end - first != b_end - b_first)
+        return HZ_FALSE;
+
+    for (; first < end; ++first, ++b_first) {
+        const hz_sequence_node_t *x = hz_sequence_logical_node(a, first);
+        const hz_sequence_node_t *y = hz_sequence_logical_node(b, b_first);
+
+        if (x->id != y->id || x->x_advance != y->x_advance || x->y_advance != y->y_advance
+            || x->x_offset != y->x_offset || x->y_offset != y->y_offset)
+            return HZ_FALSE;
+    }
+
+    return HZ_TRUE;
+}
+
+void
+hz_shape_edit(hz_context_t *ctx, hz_sequence_t *sequence,
+              size_t offset, size_t removed_length,
+              const hz_unicode_t *inserted, size_t inserted_length)
+{
+    hz_sequence_t *sect;
+    size_t first, end, text_first, text_end, index, removed_end, edit_end, at, count, i;
+    int64_t delta, width = 0;
+
+    if (offset > sequence->text_size)
+        offset = sequence->text_size;
+
+    if (removed_length > sequence->text_size - offset)
+        removed_length = sequence->text_size - offset;
+
+    /* the edit is made of whole characters */
+    index = hz_sequence_text_index(sequence, offset);
+    removed_end = hz_sequence_text_index(sequence, offset + removed_length);
+    offset = index < sequence->text_length ? sequence->text_offsets[index] : sequence->text_size;
+    removed_length = (removed_end < sequence->text_length ? sequence->text_offsets[removed_end]
+                                                          : sequence->text_size) - offset;
+
+    edit_end = offset + removed_length;
+    delta = -(int64_t) removed_length;
+    for (i = 0; i < inserted_length; ++i)
+        delta += hz_encoding_char_size(sequence->encoding, inserted[i]);
+
+    /* the clusters next to the edit are reshaped too, the edit may give them
+     * new context. The range then grows to breaks that are safe */
+    first = hz_sequence_find_cluster(sequence, offset);
+    if (first > 0)
+        --first;
+    while (!hz_sequence_is_safe_to_break(sequence, first))
+        --first;
+
+    end = hz_sequence_find_cluster(sequence, offset + removed_length);
+    if (end < sequence->length)
+        ++end;
+    while (!hz_sequence_is_safe_to_break(sequence, end))
+        ++end;
+
+    /* edit the text */
+    hz_sequence_reserve_text(sequence, sequence->text_length + inserted_length);
+    if (sequence->text != NULL) {
+        memmove(sequence->text + index + inserted_length,
+                sequence->text + removed_end,
+                (sequence->text_length - removed_end) * sizeof(hz_unicode_t));
+        memmove(sequence->text_offsets + index + inserted_length,
+                sequence->text_offsets + removed_end,
+                (sequence->text_length - removed_end) * sizeof(uint32_t));
+    }
+
+    sequence->text_length = sequence->text_length + inserted_length - (removed_end - index);
+    sequence->text_size += delta;
+
+    for (i = 0; i < inserted_length; ++i) {
+        sequence->text[index + i] = inserted[i];
+        sequence->text_offsets[index + i] = (uint32_t) offset;
+        offset += hz_encoding_char_size(sequence->encoding, inserted[i]);
+    }
+
+    for (i = index + inserted_length; i < sequence->text_length; ++i)
+        sequence->text_offsets[i] = (uint32_t) (sequence->text_offsets[i] + delta);
+
+    for (;;) {
+        size_t edge, cluster;
+        hz_bool_t widen_first = HZ_FALSE, widen_end = HZ_FALSE;
+
+        text_first = first > 0 ? hz_sequence_logical_node(sequence, first)->cluster : 0;
+        text_end = end < sequence->length
+            ? (size_t) ((int64_t) hz_sequence_logical_node(sequence, end)->cluster + delta)
+            : sequence->text_size;
+
+        /* shape the characters of the range, their clusters index the text
+         * from its first character until they're turned into offsets */
+        index = hz_sequence_text_index(sequence, text_first);
+        sect = hz_context_get_scratch_sequence(ctx);
+        hz_sequence_load_unicode(sect, sequence->text + index,
+                                 hz_sequence_text_index(sequence, text_end) - index);
+        hz_shape_glyphs(ctx, sect);
+
+        for (i = 0; i < sect->length; ++i)
+            sect->nodes[i].cluster = sequence->text_offsets[index + sect->nodes[i].cluster];
+
+        /* the glyphs outside the range interact with the clusters at its edges,
+         * up to the first and from the last glyph that isn't a mark. When these
+         * come out shaped differently the edit reached past them and the range
+         * is widened */
+        if (first > 0) {
+            edge = first;
+            while (edge + 1 < end && hz_sequence_logical_node(sequence, edge)->gc & HZ_GLYPH_CLASS_MARK)
+                ++edge;
+
+            cluster = hz_sequence_logical_node(sequence, edge)->cluster + 1;
+            edge = hz_sequence_find_cluster(sequence, cluster);
+            cluster = cluster > edit_end ? cluster + delta : cluster;
+            widen_first = !hz_sequence_glyphs_match(sequence, first, edge,
+                                                    sect, 0, hz_sequence_find_cluster(sect, cluster));
+        }
+
+        if (end < sequence->length) {
+            edge = end;
+            while (edge - 1 > first && hz_sequence_logical_node(sequence, edge - 1)->gc & HZ_GLYPH_CLASS_MARK)
+                --edge;
+
+            cluster = hz_sequence_logical_node(sequence, edge - 1)->cluster;
+            edge = hz_sequence_find_cluster(sequence, cluster);
+            cluster = cluster >= edit_end ? cluster + delta : cluster;
+            widen_end = !hz_sequence_glyphs_match(sequence, edge, end,
+                                                  sect, hz_sequence_find_cluster(sect, cluster), sect->length);
+        }
+
+        if (!widen_first && !widen_end)
+            break;
+
+        if (widen_first) {
+            --first;
+            while (!hz_sequence_is_safe_to_break(sequence, first))
+                --first;
+        }
+
+        if (widen_end) {
+            ++end;
+            while (!hz_sequence_is_safe_to_break(sequence, end))
+                ++end;
+        }
+    }
+
+    /* splice the glyphs in, the glyphs of right-to-left text come in visual order */
+    count = end - first;
+    at = (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) ? sequence->length - end : first;
+
+    for (i = at; i < at + count; ++i)
+        width += sequence->nodes[i].x_advance;
+
+    if (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) {
+        for (i = 0; i < at; ++i)
+            sequence->nodes[i].cluster = (uint32_t) (sequence->nodes[i].cluster + delta);
+    } else {
+        for (i = at + count; i < sequence->length; ++i)
+            sequence->nodes[i].cluster = (uint32_t) (sequence->nodes[i].cluster + delta);
+    }
+
+    if (count > 0 || sect->length > 0) {
+        hz_sequence_reserve(sequence, sequence->length - count + sect->length);
+        memmove(sequence->nodes + at + sect->length,
+                sequence->nodes + at + count,
+                (sequence->length - at - count) * sizeof(hz_sequence_node_t));
+        if (sect->length > 0)
+            memcpy(sequence->nodes + at, sect->nodes, sect->length * sizeof(hz_sequence_node_t));
+        sequence->length = sequence->length - count + sect->length;
+    }
+
+    sequence->width += sect->width - width;
+    hz_sequence_reset_skip_indices(sequence);
+
+    /* the glyphs before the spliced ones kept their positions */
+    hz_sequence_fill_x_positions(sequence, at);
+}
+
+/* the glyphs and characters of a cluster, and where carets go inside it */
+typedef struct hz_caret_cluster_t {
+    size_t first;
+    size_t end;
+    size_t text_first;
+    size_t text_end;
+    int64_t left;
+    int64_t right;
+    int64_t origin;
+    const int16_t *carets;
+    uint16_t caret_count;
+    hz_bool_t ligature;
+} hz_caret_cluster_t;
+
+/* visual index of the glyph at logical index */
+static size_t
+hz_sequence_visual_index(const hz_sequence_t *sequence, size_t index)
+{
+    return (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) ? sequence->length - 1 - index : index;
+}
+
+/* gathers the cluster of the glyph at logical index. Its carets come from the
+ * GDEF carets of its first glyph, a ligature without any is split evenly */
+static void
+hz_caret_cluster_init(hz_caret_cluster_t *cluster, hz_face_t *face,
+                      const hz_sequence_t *sequence, size_t index)
+{
+    const hz_sequence_node_t *node = hz_sequence_logical_node(sequence, index);
+    uint32_t offset = node->cluster;
+    size_t left_index, right_index;
+
+    cluster->first = hz_sequence_find_cluster(sequence, offset);
+    cluster->end = hz_sequence_find_cluster(sequence, (size_t) offset + 1);
+    cluster->text_first = hz_sequence_text_index(sequence, offset);
+    cluster->text_end = cluster->end < sequence->length
+        ? hz_sequence_text_index(sequence, hz_sequence_logical_node(sequence, cluster->end)->cluster)
+        : sequence->text_length;
+
+    left_index = hz_sequence_visual_index(sequence, cluster->first);
+    right_index = hz_sequence_visual_index(sequence, cluster->end - 1);
+    if (left_index > right_index) {
+        size_t tmp = left_index;
+        left_index = right_index;
+        right_index = tmp;
+    }
+
+    cluster->left = sequence->x_positions[left_index];
+    cluster->right = sequence->x_positions[right_index + 1];
+
+    node = hz_sequence_logical_node(sequence, cluster->first);
+    cluster->origin = sequence->x_positions[hz_sequence_visual_index(sequence, cluster->first)];
+    cluster->caret_count = hz_ot_layout_get_ligature_carets(hz_face_get_ot_layout(face), node->id,
+                                                            &cluster->carets);
+    cluster->ligature = (node->gc & HZ_GLYPH_CLASS_LIGATURE) != 0;
+}
+
+/* visual span of the character at text index, one of the cluster's. The carets
+ * split the cluster into parts the characters take in logical order, the last
+ * character takes the parts left over */
+static void
+hz_caret_cluster_get_span(const hz_caret_cluster_t *cluster, const hz_sequence_t *sequence,
+                          size_t text_index, int64_t *x0, int64_t *x1)
+{
+    size_t char_count = cluster->text_end - cluster->text_first;
+    size_t j = text_index - cluster->text_first;
+    size_t part_count, p0, p1, b0, b1;
+
+    if (cluster->caret_count > 0)
+        part_count = (size_t) cluster->caret_count + 1;
+    else if (cluster->ligature && char_count > 1)
+        part_count = char_count;
+    else
+        part_count = 1;
+
+    p0 = j < part_count ? j : part_count - 1;
+    p1 = j + 1 >= char_count ? part_count - 1 : p0;
+
+    /* parts of right-to-left text run from the right */
+    if (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) {
+        b0 = part_count - 1 - p1;
+        b1 = part_count - p0;
+    } else {
+        b0 = p0;
+        b1 = p1 + 1;
+    }
+
+    if (cluster->caret_count > 0) {
+        *x0 = b0 == 0 ? cluster->left : cluster->origin + cluster->carets[b0 - 1];
+        *x1 = b1 == part_count ? cluster->right : cluster->origin + cluster->carets[b1 - 1];
+        *x0 = *x0 < cluster->left ? cluster->left : *x0 > cluster->right ? cluster->right : *x0;
+        *x1 = *x1 < cluster->left ? cluster->left : *x1 > cluster->right ? cluster->right : *x1;
+    } else {
+        *x0 = cluster->left + (cluster->right - cluster->left) * (int64_t) b0 / (int64_t) part_count;
+        *x1 = cluster->left + (cluster->right - cluster->left) * (int64_t) b1 / (int64_t) part_count;
+    }
+}
+
+size_t
+hz_sequence_x_to_offset(hz_face_t *face, const hz_sequence_t *sequence, int64_t x, hz_bool_t *trailing)
+{
+    hz_bool_t rtl = (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) != 0;
+    hz_caret_cluster_t cluster;
+    size_t low = 0, high = sequence->length, index;
+    int64_t x0 = 0, x1 = 0;
+
+    HZ_ASSERT(sequence->x_positions != NULL);
+
+    if (trailing != NULL)
+        *trailing = HZ_FALSE;
+
+    if (sequence->length == 0)
+        return 0;
+
+    /* last glyph starting at or before x, the first one if there is none */
+    while (low + 1 < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (sequence->x_positions[mid] <= x)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    hz_caret_cluster_init(&cluster, face, sequence, rtl ? sequence->length - 1 - low : low);
+
+    /* the character whose span holds x, clusters have few of them */
+    for (index = cluster.text_first; index < cluster.text_end; ++index) {
+        hz_caret_cluster_get_span(&cluster, sequence, index, &x0, &x1);
+        if (x >= x0 && x < x1)
+            break;
+    }
+
+    if (index >= cluster.text_end) {
+        /* x is past the edge of the line or the cluster has no character */
+        if (cluster.text_first >= cluster.text_end)
+            return cluster.text_first < sequence->text_length
+                ? sequence->text_offsets[cluster.text_first] : sequence->text_size;
+
+        index = (x < cluster.left) != rtl ? cluster.text_first : cluster.text_end - 1;
+        hz_caret_cluster_get_span(&cluster, sequence, index, &x0, &x1);
+    }
+
+    if (trailing != NULL)
+        *trailing = rtl ? 2 * x < x0 + x1 : 2 * x >= x0 + x1;
+
+    return sequence->text_offsets[index];
+}
+
+int64_t
+hz_sequence_offset_to_x(hz_face_t *face, const hz_sequence_t *sequence, size_t offset, hz_bool_t trailing)
+{
+    hz_bool_t rtl = (sequence->flags & HZ_SEQUENCE_FLAG_RIGHT_TO_LEFT) != 0;
+    hz_caret_cluster_t cluster;
+    size_t index, glyph;
+    int64_t x0, x1;
+
+    HZ_ASSERT(sequence->x_positions != NULL);
+
+    /* an offset inside a character is the character's */
+    index = hz_sequence_text_index(sequence, offset);
+    if (offset < sequence->text_size
+        && (index >= sequence->text_length || sequence->text_offsets[index] > offset))
+        --index;
+
+    /* the end of the text is at the trailing edge of the line */
+    if (index >= sequence->text_length || sequence->length == 0)
+        return rtl ? 0 : sequence->x_positions[sequence->length];
+
+    /* the glyph of the cluster holding the character */
+    glyph = hz_sequence_find_cluster(sequence, (size_t) sequence->text_offsets[index] + 1);
+    hz_caret_cluster_init(&cluster, face, sequence, glyph > 0 ? glyph - 1 : 0);
+    hz_caret_cluster_get_span(&cluster, sequence, index, &x0, &x1);
+
+    return trailing != rtl ? x1 : x0;
+}
+
+void
+hz_sequence_get_positions(const hz_sequence_t *sequence,
+                          const hz_font_t *font,
+                          hz_glyph_position_t *positions)
+{
+    size_t i;
+
+    /* widen first, the scaling pass then runs over contiguous positions */
+    for (i = 0; i < sequence->length; ++i) {
+        positions[i].x_offset = sequence->nodes[i].x_offset;
+        positions[i].y_offset = sequence->nodes[i].y_offset;
+        positions[i].x_advance = sequence->nodes[i].x_advance;
+        positions[i].y_advance = sequence->nodes[i].y_advance;
+    }
+
+    hz_font_scale_positions(font, positions, sequence->length);
+}
+
+hz_shaped_run_t *
+hz_shaped_run_create(hz_face_t *face, const hz_sequence_t *sequence)
+{
+    hz_shaped_run_t *run = HZ_ALLOC(hz_shaped_run_t);
+    size_t count = sequence->length ? sequence->length : 1;
+    size_t i;
+
+    run->face = face;
+    run->length = sequence->length;
+    run->ids = HZ_MALLOC(count * sizeof(hz_index_t));
+    run->clusters = HZ_MALLOC(count * sizeof(uint32_t));
+    run->positions = HZ_MALLOC(count * sizeof(hz_glyph_position_t));
+    run->width = sequence->width;
+
+    for (i = 0; i < sequence->length; ++i) {
+        const hz_sequence_node_t *node = &sequence->nodes[i];
+
+        run->ids[i] = node->id;
+        run->clusters[i] = node->cluster;
+        run->positions[i].x_offset = node->x_offset;
+        run->positions[i].y_offset = node->y_offset;
+        run->positions[i].x_advance = node->x_advance;
+        run->positions[i].y_advance = node->y_advance;
+    }
+
+    return run;
+}
+
+void
+hz_shaped_run_destroy(hz_shaped_run_t *run)
+{
+    HZ_FREE(run->ids);
+    HZ_FREE(run->clusters);
+    HZ_FREE(run->positions);
+    HZ_FREE(run);
+}
+
+hz_shaped_run_t *
+hz_shape_run(hz_context_t *ctx, hz_sequence_t *sequence)
+{
+    hz_shape_full(ctx, sequence);
+    return hz_shaped_run_create(hz_font_get_face(ctx->font), sequence);
+}
+
+void
+hz_shaped_run_instantiate(const hz_shaped_run_t *run,
+                          const hz_font_t *font,
+                          hz_glyph_position_t *positions)
+{
+    HZ_ASSERT(hz_font_get_face(font) == run->face);
+
+    memcpy(positions, run->positions, run->length * sizeof(hz_glyph_position_t));
+    hz_font_scale_positions(font, positions, run->length);
 }
 
 void
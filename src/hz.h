@@ -3,11 +3,14 @@
 
 #include "hz-ot.h"
 #include "hz-script-table.h"
+#include "hz-shape-cache.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct hz_shape_plan_t hz_shape_plan_t;
+
 /*  Struct: hz_context_t
  *      Shaping context structure.
  *
@@ -17,6 +20,14 @@ extern "C" {
  *      language - Language.
  *      dir - Writing direction.
  *      features - Array of wanted features.
+ *      shape_cache - Cache of shaped runs checked before shaping, NULL if none.
+ *      shared_shape_cache - Cache of shaped runs shared with other threads, NULL if none.
+ *      shared_shape_cache_hits - Hits in the shared cache not yet added to its stats.
+ *      shared_shape_cache_misses - Misses in the shared cache not yet added to its stats.
+ *      plan - What shaping precomputes for the face, script, language and features,
+ *      rebuilt when they change, NULL until the first shaping.
+ *      scratch_sequence - Sequence <hz_shape_measure> and <hz_shape_edit> shape in,
+ *      NULL until first used.
  * */
 typedef struct hz_context_t {
     hz_font_t *font;
@@ -24,6 +35,12 @@ typedef struct hz_context_t {
     hz_language_t language;
     hz_direction_t dir;
     hz_array_t *features;
+    hz_shape_cache_t *shape_cache;
+    hz_shared_shape_cache_t *shared_shape_cache;
+    uint32_t shared_shape_cache_hits;
+    uint32_t shared_shape_cache_misses;
+    hz_shape_plan_t *plan;
+    hz_sequence_t *scratch_sequence;
 } hz_context_t;
 
 void
@@ -38,6 +55,35 @@ hz_context_set_language(hz_context_t *ctx, hz_language_t language);
 void
 hz_context_set_direction(hz_context_t *ctx, hz_direction_t dir);
 
+/*  Function: hz_context_set_shape_cache
+ *      Sets the cache <hz_shape_full> checks before shaping and fills after, the
+ *      cache may be shared by contexts and isn't owned by them.
+ *
+ *  Parameters:
+ *      ctx - The shaping context.
+ *      cache - The cache, NULL to shape without one.
+ * */
+void
+hz_context_set_shape_cache(hz_context_t *ctx, hz_shape_cache_t *cache);
+
+/*  Function: hz_context_set_shared_shape_cache
+ *      Sets a cache shared with the contexts of other threads, checked after the
+ *      context's own cache.
+ *
+ *  Parameters:
+ *      ctx - The shaping context.
+ *      cache - The cache, NULL to shape without one.
+ * */
+void
+hz_context_set_shared_shape_cache(hz_context_t *ctx, hz_shared_shape_cache_t *cache);
+
+/*  Function: hz_context_get_plan_id
+ *      Hashes the script, language and features of the context, everything
+ *      besides the face, direction and text that shaping depends on.
+ * */
+uint64_t
+hz_context_get_plan_id(const hz_context_t *ctx);
+
 hz_context_t *
 hz_context_create(hz_font_t *font);
 
@@ -45,7 +91,8 @@ void
 hz_context_destroy(hz_context_t *ctx);
 
 /*  Function: hz_shape_full
- *      Shapes a sequenceion of text.
+ *      Shapes a sequenceion of text, its width is set to the sum of the advances
+ *      of the shaped glyphs.
  *
  *  Parameters:
  *      ctx - The shaping context.
@@ -54,6 +101,161 @@ hz_context_destroy(hz_context_t *ctx);
 void
 hz_shape_full(hz_context_t *ctx, hz_sequence_t *sequence);
 
+/*  Function: hz_shape_measure
+ *      Measures a text the way <hz_shape_full> would shape it, without giving
+ *      the sequence any glyphs. The lookups that can't change advances, mark
+ *      attachment, are skipped.
+ *
+ *  Parameters:
+ *      ctx - The shaping context.
+ *      sequence - Sequence the text was loaded into, its glyphs are left untouched.
+ *      cluster_widths - Array of sequence->text_size widths, NULL if only the total is
+ *      wanted. The advances of every cluster are summed at its offset and the
+ *      other entries are zero.
+ *
+ *  Returns:
+ *      Sum of the advances in font units.
+ * */
+int64_t
+hz_shape_measure(hz_context_t *ctx, const hz_sequence_t *sequence, int64_t *cluster_widths);
+
+/*  Function: hz_shape_edit
+ *      Applies an edit to the text of a shaped sequence and reshapes only the
+ *      glyphs around it. The reshaped range is widened to the nearest glyphs
+ *      the text can safely be broken before, which also bounds it at Arabic
+ *      joins, the glyphs outside of it are kept and their clusters shifted.
+ *      Only the range is shaped, but moving the text and the glyphs after the
+ *      edit and shifting their offsets is still a pass over the rest of the
+ *      sequence.
+ *
+ *  Parameters:
+ *      ctx - The shaping context the sequence was shaped with.
+ *      sequence - The shaped sequence.
+ *      offset - Offset of the first character replaced, in code units of the text.
+ *      removed_length - Number of code units removed.
+ *      inserted - Codepoints inserted at offset.
+ *      inserted_length - Number of codepoints inserted.
+ * */
+void
+hz_shape_edit(hz_context_t *ctx, hz_sequence_t *sequence,
+              size_t offset, size_t removed_length,
+              const hz_unicode_t *inserted, size_t inserted_length);
+
+/*  Function: hz_sequence_x_to_offset
+ *      Hit tests a shaped sequence, like a pointer over the line. The glyph under
+ *      x is found by binary search in the sequence's x_positions, which shaping
+ *      fills when the sequence has HZ_SEQUENCE_FLAG_X_POSITIONS. Characters of a
+ *      ligature split it at the GDEF ligature carets, or evenly if it has none.
+ *
+ *  Parameters:
+ *      face - The face the sequence was shaped with.
+ *      sequence - The shaped sequence.
+ *      x - Position from the left of the line in font units.
+ *      trailing - Set to whether x is past the middle of the character in logical
+ *      order, the caret then goes after it. May be NULL.
+ *
+ *  Returns:
+ *      The offset of the character at x, the nearest one past the edges of the line.
+ * */
+size_t
+hz_sequence_x_to_offset(hz_face_t *face, const hz_sequence_t *sequence, int64_t x, hz_bool_t *trailing);
+
+/*  Function: hz_sequence_offset_to_x
+ *      Places a caret at a character of a shaped sequence, the inverse of
+ *      <hz_sequence_x_to_offset>.
+ *
+ *  Parameters:
+ *      face - The face the sequence was shaped with.
+ *      sequence - The shaped sequence.
+ *      offset - Offset of the character, in code units of the text.
+ *      trailing - Whether the caret goes after the character instead of before it.
+ *
+ *  Returns:
+ *      The caret's position from the left of the line in font units. The end of
+ *      the text is at the end of the line.
+ * */
+int64_t
+hz_sequence_offset_to_x(hz_face_t *face, const hz_sequence_t *sequence, size_t offset, hz_bool_t trailing);
+
+/*  Struct: hz_shaped_run_t
+ *      Result of shaping a sequence, kept in font units so it doesn't depend on
+ *      the size of the font. Any font of the same face instantiates it at its
+ *      own size with <hz_shaped_run_instantiate>.
+ *
+ *  Fields:
+ *      face - Face the run was shaped with.
+ *      length - Number of glyphs.
+ *      ids - Glyph indices.
+ *      clusters - Cluster of every glyph, see <hz_sequence_node_t>.
+ *      positions - Glyph positions in font units.
+ *      width - Sum of the advances in font units.
+ * */
+typedef struct hz_shaped_run_t {
+    hz_face_t *face;
+    size_t length;
+    hz_index_t *ids;
+    uint32_t *clusters;
+    hz_glyph_position_t *positions;
+    int64_t width;
+} hz_shaped_run_t;
+
+/*  Function: hz_shaped_run_create
+ *      Copies the result of shaping a sequence into a size independent run.
+ *
+ *  Parameters:
+ *      face - The face the sequence was shaped with.
+ *      sequence - The shaped sequence.
+ *
+ *  Returns:
+ *      The shaped run.
+ * */
+hz_shaped_run_t *
+hz_shaped_run_create(hz_face_t *face, const hz_sequence_t *sequence);
+
+void
+hz_shaped_run_destroy(hz_shaped_run_t *run);
+
+/*  Function: hz_shape_run
+ *      Shapes a sequence and returns its size independent result, the context's
+ *      font only provides the face.
+ *
+ *  Parameters:
+ *      ctx - The shaping context.
+ *      sequence - The sequence to shape.
+ *
+ *  Returns:
+ *      The shaped run.
+ * */
+hz_shaped_run_t *
+hz_shape_run(hz_context_t *ctx, hz_sequence_t *sequence);
+
+/*  Function: hz_shaped_run_instantiate
+ *      Gets the positions of a shaped run at the size of a font, the font must
+ *      use the face the run was shaped with.
+ *
+ *  Parameters:
+ *      run - The shaped run.
+ *      font - The font giving the scale.
+ *      positions - Array of at least run->length positions to fill.
+ * */
+void
+hz_shaped_run_instantiate(const hz_shaped_run_t *run,
+                          const hz_font_t *font,
+                          hz_glyph_position_t *positions);
+
+/*  Function: hz_sequence_get_positions
+ *      Gets the positions of the shaped glyphs at the font's scale.
+ *
+ *  Parameters:
+ *      sequence - The shaped sequence.
+ *      font - The font giving the scale.
+ *      positions - Array of at least sequence->length positions to fill.
+ * */
+void
+hz_sequence_get_positions(const hz_sequence_t *sequence,
+                          const hz_font_t *font,
+                          hz_glyph_position_t *positions);
+
 hz_set_t *
 hz_context_gather_required_glyphs(hz_context_t *ctx);
 